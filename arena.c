@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+enum {
+  page_shift = 12,
+  page_size = 1 << page_shift,
+  huge_page_size = 2 * 1024 * 1024,
+  slab_pages = 16,
+  free_bin_count = 64,  // runs of 1 to 63 pages, and longer
+  max_slab_object = 16 * 1024,
+  no_page = UINT32_MAX
+};
+
+// Object sizes served from slabs, about 1.5 apart.
+static const uint32_t size_classes[] = {
+  64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+  4096, 6144, 8192, 12288, 16384
+};
+
+enum {
+  class_count = sizeof(size_classes) / sizeof(size_classes[0]),
+  kind_free = -2,
+  kind_extent = -1
+};
+
+// Everything but `head` is only meaningful at the first page of a run.
+struct page_info {
+  uint32_t head;   // first page of the run this page belongs to
+  uint32_t pages;  // length of the run
+  int32_t kind;    // kind_free, kind_extent, or a slab's size class
+  uint32_t free_objects;
+  void* free_list;
+  uint32_t next;   // free runs of a similar length, or slabs of a class with room
+  uint32_t prev;
+};
+
+static char* base;
+static size_t region_size;
+static uint32_t page_count;
+static struct page_info* pages;
+static uint32_t free_runs[free_bin_count];
+static uint32_t partial_slabs[class_count];
+static struct arena_metrics metrics;
+
+int arena_enabled(void) {
+  return base != NULL;
+}
+
+const char* arena_huge_pages_name(enum arena_huge_pages huge_pages) {
+  switch (huge_pages) {
+    case ARENA_HUGE_TRANSPARENT: return "transparent";
+    case ARENA_HUGE_EXPLICIT: return "explicit";
+    default: return "none";
+  }
+}
+
+static void* map_region(size_t size, enum arena_huge_pages* huge_pages) {
+#ifdef MAP_HUGETLB
+  if (*huge_pages == ARENA_HUGE_EXPLICIT) {
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+      return region;
+    }
+  }
+#endif
+  if (*huge_pages == ARENA_HUGE_NONE) {
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return region == MAP_FAILED ? NULL : region;
+  }
+
+  // Transparent huge pages need the region aligned to a huge page, so
+  // map a little more and trim the ends.
+  *huge_pages = ARENA_HUGE_TRANSPARENT;
+  char* region = mmap(NULL, size + huge_page_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    return NULL;
+  }
+  char* aligned = (char*)(((uintptr_t)region + huge_page_size - 1) & ~(uintptr_t)(huge_page_size - 1));
+  if (aligned > region) {
+    munmap(region, aligned - region);
+  }
+  munmap(aligned + size, region + huge_page_size - aligned);
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+#else
+  *huge_pages = ARENA_HUGE_NONE;
+#endif
+  return aligned;
+}
+
+// Give a run to `head` and record its length and kind. Only the first
+// and last pages need to know their run: a pointer into an extent is
+// always to its first page, and a free run finds its neighbours through
+// the pages on either side. Any page of a slab may hold an object, so
+// every page of a slab is marked.
+static void mark_run(uint32_t head, uint32_t length, int32_t kind) {
+  pages[head].head = head;
+  pages[head + length - 1].head = head;
+  if (kind >= 0) {
+    for (uint32_t page = head + 1; page < head + length - 1; ++page) {
+      pages[page].head = head;
+    }
+  }
+  pages[head].pages = length;
+  pages[head].kind = kind;
+}
+
+static int free_bin(uint32_t length) {
+  return length < free_bin_count ? length - 1 : free_bin_count - 1;
+}
+
+static void unlink_free_run(uint32_t run) {
+  struct page_info* info = &pages[run];
+  if (info->prev != no_page) {
+    pages[info->prev].next = info->next;
+  } else {
+    free_runs[free_bin(info->pages)] = info->next;
+  }
+  if (info->next != no_page) {
+    pages[info->next].prev = info->prev;
+  }
+}
+
+// Add a free run to the list for its length, merged with free neighbours.
+static void insert_free_run(uint32_t run, uint32_t length) {
+  const uint32_t after = run + length;
+  if (after < page_count && pages[after].kind == kind_free) {
+    unlink_free_run(after);
+    length += pages[after].pages;
+  }
+  if (run > 0) {
+    const uint32_t before = pages[run - 1].head;
+    if (pages[before].kind == kind_free) {
+      unlink_free_run(before);
+      length += pages[before].pages;
+      run = before;
+    }
+  }
+  mark_run(run, length, kind_free);
+
+  uint32_t* bin = &free_runs[free_bin(length)];
+  pages[run].prev = no_page;
+  pages[run].next = *bin;
+  if (*bin != no_page) {
+    pages[*bin].prev = run;
+  }
+  *bin = run;
+}
+
+int arena_init(size_t size, enum arena_huge_pages huge_pages) {
+  size = (size + huge_page_size - 1) & ~(size_t)(huge_page_size - 1);
+  if (size / page_size >= no_page) {
+    errno = EINVAL;
+    return -1;
+  }
+  pages = calloc(size / page_size, sizeof(*pages));
+  if (!pages) {
+    return -1;
+  }
+  base = map_region(size, &huge_pages);
+  if (!base) {
+    free(pages);
+    pages = NULL;
+    return -1;
+  }
+  region_size = size;
+  page_count = size / page_size;
+  for (int i = 0; i < free_bin_count; ++i) {
+    free_runs[i] = no_page;
+  }
+  for (int i = 0; i < class_count; ++i) {
+    partial_slabs[i] = no_page;
+  }
+  insert_free_run(0, page_count);
+  metrics.size = size;
+  metrics.huge_pages = huge_pages;
+  return 0;
+}
+
+// Take the run from the smallest bin that can hold `length` pages; the
+// last bin holds runs of every larger length, and is searched first-fit.
+static uint32_t alloc_run(uint32_t length, int32_t kind) {
+  uint32_t run = no_page;
+  for (int bin = free_bin(length); bin < free_bin_count && run == no_page; ++bin) {
+    run = free_runs[bin];
+    while (run != no_page && pages[run].pages < length) {
+      run = pages[run].next;
+    }
+  }
+  if (run == no_page) {
+    return no_page;
+  }
+  const uint32_t available = pages[run].pages;
+  unlink_free_run(run);
+  mark_run(run, length, kind);
+  if (available > length) {
+    insert_free_run(run + length, available - length);
+  }
+  metrics.used += (size_t)length * page_size;
+  return run;
+}
+
+static void free_run(uint32_t run) {
+  metrics.used -= (size_t)pages[run].pages * page_size;
+  insert_free_run(run, pages[run].pages);
+}
+
+static void link_partial_slab(uint32_t slab) {
+  const int32_t size_class = pages[slab].kind;
+  pages[slab].prev = no_page;
+  pages[slab].next = partial_slabs[size_class];
+  if (partial_slabs[size_class] != no_page) {
+    pages[partial_slabs[size_class]].prev = slab;
+  }
+  partial_slabs[size_class] = slab;
+}
+
+static void unlink_partial_slab(uint32_t slab) {
+  struct page_info* info = &pages[slab];
+  if (info->prev != no_page) {
+    pages[info->prev].next = info->next;
+  } else {
+    partial_slabs[info->kind] = info->next;
+  }
+  if (info->next != no_page) {
+    pages[info->next].prev = info->prev;
+  }
+}
+
+static uint32_t new_slab(int size_class) {
+  const uint32_t slab = alloc_run(slab_pages, size_class);
+  if (slab == no_page) {
+    return no_page;
+  }
+  const uint32_t object_size = size_classes[size_class];
+  const uint32_t objects = slab_pages * page_size / object_size;
+  char* start = base + ((size_t)slab << page_shift);
+  void* free_list = NULL;
+  for (uint32_t i = objects; i-- > 0;) {
+    void** object = (void**)(start + (size_t)i * object_size);
+    *object = free_list;
+    free_list = object;
+  }
+  pages[slab].free_list = free_list;
+  pages[slab].free_objects = objects;
+  link_partial_slab(slab);
+  metrics.slabs++;
+  return slab;
+}
+
+void* arena_alloc(size_t size) {
+  if (size <= max_slab_object) {
+    int size_class = 0;
+    while (size_classes[size_class] < size) {
+      ++size_class;
+    }
+    uint32_t slab = partial_slabs[size_class];
+    if (slab == no_page && (slab = new_slab(size_class)) == no_page) {
+      metrics.failures++;
+      return NULL;
+    }
+    struct page_info* info = &pages[slab];
+    void** object = info->free_list;
+    info->free_list = *object;
+    if (--info->free_objects == 0) {
+      unlink_partial_slab(slab);
+    }
+    return object;
+  }
+
+  const uint32_t run = alloc_run((size + page_size - 1) >> page_shift, kind_extent);
+  if (run == no_page) {
+    metrics.failures++;
+    return NULL;
+  }
+  metrics.extents++;
+  return base + ((size_t)run << page_shift);
+}
+
+void arena_free(void* pointer) {
+  const uint32_t head = pages[((char*)pointer - base) >> page_shift].head;
+  struct page_info* info = &pages[head];
+  if (info->kind == kind_extent) {
+    metrics.extents--;
+    free_run(head);
+    return;
+  }
+
+  const uint32_t objects = slab_pages * page_size / size_classes[info->kind];
+  *(void**)pointer = info->free_list;
+  info->free_list = pointer;
+  if (info->free_objects++ == 0) {
+    link_partial_slab(head);
+  }
+  if (info->free_objects == objects) {
+    // An empty slab goes back to the page allocator, so that its pages
+    // can serve another size class or a large file.
+    unlink_partial_slab(head);
+    metrics.slabs--;
+    free_run(head);
+  }
+}
+
+void arena_metrics(struct arena_metrics* out) {
+  *out = metrics;
+}
@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// One large anonymous memory region, optionally backed by huge pages,
+// carved up by its own allocator. Keeping thousands of cached files in
+// a few huge pages, rather than scattered over the heap, saves TLB
+// misses when they are sent, and allocating from it takes no locks.
+//
+// The region is divided into 4 KiB pages. Requests of up to 16 KiB are
+// served from slabs: 64 KiB runs of pages cut into objects of one size
+// class, with a free list threaded through the free objects. Larger
+// requests get a run of whole pages (an extent), taken from lists of
+// free runs binned by length. Free runs are coalesced with their
+// neighbours, and an empty slab returns its pages.
+// The arena is only used from one thread.
+
+enum arena_huge_pages {
+  ARENA_HUGE_NONE,
+  ARENA_HUGE_TRANSPARENT,  // madvise(MADV_HUGEPAGE)
+  ARENA_HUGE_EXPLICIT      // MAP_HUGETLB, from the reserved pool
+};
+
+struct arena_metrics {
+  size_t size;
+  size_t used;  // bytes in pages given to extents and slabs
+  unsigned long extents;
+  unsigned long slabs;
+  unsigned long failures;  // requests that did not fit
+  enum arena_huge_pages huge_pages;
+};
+
+// Map a region of `size` bytes. With ARENA_HUGE_EXPLICIT, falls back to
+// transparent huge pages if no huge pages are reserved. Returns -1 with
+// errno set if the region cannot be mapped.
+int arena_init(size_t size, enum arena_huge_pages huge_pages);
+
+int arena_enabled(void);
+
+// Returns NULL if there is no room.
+void* arena_alloc(size_t size);
+
+void arena_free(void* pointer);
+
+void arena_metrics(struct arena_metrics* metrics);
+
+const char* arena_huge_pages_name(enum arena_huge_pages huge_pages);
+
+#endif
@@ -0,0 +1,742 @@
+//
+// bench.c
+//
+// Microbenchmarks for the components on garcon's request path. Each
+// benchmark runs with a doubling iteration count until one run takes at
+// least the minimum time, and the results of that run are written to
+// stdout as JSON so that they can be diffed between builds:
+//
+//   {"benchmarks": [
+//     {"name": "...", "iterations": 1048576, "ns_per_op": 41.2, "allocs_per_op": 1.00},
+//     ...
+//   ]}
+//
+// Benchmarks that replay a request trace through the content cache also
+// report the hit ratio of their last run, and those of the path index
+// the memory it takes for each path, next to the length of the paths.
+//
+// Usage: garcon-bench [-t <min ms per benchmark>] [name filter]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "buffer/buffer.h"
+#include "cmap/map.h"
+#include "../arena.h"
+#include "../cache.h"
+#include "../event_loop.h"
+#include "../hosts.h"
+#include "../http_parser.h"
+#include "../hub.h"
+#include "../path.h"
+#include "../radix.h"
+#include "../response.h"
+#include "../rules.h"
+#include "../timer_wheel.h"
+#include "../watch.h"
+
+// Allocation counting. glibc lets a program replace malloc and friends
+// by defining them, and exports the real implementations under
+// __libc_*, so every allocation made by the code under test (including
+// strdup and stdio) goes through these. Elsewhere allocs_per_op is null.
+
+static unsigned long allocations;
+
+#ifdef __GLIBC__
+#define counting_allocations 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+#else
+#define counting_allocations 0
+#endif
+
+struct benchmark {
+  const char* name;
+  void* (*setup)(void);
+  void (*run)(void* state, size_t iterations);
+  void (*teardown)(void* state);
+};
+
+// Keeps the compiler from discarding results.
+static volatile size_t sink;
+
+// Set by a benchmark to have them reported; negative if there are none.
+static double hit_ratio = -1;
+static double bytes_per_entry = -1;
+static double key_bytes_per_entry = -1;
+
+static const struct tm* bench_time(void) {
+  static struct tm timeinfo;
+  const time_t t = 1419897771; // 2014-12-30T00:02:51Z
+  gmtime_r(&t, &timeinfo);
+  return &timeinfo;
+}
+
+static const char header_line[] = "Access-Control-Allow-Origin: *\r\n";
+
+static void* setup_buffer(void) {
+  return buffer_new();
+}
+
+static void teardown_buffer(void* state) {
+  buffer_free(state);
+}
+
+// Buffers are NUL-terminated strings, so writing a NUL to the first
+// byte empties one without giving back its allocation.
+static void reset_buffer(buffer_t* buffer) {
+  buffer->data[0] = '\0';
+}
+
+static void run_buffer_append_n(void* state, size_t iterations) {
+  buffer_t* buffer = state;
+  for (size_t i = 0; i < iterations; ++i) {
+    reset_buffer(buffer);
+    buffer_append_n(buffer, header_line, sizeof(header_line) - 1);
+  }
+  sink = buffer_length(buffer);
+}
+
+static void run_buffer_appendf(void* state, size_t iterations) {
+  buffer_t* buffer = state;
+  for (size_t i = 0; i < iterations; ++i) {
+    reset_buffer(buffer);
+    buffer_appendf(buffer, "Content-Length: %d\r\n", (int)i);
+  }
+  sink = buffer_length(buffer);
+}
+
+static void run_buffer_set_content_type(void* state, size_t iterations) {
+  buffer_t* buffer = state;
+  for (size_t i = 0; i < iterations; ++i) {
+    reset_buffer(buffer);
+    buffer_set_content_type(buffer, "/assets/v123/app.css");
+  }
+  sink = buffer_length(buffer);
+}
+
+// The headers a typical browser request carries, in the order they
+// arrive. garcon stores every one of them in a map per request.
+static const char* request_headers[][2] = {
+  { "Host", "localhost:8888" },
+  { "Connection", "keep-alive" },
+  { "Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+  { "User-Agent", "Mozilla/5.0 (Macintosh; Intel Mac OS X 10_10_1) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/39.0.2171.95 Safari/537.36" },
+  { "Accept-Encoding", "gzip, deflate, sdch" },
+  { "Accept-Language", "en-US,en;q=0.8" },
+  { "Cache-Control", "max-age=0" },
+  { "Referer", "http://localhost:8888/" }
+};
+
+enum {
+  request_header_count = sizeof(request_headers) / sizeof(request_headers[0])
+};
+
+static void* setup_header_map(void) {
+  struct map_t* map = new_map();
+  map_set_free_func(map, free);
+  for (size_t i = 0; i < request_header_count; ++i) {
+    map_set(map, request_headers[i][0], strdup(request_headers[i][1]));
+  }
+  return map;
+}
+
+static void teardown_header_map(void* state) {
+  struct map_t* map = state;
+  destroy_map(&map);
+}
+
+// One op fills a fresh map with a whole request's headers, the way
+// on_header_field does, and destroys it again.
+static void run_map_set(void* state, size_t iterations) {
+  (void)state;
+  for (size_t i = 0; i < iterations; ++i) {
+    struct map_t* map = new_map();
+    map_set_free_func(map, free);
+    for (size_t h = 0; h < request_header_count; ++h) {
+      map_set(map, request_headers[h][0], strdup(request_headers[h][1]));
+    }
+    sink = map_size(map);
+    destroy_map(&map);
+  }
+}
+
+static void run_map_get(void* state, size_t iterations) {
+  struct map_t* map = state;
+  for (size_t i = 0; i < iterations; ++i) {
+    sink = (size_t)map_get(map, "User-Agent");
+  }
+}
+
+static void run_response_headers(void* state, size_t iterations) {
+  (void)state;
+  const struct tm* timeinfo = bench_time();
+  for (size_t i = 0; i < iterations; ++i) {
+    buffer_t* headers = response_headers(459211, rules_headers(NULL, "assets/v123/app.css", 19),
+        timeinfo, "/assets/v123/app.css");
+    sink = buffer_length(headers);
+    buffer_free(headers);
+  }
+}
+
+// A rules file like a site's: a default, long-lived assets, HTML that is
+// always checked, and a few one-off prefixes and suffixes.
+static void* setup_rules(void) {
+  char path[] = "/tmp/garcon-bench-rules-XXXXXX";
+  const int fd = mkstemp(path);
+  FILE* file = fd == -1 ? NULL : fdopen(fd, "w");
+  if (!file) {
+    perror("rules");
+    exit(EXIT_FAILURE);
+  }
+  fputs("/ Cache-Control: public, max-age=300\n"
+      "/assets/ Cache-Control: public, max-age=31536000, immutable\n"
+      "/assets/v123/ X-Release: 123\n"
+      "/downloads/ Content-Disposition: attachment\n"
+      "/api/ Cache-Control: no-store\n"
+      "*.html Cache-Control: no-cache\n"
+      "*.map Cache-Control: private\n"
+      "*.min.js X-Minified: yes\n", file);
+  fclose(file);
+  struct rules* rules = rules_load(path);
+  unlink(path);
+  if (!rules) {
+    exit(EXIT_FAILURE);
+  }
+  return rules;
+}
+
+static void run_rules_headers(void* state, size_t iterations) {
+  const struct rules* rules = state;
+  static const char path[] = "assets/v123/static/js/main.3f9a2c1b.min.js";
+  for (size_t i = 0; i < iterations; ++i) {
+    sink = (size_t)rules_headers(rules, path, sizeof(path) - 1);
+  }
+}
+
+// Some hundreds of names over a few roots, as a shared host might have.
+static void* setup_hosts(void) {
+  char path[] = "/tmp/garcon-bench-hosts-XXXXXX";
+  const int fd = mkstemp(path);
+  FILE* file = fd == -1 ? NULL : fdopen(fd, "w");
+  if (!file) {
+    perror("hosts");
+    exit(EXIT_FAILURE);
+  }
+  static const char* const roots[] = { "/", "/tmp", "/usr", "/etc" };
+  for (int i = 0; i < 400; ++i) {
+    fprintf(file, "site%d.example.com %s\n", i, roots[i % 4]);
+  }
+  fclose(file);
+  const int loaded = hosts_load(path, NULL);
+  unlink(path);
+  if (loaded == -1) {
+    exit(EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static void run_hosts_find(void* state, size_t iterations) {
+  (void)state;
+  for (size_t i = 0; i < iterations; ++i) {
+    sink = (size_t)hosts_find("Site123.Example.com:8888");
+  }
+}
+
+// Live reload subscribers on one end of socket pairs, whose other ends
+// are drained now and then as a browser would.
+enum { hub_peers = 256 };
+
+struct hub_bench {
+  int peers[hub_peers];
+};
+
+static void* setup_hub(void) {
+  static struct timer_wheel timers;
+  struct event_loop* loop = event_loop_new();
+  if (!loop) {
+    perror("event loop");
+    exit(EXIT_FAILURE);
+  }
+  timer_wheel_init(&timers, 0);
+  hub_init(loop, &timers);
+  struct hub_bench* bench = malloc(sizeof(*bench));
+  if (!bench) {
+    perror("hub");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < hub_peers; ++i) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) == -1) {
+      perror("socketpair");
+      exit(EXIT_FAILURE);
+    }
+    hub_subscribe(pair[0], "");
+    bench->peers[i] = pair[1];
+  }
+  return bench;
+}
+
+static void run_hub_publish(void* state, size_t iterations) {
+  struct hub_bench* bench = state;
+  const struct watch_event event = { WATCH_MODIFIED, "assets/css", "site.css" };
+  char buffer[4096];
+  for (size_t i = 0; i < iterations; ++i) {
+    hub_publish(&event);
+    if (i % 16 == 15) {
+      for (int p = 0; p < hub_peers; ++p) {
+        while (recv(bench->peers[p], buffer, sizeof(buffer), 0) > 0) {
+        }
+      }
+    }
+  }
+}
+
+static void teardown_hub(void* state) {
+  struct hub_bench* bench = state;
+  for (int i = 0; i < hub_peers; ++i) {
+    close(bench->peers[i]);
+  }
+  free(bench);
+}
+
+static void* setup_error_responses(void) {
+  error_responses_init();
+  return NULL;
+}
+
+static void run_error_response(void* state, size_t iterations) {
+  (void)state;
+  size_t length;
+  for (size_t i = 0; i < iterations; ++i) {
+    sink = (size_t)error_response(404, 1419897771, &length) + length;
+  }
+}
+
+// remove_query_string() consumes its argument, so each op includes
+// copying the url into a new buffer.
+static void run_remove_query_string(void* state, size_t iterations) {
+  (void)state;
+  for (size_t i = 0; i < iterations; ++i) {
+    buffer_t* path = buffer_new_with_copy("/assets/v123/app.css?v=1419897771");
+    remove_query_string(&path);
+    sink = buffer_length(path);
+    buffer_free(path);
+  }
+}
+
+static void run_request_path(void* state, size_t iterations) {
+  (void)state;
+  char path[256];
+  for (size_t i = 0; i < iterations; ++i) {
+    sink = request_path("/assets/v123/../v124/app%20main.css?v=1419897771", path, sizeof(path));
+  }
+}
+
+enum { cached_files = 10000 };
+
+static void* setup_cache(void) {
+  cache_init(64 << 20, 4 << 20, CACHE_LRU);
+  for (int i = 0; i < cached_files; ++i) {
+    char path[64];
+    const int length = snprintf(path, sizeof(path), "assets/v123/file%d.css", i);
+    struct cache_entry* entry = cache_entry_new(1024);
+    cache_insert(entry, path, length, cache_generation());
+    cache_entry_release(entry);
+  }
+  return NULL;
+}
+
+// One op is what send_file() does for a hit: look the path up, and
+// release the reference once the response has been sent.
+static void run_cache_lookup(void* state, size_t iterations) {
+  (void)state;
+  static const char path[] = "assets/v123/file4242.css";
+  for (size_t i = 0; i < iterations; ++i) {
+    struct cache_entry* entry = cache_lookup(path, sizeof(path) - 1);
+    sink = entry->length;
+    cache_entry_release(entry);
+  }
+}
+
+// A trace of requests to a site with a hot set of a few thousand small
+// files, asked for with a skewed popularity, while a crawler walks
+// through a much larger tree of cold files, one in every four requests.
+// The cache holds about the hot set, so the hit ratio shows how well
+// each eviction policy keeps it through the crawl.
+enum {
+  hot_files = 2000,
+  crawled_files = 200000,
+  trace_budget = 20 << 20
+};
+
+static void* setup_trace(enum cache_policy policy) {
+  cache_init(trace_budget, 4 << 20, policy);
+  return NULL;
+}
+
+static void* setup_trace_lru(void) {
+  return setup_trace(CACHE_LRU);
+}
+
+static void* setup_trace_clock(void) {
+  return setup_trace(CACHE_CLOCK);
+}
+
+static void* setup_trace_tinylfu(void) {
+  return setup_trace(CACHE_TINYLFU);
+}
+
+static uint64_t trace_random(void) {
+  static uint64_t x = 88172645463325252ull;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+// One op is one request: a lookup, and on a miss, what send_file() does
+// once it has read the file.
+static void run_trace(void* state, size_t iterations) {
+  (void)state;
+  static unsigned long crawled;
+  struct cache_metrics before, after;
+  cache_metrics(&before);
+  for (size_t i = 0; i < iterations; ++i) {
+    const uint64_t r = trace_random();
+    char path[64];
+    int length;
+    size_t size;
+    if ((r & 3) == 0) {
+      const unsigned long file = crawled++ % crawled_files;
+      length = snprintf(path, sizeof(path), "archive/%lu.html", file);
+      size = 2048 + file * 7919 % 16384;
+    } else {
+      const double u = (double)(r >> 11) / (double)(1ull << 53);
+      const int file = (int)(hot_files * u * u);
+      length = snprintf(path, sizeof(path), "assets/%d.css", file);
+      size = 2048 + file * 7919 % 16384;
+    }
+    struct cache_entry* entry = cache_lookup(path, length);
+    if (!entry) {
+      const uint64_t generation = cache_generation();
+      entry = cache_entry_new(size);
+      cache_insert(entry, path, length, generation);
+    }
+    sink = entry->length;
+    cache_entry_release(entry);
+  }
+  cache_metrics(&after);
+  hit_ratio = (double)(after.hits - before.hits) / iterations;
+}
+
+// Churn through cache-sized bodies: one op frees the oldest of 1024 live
+// blocks and allocates a new one, with sizes spread like small assets
+// (a few hundred bytes to 64 KiB).
+enum { live_blocks = 1024 };
+
+static size_t churn_size(size_t i) {
+  return 200 + (i * 2654435761u) % (64 * 1024);
+}
+
+static void* setup_arena(void) {
+  arena_init(256 << 20, ARENA_HUGE_TRANSPARENT);
+  return NULL;
+}
+
+static void run_arena_churn(void* state, size_t iterations) {
+  (void)state;
+  static void* blocks[live_blocks];
+  for (size_t i = 0; i < iterations; ++i) {
+    void** block = &blocks[i % live_blocks];
+    if (*block) {
+      arena_free(*block);
+    }
+    *block = arena_alloc(churn_size(i));
+  }
+}
+
+static void run_malloc_churn(void* state, size_t iterations) {
+  (void)state;
+  static void* blocks[live_blocks];
+  for (size_t i = 0; i < iterations; ++i) {
+    void** block = &blocks[i % live_blocks];
+    free(*block);
+    *block = malloc(churn_size(i));
+  }
+}
+
+// A tree of long paths that share most of their prefixes, like a build's
+// output: versioned directories of sections, each with 64 hashed chunks.
+// One lookup op is what cache_lookup() does with the index; one churn op
+// removes a path and puts it back, as a change notification and the
+// next miss do.
+enum { indexed_paths = 100000 };
+
+static struct radix bench_index;
+static char (*indexed)[128];
+
+static void* setup_radix(void) {
+  indexed = malloc(indexed_paths * sizeof(*indexed));
+  radix_init(&bench_index);
+  size_t key_bytes = 0;
+  for (int i = 0; i < indexed_paths; ++i) {
+    const int length = snprintf(indexed[i], sizeof(indexed[i]),
+        "assets/v%d/static/js/chunks/section-%d/chunk-%d.%08x.js",
+        i % 4, i / 256, i / 4 % 64, (unsigned)(i * 2654435761u));
+    radix_insert(&bench_index, indexed[i], length, indexed[i]);
+    key_bytes += length + 1;
+  }
+  bytes_per_entry = (double)bench_index.bytes / bench_index.count;
+  key_bytes_per_entry = (double)key_bytes / indexed_paths;
+  return NULL;
+}
+
+static void teardown_radix(void* state) {
+  (void)state;
+  radix_clear(&bench_index);
+  free(indexed);
+}
+
+static void run_radix_lookup(void* state, size_t iterations) {
+  (void)state;
+  for (size_t i = 0; i < iterations; ++i) {
+    const char* path = indexed[i * 7919 % indexed_paths];
+    sink = (size_t)radix_find(&bench_index, path, strlen(path));
+  }
+}
+
+static void run_radix_churn(void* state, size_t iterations) {
+  (void)state;
+  for (size_t i = 0; i < iterations; ++i) {
+    char* path = indexed[i * 7919 % indexed_paths];
+    const size_t length = strlen(path);
+    radix_remove(&bench_index, radix_find(&bench_index, path, length));
+    sink = (size_t)radix_insert(&bench_index, path, length, path);
+  }
+}
+
+// stdout is pointed at /dev/null in main(), so this measures the
+// formatting and stdio buffering but not the terminal.
+static void run_log_request(void* state, size_t iterations) {
+  (void)state;
+  struct request request;
+  request.uri = "/assets/v123/app.css";
+  request.user_agent = request_headers[3][1];
+  request.method = "GET";
+  request.client_address = "127.0.0.1";
+  request.time = bench_time();
+  for (size_t i = 0; i < iterations; ++i) {
+    log_request(200, &request);
+  }
+}
+
+// http_parser corpus. Parsing runs with no-op callbacks: the cost of
+// garcon's callbacks is covered by the buffer and map benchmarks.
+
+static const char curl_request[] =
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: localhost:8888\r\n"
+  "User-Agent: curl/7.88.1\r\n"
+  "Accept: */*\r\n"
+  "\r\n";
+
+static const char browser_request[] =
+  "GET /assets/v123/app.css HTTP/1.1\r\n"
+  "Host: localhost:8888\r\n"
+  "Connection: keep-alive\r\n"
+  "Accept: text/css,*/*;q=0.1\r\n"
+  "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_10_1) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/39.0.2171.95 Safari/537.36\r\n"
+  "Referer: http://localhost:8888/\r\n"
+  "Accept-Encoding: gzip, deflate, sdch\r\n"
+  "Accept-Language: en-US,en;q=0.8\r\n"
+  "Cookie: _ga=GA1.1.1419897771.1419897771; session=4f2b1c9a8e7d6c5b4a39281706f5e4d3\r\n"
+  "If-Modified-Since: Sun, 07 Sep 2014 01:37:26 GMT\r\n"
+  "\r\n";
+
+static const char query_request[] =
+  "GET /search/results.html?q=garcon+static+file+server&page=2&sort=date&utm_source=newsletter HTTP/1.1\r\n"
+  "Host: localhost:8888\r\n"
+  "User-Agent: Wget/1.21.3\r\n"
+  "Accept: */*\r\n"
+  "Accept-Encoding: identity\r\n"
+  "\r\n";
+
+static const char probe_request[] =
+  "GET /apple-touch-icon-precomposed.png HTTP/1.1\r\n"
+  "Host: localhost:8888\r\n"
+  "\r\n";
+
+static void run_parser(const char* request, size_t length, size_t iterations) {
+  http_parser_settings settings;
+  memset(&settings, 0, sizeof(settings));
+  http_parser parser;
+  for (size_t i = 0; i < iterations; ++i) {
+    http_parser_init(&parser, HTTP_REQUEST);
+    sink = http_parser_execute(&parser, &settings, request, length);
+  }
+  if (sink != length) {
+    fprintf(stderr, "garcon-bench: parse error: %s\n",
+        http_errno_description(HTTP_PARSER_ERRNO(&parser)));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void run_parser_curl(void* state, size_t iterations) {
+  (void)state;
+  run_parser(curl_request, sizeof(curl_request) - 1, iterations);
+}
+
+static void run_parser_browser(void* state, size_t iterations) {
+  (void)state;
+  run_parser(browser_request, sizeof(browser_request) - 1, iterations);
+}
+
+static void run_parser_query(void* state, size_t iterations) {
+  (void)state;
+  run_parser(query_request, sizeof(query_request) - 1, iterations);
+}
+
+static void run_parser_probe(void* state, size_t iterations) {
+  (void)state;
+  run_parser(probe_request, sizeof(probe_request) - 1, iterations);
+}
+
+static const struct benchmark benchmarks[] = {
+  { "buffer/buffer_append_n", setup_buffer, run_buffer_append_n, teardown_buffer },
+  { "buffer/buffer_appendf", setup_buffer, run_buffer_appendf, teardown_buffer },
+  { "cmap/map_set_request_headers", NULL, run_map_set, NULL },
+  { "cmap/map_get", setup_header_map, run_map_get, teardown_header_map },
+  { "response/buffer_set_content_type", setup_buffer, run_buffer_set_content_type, teardown_buffer },
+  { "response/response_headers", NULL, run_response_headers, NULL },
+  { "response/rules_headers", setup_rules, run_rules_headers, NULL },
+  { "request/hosts_find", setup_hosts, run_hosts_find, NULL },
+  { "hub/publish_256", setup_hub, run_hub_publish, teardown_hub },
+  { "response/error_response", setup_error_responses, run_error_response, NULL },
+  { "response/remove_query_string", NULL, run_remove_query_string, NULL },
+  { "response/log_request", NULL, run_log_request, NULL },
+  { "path/request_path", NULL, run_request_path, NULL },
+  { "cache/lookup_hit", setup_cache, run_cache_lookup, NULL },
+  { "cache/trace_lru", setup_trace_lru, run_trace, NULL },
+  { "cache/trace_clock", setup_trace_clock, run_trace, NULL },
+  { "cache/trace_tinylfu", setup_trace_tinylfu, run_trace, NULL },
+  { "cache/arena_churn", setup_arena, run_arena_churn, NULL },
+  { "cache/malloc_churn", NULL, run_malloc_churn, NULL },
+  { "index/radix_lookup", setup_radix, run_radix_lookup, teardown_radix },
+  { "index/radix_churn", setup_radix, run_radix_churn, teardown_radix },
+  { "http_parser/execute_curl", NULL, run_parser_curl, NULL },
+  { "http_parser/execute_browser", NULL, run_parser_browser, NULL },
+  { "http_parser/execute_query_string", NULL, run_parser_query, NULL },
+  { "http_parser/execute_probe", NULL, run_parser_probe, NULL }
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run_benchmark(FILE* out, const struct benchmark* b, double min_ns, int first) {
+  void* state = b->setup ? b->setup() : NULL;
+
+  // Warm up caches and the allocator.
+  b->run(state, 1);
+
+  size_t iterations = 1;
+  double elapsed = 0;
+  unsigned long allocs = 0;
+  for (;;) {
+    const unsigned long allocs_before = allocations;
+    const double start = now_ns();
+    b->run(state, iterations);
+    elapsed = now_ns() - start;
+    allocs = allocations - allocs_before;
+    if (elapsed >= min_ns) {
+      break;
+    }
+    iterations *= 2;
+  }
+
+  if (b->teardown) {
+    b->teardown(state);
+  }
+
+  fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.2f, ",
+      first ? "" : ",", b->name, iterations, elapsed / iterations);
+  if (hit_ratio >= 0) {
+    fprintf(out, "\"hit_ratio\": %.3f, ", hit_ratio);
+    hit_ratio = -1;
+  }
+  if (bytes_per_entry >= 0) {
+    fprintf(out, "\"bytes_per_entry\": %.1f, \"key_bytes_per_entry\": %.1f, ",
+        bytes_per_entry, key_bytes_per_entry);
+    bytes_per_entry = -1;
+  }
+  if (counting_allocations) {
+    fprintf(out, "\"allocs_per_op\": %.2f}", (double)allocs / iterations);
+  } else {
+    fprintf(out, "\"allocs_per_op\": null}");
+  }
+}
+
+int main(int argc, char **argv) {
+  double min_ms = 100;
+  const char* filter = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      min_ms = strtod(argv[++i], NULL);
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  // log_request() writes to stdout, so keep the real stdout for the
+  // results and point stdout at /dev/null.
+  FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+  if (!out || !freopen("/dev/null", "w", stdout)) {
+    perror("garcon-bench");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(out, "{\"benchmarks\": [");
+  int first = 1;
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+    if (filter && !strstr(benchmarks[i].name, filter)) {
+      continue;
+    }
+    run_benchmark(out, &benchmarks[i], min_ms * 1e6, first);
+    first = 0;
+    fflush(out);
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,595 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bundle.h"
+#include "crawl.h"
+#include "response.h"
+
+// The file starts with a header, then the bodies, then the index:
+//
+//   uint32_t displacements[buckets];
+//   uint32_t slots[slots];          record number, or empty_slot
+//   struct bundle_record records[count];
+//   char strings[strings_size];     NUL-terminated, starting with ""
+//
+// A path's hash picks a bucket, and the bucket's displacement picks the
+// slot that holds its record; the packer chose the displacements so that
+// no two paths share a slot (hash and displace, as in CHD).
+
+static const char magic[8] = "GARCONB";
+
+enum {
+  bundle_version = 2,
+  byte_order_mark = 0x01020304,
+  empty_slot = UINT32_MAX,
+  keys_per_bucket = 4,
+  max_displacement = 1 << 24,
+  body_alignment = 8
+};
+
+struct bundle_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t count;
+  uint32_t buckets;
+  uint32_t slots;
+  uint32_t strings_size;
+  uint64_t index_offset;
+};
+
+struct bundle_record {
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t gzip_offset;
+  uint64_t gzip_length;
+  uint32_t path;  // offsets into the strings
+  uint32_t content_type;
+  uint32_t etag;
+  uint32_t gzip_etag;  // the variant's, a representation of its own
+};
+
+// FNV-1a, finished with MurmurHash3's mixer. It is stored in the bundle,
+// so unlike the server's other tables it cannot be keyed at random; the
+// paths are fixed when the bundle is packed, so there is nothing for a
+// client to collide with.
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t length) {
+  const unsigned char* bytes = data;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+static uint64_t path_hash(const char* path, size_t length) {
+  return fnv1a(0xcbf29ce484222325ull, path, length);
+}
+
+static uint32_t bucket_of(uint64_t hash, uint32_t buckets) {
+  return mix(hash) % buckets;
+}
+
+static uint32_t slot_of(uint64_t hash, uint32_t displacement, uint32_t slots) {
+  return mix(hash + displacement * 0x9e3779b97f4a7c15ull) % slots;
+}
+
+// Packing.
+
+enum {
+  pack_threads = 16
+};
+
+// A bundle being built in `image`, which is big enough for all of it.
+// The files are read in by several threads, each taking the next file
+// from `next`.
+struct build {
+  int root_fd;
+  const struct crawl* crawl;
+  int strict;  // fail if a file cannot be read, rather than leave it out
+  char* image;
+  struct bundle_header* header;
+  uint32_t* displacements;
+  uint32_t* slots;
+  struct bundle_record* records;
+  char* strings;
+  unsigned char* missing;  // files that could not be read
+  crawl_progress progress;
+  size_t next;
+  size_t loaded;
+  uint64_t loaded_bytes;
+  int error;
+  size_t error_file;
+};
+
+static size_t aligned_length(off_t length) {
+  return (length + body_alignment - 1) / body_alignment * body_alignment;
+}
+
+static size_t etag_length(off_t length) {
+  return snprintf(NULL, 0, "\"%016llx-%llx\"", 0ull, (unsigned long long)length);
+}
+
+// Work out where everything in the bundle of the crawl's files goes, and
+// return its size.
+static size_t plan(const struct crawl* crawl, struct bundle_header* header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, magic, sizeof(magic));
+  header->version = bundle_version;
+  header->byte_order = byte_order_mark;
+  header->count = crawl->count;
+
+  size_t offset = sizeof(*header);
+  size_t strings = 1;
+  for (size_t i = 0; i < crawl->count; ++i) {
+    const struct crawl_file* file = &crawl->files[i];
+    const char* type = content_type(file->path);
+    offset += aligned_length(file->length);
+    strings += strlen(file->path) + 1 + (type ? strlen(type) + 1 : 0) +
+      etag_length(file->length) + 1;
+  }
+
+  // About four paths to a bucket, and slots to spare, keep the search
+  // for displacements short.
+  header->buckets = crawl->count / keys_per_bucket + 1;
+  header->slots = crawl->count + crawl->count / 8 + 1;
+  header->strings_size = strings;
+  header->index_offset = offset;
+  return offset + (size_t)header->buckets * sizeof(uint32_t) +
+    (size_t)header->slots * sizeof(uint32_t) +
+    crawl->count * sizeof(struct bundle_record) + strings;
+}
+
+static uint32_t add_string(struct build* build, uint32_t* length, const char* string, size_t size) {
+  memcpy(build->strings + *length, string, size);
+  build->strings[*length + size] = '\0';
+  *length += size + 1;
+  return *length - size - 1;
+}
+
+// Read the file's body into its place in the image and write its ETag,
+// which is a hash of the body and its length.
+static int load_body(struct build* build, size_t i) {
+  const struct crawl_file* file = &build->crawl->files[i];
+  struct bundle_record* record = &build->records[i];
+  const int in = openat(build->root_fd, file->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (in == -1) {
+    return -1;
+  }
+  char* body = build->image + record->offset;
+  off_t copied = 0;
+  while (copied < file->length) {
+    const ssize_t n = pread(in, body + copied, file->length - copied, copied);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Shorter than when the crawl found it.
+      errno = n == 0 ? EAGAIN : errno;
+      break;
+    }
+    copied += n;
+  }
+  const int error = errno;
+  close(in);
+  if (copied != file->length) {
+    errno = error;
+    return -1;
+  }
+  const uint64_t etag = mix(fnv1a(0xcbf29ce484222325ull, body, file->length));
+  snprintf(build->strings + record->etag, etag_length(file->length) + 1,
+      "\"%016llx-%llx\"", (unsigned long long)etag, (unsigned long long)file->length);
+  return 0;
+}
+
+static void load_bodies(void* argument) {
+  struct build* build = argument;
+  for (;;) {
+    const size_t i = __atomic_fetch_add(&build->next, 1, __ATOMIC_RELAXED);
+    if (i >= build->crawl->count || __atomic_load_n(&build->error, __ATOMIC_RELAXED)) {
+      return;
+    }
+    if (load_body(build, i) == -1) {
+      if (build->strict) {
+        build->error_file = i;
+        __atomic_store_n(&build->error, errno ? errno : EIO, __ATOMIC_RELAXED);
+        return;
+      }
+      build->missing[i] = 1;
+      continue;
+    }
+    __atomic_fetch_add(&build->loaded, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&build->loaded_bytes, build->crawl->files[i].length, __ATOMIC_RELAXED);
+  }
+}
+
+static void load_tick(void* argument) {
+  struct build* build = argument;
+  build->progress(__atomic_load_n(&build->loaded, __ATOMIC_RELAXED),
+      __atomic_load_n(&build->loaded_bytes, __ATOMIC_RELAXED));
+}
+
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(((const struct crawl_file*)a)->path, ((const struct crawl_file*)b)->path);
+}
+
+struct bucket {
+  uint32_t number;
+  uint32_t size;
+  uint32_t* files;
+};
+
+static int compare_bucket_sizes(const void* a, const void* b) {
+  return (int)((const struct bucket*)b)->size - (int)((const struct bucket*)a)->size;
+}
+
+// Choose a displacement for each bucket, biggest first, so that every
+// file that was read lands in a slot of its own.
+static int build_index(struct build* build) {
+  const uint32_t count = build->header->count;
+  const uint32_t buckets = build->header->buckets;
+  const uint32_t slot_count = build->header->slots;
+  const struct bundle_record* records = build->records;
+  uint32_t* slots = build->slots;
+  struct bucket* table = calloc(buckets, sizeof(*table));
+  uint32_t* members = malloc((count + 1) * sizeof(*members));
+  uint32_t* positions = malloc((count + 1) * sizeof(*positions));
+  if (!table || !members || !positions) {
+    free(table);
+    free(members);
+    free(positions);
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!build->missing[i]) {
+      table[bucket_of(records[i].hash, buckets)].size++;
+    }
+  }
+  uint32_t next = 0;
+  for (uint32_t b = 0; b < buckets; ++b) {
+    table[b].number = b;
+    table[b].files = members + next;
+    next += table[b].size;
+    table[b].size = 0;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!build->missing[i]) {
+      struct bucket* bucket = &table[bucket_of(records[i].hash, buckets)];
+      bucket->files[bucket->size++] = i;
+    }
+  }
+  qsort(table, buckets, sizeof(*table), compare_bucket_sizes);
+
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    slots[i] = empty_slot;
+  }
+  int result = 0;
+  for (uint32_t b = 0; b < buckets && table[b].size > 0 && result == 0; ++b) {
+    const struct bucket* bucket = &table[b];
+    uint32_t displacement = 0;
+    for (;; ++displacement) {
+      if (displacement == max_displacement) {
+        errno = EDOM;
+        result = -1;
+        break;
+      }
+      uint32_t placed = 0;
+      for (; placed < bucket->size; ++placed) {
+        const uint32_t slot = slot_of(records[bucket->files[placed]].hash, displacement, slot_count);
+        if (slots[slot] != empty_slot) {
+          break;
+        }
+        slots[slot] = bucket->files[placed];
+        positions[placed] = slot;
+      }
+      if (placed == bucket->size) {
+        break;
+      }
+      while (placed-- > 0) {
+        slots[positions[placed]] = empty_slot;
+      }
+    }
+    build->displacements[bucket->number] = displacement;
+  }
+  free(table);
+  free(members);
+  free(positions);
+  return result;
+}
+
+// Build the bundle planned in `header` in `image`. Returns 0, or -1 with
+// errno set.
+static int build_bundle(struct build* build, const struct bundle_header* header, int threads) {
+  const struct crawl* crawl = build->crawl;
+  build->header = (struct bundle_header*)build->image;
+  *build->header = *header;
+  build->displacements = (uint32_t*)(build->image + header->index_offset);
+  build->slots = build->displacements + header->buckets;
+  build->records = (struct bundle_record*)(build->slots + header->slots);
+  build->strings = (char*)(build->records + header->count);
+
+  // Lay out the bodies and the strings, leaving room for the ETags.
+  uint64_t offset = sizeof(*header);
+  uint32_t strings = 0;
+  add_string(build, &strings, "", 0);
+  for (size_t i = 0; i < crawl->count; ++i) {
+    const struct crawl_file* file = &crawl->files[i];
+    struct bundle_record* record = &build->records[i];
+    const char* type = content_type(file->path);
+    const size_t path_length = strlen(file->path);
+    memset(record, 0, sizeof(*record));
+    record->hash = path_hash(file->path, path_length);
+    record->offset = offset;
+    record->length = file->length;
+    record->path = add_string(build, &strings, file->path, path_length);
+    record->content_type = type ? add_string(build, &strings, type, strlen(type)) : 0;
+    record->etag = strings;
+    strings += etag_length(file->length) + 1;
+    offset += aligned_length(file->length);
+  }
+
+  if (crawl_run(threads, load_bodies, build->progress ? load_tick : NULL, build) == -1) {
+    return -1;
+  }
+  if (build->error) {
+    errno = build->error;
+    return -1;
+  }
+
+  // A file with a ".gz" next to it is sent compressed to clients that
+  // accept gzip. The variant is the other file's body.
+  for (size_t i = 0; i < crawl->count; ++i) {
+    char compressed[PATH_MAX];
+    snprintf(compressed, sizeof(compressed), "%s.gz", crawl->files[i].path);
+    const struct crawl_file key = { compressed, 0 };
+    const struct crawl_file* variant =
+      bsearch(&key, crawl->files, crawl->count, sizeof(*crawl->files), compare_paths);
+    if (variant && !build->missing[variant - crawl->files]) {
+      const struct bundle_record* record = &build->records[variant - crawl->files];
+      build->records[i].gzip_offset = record->offset;
+      build->records[i].gzip_length = record->length;
+      build->records[i].gzip_etag = record->etag;
+    }
+  }
+
+  return build_index(build);
+}
+
+int bundle_pack(const char* directory, const char* path) {
+  const int root_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct crawl crawl;
+  if (root_fd == -1 || crawl_tree(root_fd, pack_threads, -1, &crawl, NULL) == -1) {
+    fprintf(stderr, "Cannot read %s: %s\n", directory, strerror(errno));
+    return -1;
+  }
+  if (crawl.count == 0 || crawl.count >= UINT32_MAX / 2) {
+    fprintf(stderr, "No files to pack in %s\n", directory);
+    return -1;
+  }
+
+  struct bundle_header header;
+  const size_t size = plan(&crawl, &header);
+  const int out = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out == -1 || ftruncate(out, size) == -1) {
+    fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  void* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+  struct build build;
+  memset(&build, 0, sizeof(build));
+  build.root_fd = root_fd;
+  build.crawl = &crawl;
+  build.strict = 1;
+  build.image = image;
+  build.missing = calloc(crawl.count, 1);
+  if (image == MAP_FAILED || !build.missing) {
+    fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (build_bundle(&build, &header, pack_threads) == -1) {
+    if (build.error) {
+      fprintf(stderr, "Cannot pack %s/%s: %s\n", directory,
+          crawl.files[build.error_file].path,
+          build.error == EAGAIN ? "file changed" : strerror(build.error));
+    } else {
+      fprintf(stderr, "Cannot pack %s: %s\n", directory,
+          errno == EDOM ? "no perfect hash found" : strerror(errno));
+    }
+    return -1;
+  }
+  if (munmap(image, size) == -1 || close(out) == -1) {
+    fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  printf("Packed %zu files, %ju bytes, into %s\n", crawl.count,
+      (uintmax_t)header.index_offset, path);
+  free(build.missing);
+  crawl_free(&crawl);
+  close(root_fd);
+  return 0;
+}
+
+int bundle_load(int root_fd, const struct crawl* crawl, int threads,
+    crawl_progress progress, struct bundle* bundle) {
+  if (crawl->count >= UINT32_MAX / 2) {
+    errno = EFBIG;
+    return -1;
+  }
+  struct bundle_header header;
+  const size_t size = plan(crawl, &header);
+  char* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (image == MAP_FAILED) {
+    return -1;
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(image, size, MADV_HUGEPAGE);
+#endif
+  struct build build;
+  memset(&build, 0, sizeof(build));
+  build.root_fd = root_fd;
+  build.crawl = crawl;
+  build.image = image;
+  build.progress = progress;
+  build.missing = calloc(crawl->count + 1, 1);
+  if (!build.missing || build_bundle(&build, &header, threads) == -1 ||
+      mprotect(image, size, PROT_READ) == -1 || bundle_attach(bundle, image, size) == -1) {
+    const int error = errno;
+    free(build.missing);
+    munmap(image, size);
+    errno = error;
+    return -1;
+  }
+
+  // The files that could not be read stay out of the index; they are
+  // already, in effect, stale.
+  bundle->stale = build.missing;
+  return 0;
+}
+
+// Serving.
+
+int bundle_attach(struct bundle* bundle, const void* data, size_t size) {
+  const struct bundle_header* header = data;
+  if (size < sizeof(*header) || memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+      header->version != bundle_version || header->byte_order != byte_order_mark ||
+      header->buckets == 0 || header->slots == 0 || header->index_offset > size) {
+    return -1;
+  }
+  const uint64_t index_size = (uint64_t)header->buckets * sizeof(uint32_t) +
+    (uint64_t)header->slots * sizeof(uint32_t) +
+    (uint64_t)header->count * sizeof(struct bundle_record) + header->strings_size;
+  if (index_size != size - header->index_offset) {
+    return -1;
+  }
+  const char* strings = (const char*)data + size - header->strings_size;
+  if (header->strings_size == 0 || strings[header->strings_size - 1] != '\0') {
+    return -1;
+  }
+  // Check every record once, so that serving never reads past a body or
+  // the end of the strings of a bundle that is corrupt.
+  const struct bundle_record* records = (const struct bundle_record*)(strings -
+      (uint64_t)header->count * sizeof(struct bundle_record));
+  for (uint32_t i = 0; i < header->count; ++i) {
+    const struct bundle_record* record = &records[i];
+    if (record->offset > header->index_offset ||
+        record->length > header->index_offset - record->offset ||
+        record->gzip_offset > header->index_offset ||
+        record->gzip_length > header->index_offset - record->gzip_offset ||
+        record->path >= header->strings_size ||
+        record->content_type >= header->strings_size ||
+        record->etag >= header->strings_size ||
+        record->gzip_etag >= header->strings_size) {
+      return -1;
+    }
+  }
+  bundle->map = data;
+  bundle->size = size;
+  bundle->fd = -1;
+  bundle->stale = NULL;
+  bundle->header = header;
+  bundle->displacements = (const uint32_t*)(bundle->map + header->index_offset);
+  bundle->slots = bundle->displacements + header->buckets;
+  bundle->records = (const struct bundle_record*)(bundle->slots + header->slots);
+  bundle->strings = (const char*)(bundle->records + header->count);
+  return 0;
+}
+
+int bundle_open(struct bundle* bundle, const char* path) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat stat;
+  if (fd == -1 || fstat(fd, &stat) == -1) {
+    fprintf(stderr, "Cannot open bundle %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  const size_t size = stat.st_size;
+  void* map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (map == MAP_FAILED || bundle_attach(bundle, map, size) == -1) {
+    fprintf(stderr, "%s is not a bundle made by this version of garcon on this kind of machine\n", path);
+    if (map != MAP_FAILED) {
+      munmap(map, size);
+    }
+    close(fd);
+    return -1;
+  }
+  bundle->fd = fd;
+
+  // Keep the index in memory; the bodies are paged in as they are sent.
+  madvise((char*)map + (bundle->header->index_offset & ~(uint64_t)4095),
+      size - (bundle->header->index_offset & ~(uint64_t)4095), MADV_WILLNEED);
+  return 0;
+}
+
+size_t bundle_count(const struct bundle* bundle) {
+  return bundle->header ? bundle->header->count : 0;
+}
+
+int bundle_lookup(const struct bundle* bundle, const char* path, size_t length,
+    struct bundle_file* file) {
+  const struct bundle_header* header = bundle->header;
+  const uint64_t hash = path_hash(path, length);
+  const uint32_t displacement = bundle->displacements[bucket_of(hash, header->buckets)];
+  const uint32_t slot = bundle->slots[slot_of(hash, displacement, header->slots)];
+  if (slot == empty_slot || slot >= header->count || (bundle->stale && bundle->stale[slot])) {
+    return 0;
+  }
+  const struct bundle_record* record = &bundle->records[slot];
+  if (record->hash != hash || strcmp(bundle->strings + record->path, path) != 0) {
+    return 0;
+  }
+  file->offset = record->offset;
+  file->length = record->length;
+  file->gzip_offset = record->gzip_offset;
+  file->gzip_length = record->gzip_length;
+  file->content_type = record->content_type ? bundle->strings + record->content_type : NULL;
+  file->etag = bundle->strings + record->etag;
+  file->gzip_etag = bundle->strings + record->gzip_etag;
+  return 1;
+}
+
+// Find the record for `path`, whether or not it is stale.
+static const struct bundle_record* find_record(const struct bundle* bundle, const char* path) {
+  const struct bundle_header* header = bundle->header;
+  const uint64_t hash = path_hash(path, strlen(path));
+  const uint32_t displacement = bundle->displacements[bucket_of(hash, header->buckets)];
+  const uint32_t slot = bundle->slots[slot_of(hash, displacement, header->slots)];
+  if (slot == empty_slot || slot >= header->count) {
+    return NULL;
+  }
+  const struct bundle_record* record = &bundle->records[slot];
+  return record->hash == hash && strcmp(bundle->strings + record->path, path) == 0 ?
+    record : NULL;
+}
+
+void bundle_invalidate(struct bundle* bundle, const char* path) {
+  const struct bundle_record* record = find_record(bundle, path);
+  if (record && bundle->stale) {
+    bundle->stale[record - bundle->records] = 1;
+  }
+}
+
+void bundle_invalidate_tree(struct bundle* bundle, const char* directory) {
+  const size_t length = strlen(directory);
+  for (uint32_t i = 0; bundle->stale && i < bundle->header->count; ++i) {
+    const char* path = bundle->strings + bundle->records[i].path;
+    if (length == 0 || (strncmp(path, directory, length) == 0 && path[length] == '/')) {
+      bundle->stale[i] = 1;
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "crawl.h"
+
+// A bundle is a document root packed into a single file by `garcon pack
+// <directory> <bundle>`, so that a site can be deployed as one file and
+// served without asking the filesystem anything per request.
+//
+// The file holds the bodies, followed by an index: a perfect hash from
+// each path to a record of where its body is, its content type and ETag,
+// and where a precompressed variant is, if the directory had a `.gz`
+// file next to it. The whole bundle is mapped into memory, so a lookup
+// is a hash and two probes, and bodies are sent with sendfile() from the
+// bundle's descriptor. A bundle can also be built into the binary (`make
+// embed`), and is then served from memory. Bundles are in the packing
+// machine's byte order.
+
+struct bundle_header;
+struct bundle_record;
+
+struct bundle_file {
+  off_t offset;  // of the body in the bundle
+  off_t length;
+  off_t gzip_offset;
+  off_t gzip_length;  // 0 if there is no precompressed variant
+  const char* content_type;  // NULL if unknown
+  const char* etag;          // with its quotes
+  const char* gzip_etag;     // the precompressed variant's
+};
+
+struct bundle {
+  const char* map;
+  size_t size;
+  int fd;  // -1 for a bundle built into the binary
+  const struct bundle_header* header;
+  const uint32_t* displacements;
+  const uint32_t* slots;
+  const struct bundle_record* records;
+  const char* strings;
+  unsigned char* stale;  // by record, for a bundle loaded from a directory
+};
+
+// Write the regular files under `directory` to a bundle at `path`.
+// Returns 0, or -1 after reporting the problem on stderr.
+int bundle_pack(const char* directory, const char* path);
+
+// Map the bundle at `path` for serving. Returns -1 after reporting the
+// problem on stderr.
+int bundle_open(struct bundle* bundle, const char* path);
+
+// Pack the files found by crawl_tree() under `root_fd` into a bundle in
+// memory, reading them with `threads` threads, and serve it. The memory
+// is made read-only once the bundle is built. Files that cannot be read
+// are left out. Returns 0, or -1 with errno set.
+int bundle_load(int root_fd, const struct crawl* crawl, int threads,
+    crawl_progress progress, struct bundle* bundle);
+
+// Serve the bundle in the `size` bytes at `data`, which must stay put
+// and be aligned to 8 bytes. Returns -1 if it is not a bundle.
+int bundle_attach(struct bundle* bundle, const void* data, size_t size);
+
+// The number of files in the bundle.
+size_t bundle_count(const struct bundle* bundle);
+
+// Find `path` (as made by request_path()). Returns 1 and fills in `file`
+// if it is in the bundle, or 0.
+int bundle_lookup(const struct bundle* bundle, const char* path, size_t length,
+    struct bundle_file* file);
+
+// Stop serving `path`, or everything under `directory` ("" for all of
+// it), from a bundle made by bundle_load() because the files changed.
+void bundle_invalidate(struct bundle* bundle, const char* path);
+void bundle_invalidate_tree(struct bundle* bundle, const char* directory);
+
+#endif
@@ -0,0 +1,575 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "cache.h"
+#include "hash.h"
+#include "radix.h"
+
+// Entries are kept on lists, most recently used first. LRU and CLOCK
+// keep every entry on `main`. W-TinyLFU admits new entries to a small
+// LRU `window`, and lets one that falls out of it into the main space
+// only if it has been asked for more often than the entry it would
+// push out. The main space is a segmented LRU: entries start on
+// `probation` and move to `protected` when they are hit again.
+enum {
+  segment_window,
+  segment_probation,
+  segment_protected,
+  segment_count,
+  segment_main = segment_probation
+};
+
+struct segment {
+  struct cache_entry head;
+  size_t bytes;
+};
+
+// The entries by path. Each entry holds its key's node, so it is removed
+// without a lookup, and a directory's entries are a prefix of the trie.
+static struct radix paths;
+static uint64_t hash_key[2];
+
+static struct segment segments[segment_count];
+static struct cache_entry* hand;  // CLOCK's next candidate on `main`
+
+static enum cache_policy policy;
+static size_t budget;
+static size_t window_budget;
+static size_t protected_budget;
+static size_t max_entry;
+static uint64_t generation;
+static struct cache_metrics metrics;
+
+// W-TinyLFU's record of how often each path has been asked for: a
+// count-min sketch of four 4-bit counters per path, packed 16 to a
+// word. A Bloom filter, the doorkeeper, absorbs the first request for
+// each path, so that the many paths asked for once (a crawler's) never
+// reach the sketch. Every `sample_size` requests the counters are
+// halved and the doorkeeper cleared, so that old popularity fades.
+static uint64_t* sketch;
+static size_t counter_mask;
+static uint64_t* doorkeeper;
+static size_t doorkeeper_mask;
+static size_t sample_size;
+static size_t samples;
+
+static const char* const policy_names[] = { "lru", "clock", "tinylfu" };
+
+static size_t round_up_pow2(size_t n) {
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+
+const char* cache_policy_name(enum cache_policy p) {
+  return policy_names[p];
+}
+
+int cache_policy_parse(const char* name, enum cache_policy* out) {
+  for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); ++i) {
+    if (strcmp(name, policy_names[i]) == 0) {
+      *out = (enum cache_policy)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static size_t counter_index(uint64_t hash, int row) {
+  const uint64_t h = (hash + row * ((hash >> 32) | 1)) * 0x9e3779b97f4a7c15ull;
+  return (h >> 32) & counter_mask;
+}
+
+static unsigned counter(size_t index) {
+  return (sketch[index >> 4] >> ((index & 15) << 2)) & 15;
+}
+
+// Set the doorkeeper's bits for `hash`, returning whether they all were.
+static int doorkeeper_check_and_set(uint64_t hash) {
+  const size_t bits[2] = { hash & doorkeeper_mask, (hash >> 32) & doorkeeper_mask };
+  int present = 1;
+  for (int i = 0; i < 2; ++i) {
+    const uint64_t bit = (uint64_t)1 << (bits[i] & 63);
+    present &= (doorkeeper[bits[i] >> 6] & bit) != 0;
+    doorkeeper[bits[i] >> 6] |= bit;
+  }
+  return present;
+}
+
+static int doorkeeper_contains(uint64_t hash) {
+  const size_t bits[2] = { hash & doorkeeper_mask, (hash >> 32) & doorkeeper_mask };
+  for (int i = 0; i < 2; ++i) {
+    if (!(doorkeeper[bits[i] >> 6] & ((uint64_t)1 << (bits[i] & 63)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static unsigned frequency(uint64_t hash) {
+  unsigned result = 15;
+  for (int row = 0; row < 4; ++row) {
+    const unsigned count = counter(counter_index(hash, row));
+    result = count < result ? count : result;
+  }
+  return result + doorkeeper_contains(hash);
+}
+
+static void record_access(uint64_t hash) {
+  if (policy != CACHE_TINYLFU) {
+    return;
+  }
+  if (doorkeeper_check_and_set(hash)) {
+    for (int row = 0; row < 4; ++row) {
+      const size_t index = counter_index(hash, row);
+      if (counter(index) < 15) {
+        sketch[index >> 4] += (uint64_t)1 << ((index & 15) << 2);
+      }
+    }
+  }
+
+  if (++samples >= sample_size) {
+    for (size_t i = 0; i <= counter_mask >> 4; ++i) {
+      sketch[i] = (sketch[i] >> 1) & 0x7777777777777777ull;
+    }
+    memset(doorkeeper, 0, (doorkeeper_mask + 1) / 8);
+    samples /= 2;
+  }
+}
+
+static void remove_entry(struct cache_entry* entry);
+
+int cache_init(size_t budget_bytes, size_t max_entry_bytes, enum cache_policy eviction) {
+  // Start over if called again, as the benchmarks do.
+  if (sketch) {
+    cache_invalidate_tree("");
+    radix_clear(&paths);
+    free(sketch);
+    free(doorkeeper);
+  }
+
+  policy = eviction;
+  budget = budget_bytes;
+  window_budget = budget / 100;
+  protected_budget = (budget - window_budget) / 5 * 4;
+  max_entry = max_entry_bytes < budget_bytes ? max_entry_bytes : budget_bytes;
+  for (int i = 0; i < segment_count; ++i) {
+    segments[i].head.prev = segments[i].head.next = &segments[i].head;
+    segments[i].bytes = 0;
+  }
+  hand = &segments[segment_main].head;
+  memset(&metrics, 0, sizeof(metrics));
+
+  // The sketch has four counters, and the doorkeeper eight bits, for
+  // every file of 4 KiB or more that could fit.
+  const size_t buckets = round_up_pow2(budget / 4096 < 64 ? 64 : budget / 4096);
+  radix_init(&paths);
+  sketch = calloc(buckets * 4 / 16, sizeof(*sketch));
+  doorkeeper = calloc(buckets * 8 / 64, sizeof(*doorkeeper));
+  if (!sketch || !doorkeeper) {
+    free(sketch);
+    free(doorkeeper);
+    sketch = NULL;
+    doorkeeper = NULL;
+    return -1;
+  }
+  counter_mask = buckets * 4 - 1;
+  doorkeeper_mask = buckets * 8 - 1;
+  sample_size = buckets * 10;
+  samples = 0;
+  hash_random_key(hash_key, 2);
+  return 0;
+}
+
+int cache_admits(off_t length) {
+  return sketch && length > 0 && (size_t)length <= max_entry;
+}
+
+static void unlink_entry(struct cache_entry* entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  segments[entry->segment].bytes -= entry->length;
+}
+
+// Link `entry` into `segment` just before `position`.
+static void link_before(struct cache_entry* position, struct cache_entry* entry, int segment) {
+  entry->next = position;
+  entry->prev = position->prev;
+  position->prev->next = entry;
+  position->prev = entry;
+  entry->segment = segment;
+  segments[segment].bytes += entry->length;
+}
+
+static void push_front(struct cache_entry* entry, int segment) {
+  link_before(segments[segment].head.next, entry, segment);
+}
+
+static struct cache_entry* tail(int segment) {
+  struct cache_entry* entry = segments[segment].head.prev;
+  return entry == &segments[segment].head ? NULL : entry;
+}
+
+// A hit in W-TinyLFU's main space protects the entry, and the protected
+// segment's least recently used entries go back on probation if that
+// takes it over its share.
+static void promote(struct cache_entry* entry) {
+  unlink_entry(entry);
+  if (entry->segment == segment_window) {
+    push_front(entry, segment_window);
+    return;
+  }
+  push_front(entry, segment_protected);
+  while (segments[segment_protected].bytes > protected_budget) {
+    struct cache_entry* demoted = tail(segment_protected);
+    unlink_entry(demoted);
+    push_front(demoted, segment_probation);
+  }
+}
+
+struct cache_entry* cache_lookup(const char* path, size_t length) {
+  const uint64_t hash = siphash(path, length, hash_key);
+  record_access(hash);
+  struct radix_node* node = radix_find(&paths, path, length);
+  if (node) {
+    struct cache_entry* entry = node->value;
+    switch (policy) {
+      case CACHE_LRU:
+        unlink_entry(entry);
+        push_front(entry, segment_main);
+        break;
+      case CACHE_CLOCK:
+        entry->referenced = 1;
+        break;
+      case CACHE_TINYLFU:
+        promote(entry);
+        break;
+    }
+    entry->refs++;
+    metrics.hits++;
+    return entry;
+  }
+  return NULL;
+}
+
+void cache_miss(void) {
+  metrics.misses++;
+}
+
+// CLOCK sweeps `main` from its most recent end, giving each entry that
+// has been hit since the hand last passed a second chance.
+static struct cache_entry* clock_victim(void) {
+  struct cache_entry* head = &segments[segment_main].head;
+  for (;;) {
+    if (hand == head) {
+      hand = head->next;
+      if (hand == head) {
+        return NULL;
+      }
+    }
+    if (!hand->referenced) {
+      return hand;
+    }
+    hand->referenced = 0;
+    hand = hand->next;
+  }
+}
+
+// Evict the entry the policy thinks least useful. Returns 0 if the
+// cache is empty.
+static int evict_one(void) {
+  struct cache_entry* victim = NULL;
+  switch (policy) {
+    case CACHE_LRU:
+      victim = tail(segment_main);
+      break;
+    case CACHE_CLOCK:
+      victim = clock_victim();
+      break;
+    case CACHE_TINYLFU:
+      victim = tail(segment_probation);
+      if (!victim) {
+        victim = tail(segment_protected);
+      }
+      if (!victim) {
+        victim = tail(segment_window);
+      }
+      break;
+  }
+  if (!victim) {
+    return 0;
+  }
+  remove_entry(victim);
+  metrics.evictions++;
+  return 1;
+}
+
+// Evict the entry of `quota` that the policy would reach first, looking
+// from the least useful end of each list in turn. Returns 0 if it has
+// none in the cache.
+static int evict_within(const struct cache_quota* quota) {
+  static const int order[] = { segment_probation, segment_protected, segment_window };
+  for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); ++i) {
+    const struct cache_entry* head = &segments[order[i]].head;
+    for (struct cache_entry* entry = head->prev; entry != head; entry = entry->prev) {
+      if (entry->quota == quota) {
+        remove_entry(entry);
+        metrics.evictions++;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// With an arena, an entry and its body are a single allocation from it.
+// When the arena is full, entries are evicted until the new one fits; if
+// it still does not, because the evicted bodies are still being sent, it
+// comes from the heap instead and is not cached.
+static struct cache_entry* arena_entry_new(off_t length) {
+  const size_t size = sizeof(struct cache_entry) + length;
+  struct cache_entry* entry;
+  while (!(entry = arena_alloc(size)) && evict_one()) {
+  }
+  if (entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->data = (char*)(entry + 1);
+    entry->in_arena = 1;
+  }
+  return entry;
+}
+
+struct cache_entry* cache_entry_new(off_t length) {
+  if (arena_enabled() && cache_admits(length)) {
+    struct cache_entry* entry = arena_entry_new(length);
+    if (entry) {
+      entry->length = length;
+      entry->refs = 1;
+      return entry;
+    }
+  }
+
+  struct cache_entry* entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    return NULL;
+  }
+  entry->data = malloc(length ? length : 1);
+  if (!entry->data) {
+    free(entry);
+    return NULL;
+  }
+  entry->length = length;
+  entry->refs = 1;
+  return entry;
+}
+
+struct cache_entry* cache_entry_adopt(char* data, off_t length) {
+  struct cache_entry* entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    free(data);
+    return NULL;
+  }
+  entry->data = data;
+  entry->length = length;
+  entry->refs = 1;
+  return entry;
+}
+
+void cache_entry_retain(struct cache_entry* entry) {
+  entry->refs++;
+}
+
+void cache_entry_release(struct cache_entry* entry) {
+  if (--entry->refs == 0 && entry->in_arena) {
+    arena_free(entry);
+  } else if (entry->refs == 0) {
+    free(entry->data);
+    free(entry);
+  }
+}
+
+uint64_t cache_generation(void) {
+  return generation;
+}
+
+static void remove_entry(struct cache_entry* entry) {
+  if (entry->quota) {
+    entry->quota->bytes -= entry->length;
+  }
+  radix_remove(&paths, entry->node);
+  entry->node = NULL;
+  if (hand == entry) {
+    hand = entry->next;
+  }
+  unlink_entry(entry);
+  metrics.entries--;
+  metrics.bytes -= entry->length;
+  cache_entry_release(entry);
+}
+
+// Move the window's least recently used entry into the main space if
+// it has been asked for more often than each entry that would have to
+// make room for it, or drop it.
+static void admit_from_window(void) {
+  struct cache_entry* candidate = tail(segment_window);
+  const size_t main_budget = budget - window_budget;
+  const unsigned candidate_frequency = frequency(candidate->hash);
+  while (segments[segment_probation].bytes + segments[segment_protected].bytes +
+      candidate->length > main_budget) {
+    struct cache_entry* victim = tail(segment_probation);
+    if (!victim) {
+      victim = tail(segment_protected);
+    }
+    if (!victim || candidate_frequency <= frequency(victim->hash)) {
+      remove_entry(candidate);
+      metrics.rejections++;
+      return;
+    }
+    remove_entry(victim);
+    metrics.evictions++;
+  }
+  unlink_entry(candidate);
+  push_front(candidate, segment_probation);
+}
+
+void cache_insert(struct cache_entry* entry, const char* path, size_t length,
+    uint64_t expected_generation) {
+  struct cache_quota* quota = entry->quota;
+  if (!cache_admits(entry->length) || entry->node || expected_generation != generation ||
+      (arena_enabled() && !entry->in_arena) ||
+      (quota && (size_t)entry->length > quota->limit)) {
+    return;
+  }
+
+  // Another connection may have cached the same file meanwhile.
+  struct radix_node* other = radix_find(&paths, path, length);
+  if (other) {
+    remove_entry(other->value);
+  }
+  entry->node = radix_insert(&paths, path, length, entry);
+  if (!entry->node) {
+    return;
+  }
+  entry->hash = siphash(path, length, hash_key);
+  if (quota) {
+    while (quota->bytes + entry->length > quota->limit && evict_within(quota)) {
+    }
+    quota->bytes += entry->length;
+  }
+  entry->refs++;
+  entry->referenced = 0;
+  metrics.entries++;
+  metrics.bytes += entry->length;
+  metrics.inserts++;
+
+  switch (policy) {
+    case CACHE_LRU:
+      while (metrics.bytes > budget && evict_one()) {
+      }
+      push_front(entry, segment_main);
+      break;
+    case CACHE_CLOCK:
+      while (metrics.bytes > budget && evict_one()) {
+      }
+      // Behind the hand, so that it is the last entry the hand reaches.
+      link_before(hand, entry, segment_main);
+      break;
+    case CACHE_TINYLFU:
+      push_front(entry, segment_window);
+      while (segments[segment_window].bytes > window_budget) {
+        admit_from_window();
+      }
+      break;
+  }
+}
+
+void cache_invalidate(const char* path) {
+  generation++;
+  struct radix_node* node = radix_find(&paths, path, strlen(path));
+  if (node) {
+    remove_entry(node->value);
+    metrics.invalidations++;
+  }
+}
+
+struct removal {
+  struct cache_entry** entries;
+  size_t count;
+  size_t capacity;
+  int incomplete;
+};
+
+static int collect_entry(const char* key, size_t length, struct radix_node* node, void* argument) {
+  (void)key;
+  (void)length;
+  struct removal* removal = argument;
+  if (removal->count == removal->capacity) {
+    const size_t capacity = removal->capacity ? removal->capacity * 2 : 64;
+    struct cache_entry** entries = realloc(removal->entries, capacity * sizeof(*entries));
+    if (!entries) {
+      removal->incomplete = 1;
+      return 1;
+    }
+    removal->entries = entries;
+    removal->capacity = capacity;
+  }
+  removal->entries[removal->count++] = node->value;
+  return 0;
+}
+
+// Without the memory for a walk, go through every entry instead.
+static void invalidate_by_scan(const char* prefix, size_t length) {
+  for (int segment = 0; segment < segment_count; ++segment) {
+    struct cache_entry* head = &segments[segment].head;
+    for (struct cache_entry* entry = head->next; entry != head;) {
+      struct cache_entry* next = entry->next;
+      char path[PATH_MAX];
+      if (radix_key(entry->node, path, sizeof(path)) >= length &&
+          memcmp(path, prefix, length) == 0) {
+        remove_entry(entry);
+        metrics.invalidations++;
+      }
+      entry = next;
+    }
+  }
+}
+
+void cache_invalidate_tree(const char* directory) {
+  generation++;
+
+  // The entries under the directory are those whose path starts with it
+  // and a '/'. Nodes cannot be removed during a walk, so they are
+  // collected first.
+  char prefix[PATH_MAX];
+  size_t length = strlen(directory);
+  if (length + 1 >= sizeof(prefix)) {
+    return;
+  }
+  memcpy(prefix, directory, length);
+  if (length > 0) {
+    prefix[length++] = '/';
+  }
+  int incomplete;
+  do {
+    struct removal removal = { NULL, 0, 0, 0 };
+    incomplete = radix_walk(&paths, prefix, length, collect_entry, &removal) == -1 ||
+      removal.incomplete;
+    for (size_t i = 0; i < removal.count; ++i) {
+      remove_entry(removal.entries[i]);
+      metrics.invalidations++;
+    }
+    free(removal.entries);
+    if (incomplete && removal.count == 0) {
+      invalidate_by_scan(prefix, length);
+      return;
+    }
+  } while (incomplete);
+}
+
+void cache_metrics(struct cache_metrics* out) {
+  *out = metrics;
+  out->policy = policy;
+}
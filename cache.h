@@ -0,0 +1,129 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct radix_node;
+
+// An in-memory cache of file bodies, keyed by their path relative to
+// the document root, so that hot files are served without opening or
+// reading them.
+//
+// Which entries are evicted to make room depends on the policy:
+//
+//   lru      the least recently used.
+//   clock    an approximation of LRU that only sets a bit on a hit,
+//            rather than moving the entry to the front of a list.
+//   tinylfu  W-TinyLFU: new entries wait in a small LRU window, and only
+//            replace an entry in the main cache if their path has been
+//            asked for more often, going by a count-min sketch of recent
+//            requests. A crawl through every file therefore cannot push
+//            out the hot set, as it would with LRU or CLOCK.
+//
+// Entries are reference counted. The cache holds one reference to each
+// entry in it, and a connection holds one for as long as it sends from
+// an entry, so evicting or invalidating an entry never frees memory that
+// the kernel may still be reading. The cache is only used from the event
+// loop's thread.
+//
+// If arena_init() has been called first, entries are allocated from the
+// arena, which then bounds the memory used along with the budget.
+
+// A cap on the bytes that the entries sharing it, such as the files of
+// one virtual host, may take in the cache. Going over it evicts the
+// group's own entries, in the policy's order, rather than anyone else's.
+struct cache_quota {
+  size_t limit;
+  size_t bytes;
+};
+
+struct cache_entry {
+  char* data;
+  off_t length;
+  const char* rules;  // the file's header lines, from rules_headers()
+  struct cache_quota* quota;  // NULL for none
+
+  // Private to the cache.
+  struct cache_entry* prev;
+  struct cache_entry* next;
+  struct radix_node* node;  // of its path, while it is in the cache
+  uint64_t hash;
+  unsigned refs;
+  unsigned char in_arena;
+  unsigned char segment;
+  unsigned char referenced;
+};
+
+enum cache_policy {
+  CACHE_LRU,
+  CACHE_CLOCK,
+  CACHE_TINYLFU
+};
+
+struct cache_metrics {
+  unsigned long hits;
+  unsigned long misses;  // of files the cache could have held
+  unsigned long inserts;
+  unsigned long evictions;
+  unsigned long rejections;  // new entries tinylfu would not let in
+  unsigned long invalidations;
+  unsigned long entries;
+  unsigned long bytes;
+  enum cache_policy policy;
+};
+
+// Keep at most `budget` bytes of bodies, none larger than `max_entry`,
+// evicting by `policy`. Returns -1 if the table cannot be allocated.
+int cache_init(size_t budget, size_t max_entry, enum cache_policy policy);
+
+const char* cache_policy_name(enum cache_policy policy);
+
+// Returns -1 if `name` is not "lru", "clock" or "tinylfu".
+int cache_policy_parse(const char* name, enum cache_policy* policy);
+
+// Whether a body of `length` bytes may be cached.
+int cache_admits(off_t length);
+
+// The entry for `path`, with a reference taken, or NULL.
+struct cache_entry* cache_lookup(const char* path, size_t length);
+
+// Count a miss for a file the cache could have held. A lookup that
+// misses is not counted by itself: most are for paths that could never
+// be cached, such as large files and missing ones, which would make the
+// hit ratio say more about the requests than about the policy.
+void cache_miss(void);
+
+// A new entry with room for `length` bytes, not yet in the cache and
+// holding one reference for the caller. Returns NULL if out of memory.
+struct cache_entry* cache_entry_new(off_t length);
+
+// An entry for the `length` bytes at `data`, which came from malloc() and
+// is freed with the entry. It is not in the cache and holds one reference
+// for the caller. Returns NULL, with `data` freed, if out of memory.
+struct cache_entry* cache_entry_adopt(char* data, off_t length);
+
+void cache_entry_retain(struct cache_entry* entry);
+void cache_entry_release(struct cache_entry* entry);
+
+// Incremented by every invalidation. An entry read from a file after
+// the generation was sampled may only be inserted if it has not changed
+// since, or it could hold what the file said before a change.
+uint64_t cache_generation(void);
+
+// Add a filled-in entry for `path`, evicting others to make room. The
+// caller keeps its reference. Nothing is done if the entry is too large
+// or the generation has moved on from `generation`.
+void cache_insert(struct cache_entry* entry, const char* path, size_t length,
+    uint64_t generation);
+
+// Drop the entry for `path`.
+void cache_invalidate(const char* path);
+
+// Drop every entry beneath `directory`, or every entry if it is "".
+void cache_invalidate_tree(const char* directory);
+
+void cache_metrics(struct cache_metrics* metrics);
+
+#endif
@@ -0,0 +1,374 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_getdents64
+#define HAVE_GETDENTS64 1
+#endif
+#endif
+#include "crawl.h"
+
+enum {
+  dirent_buffer_size = 64 * 1024
+};
+
+// Running threads.
+
+struct run {
+  void (*work)(void*);
+  void* argument;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  int running;
+};
+
+static void* run_thread(void* argument) {
+  struct run* run = argument;
+  run->work(run->argument);
+  pthread_mutex_lock(&run->lock);
+  if (--run->running == 0) {
+    pthread_cond_signal(&run->finished);
+  }
+  pthread_mutex_unlock(&run->lock);
+  return NULL;
+}
+
+int crawl_run(int threads, void (*work)(void*), void (*tick)(void*), void* argument) {
+  struct run run = { work, argument, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+  pthread_t* ids = calloc(threads, sizeof(*ids));
+  if (!ids) {
+    return -1;
+  }
+  int started = 0;
+  pthread_mutex_lock(&run.lock);
+  for (; started < threads; ++started) {
+    if (pthread_create(&ids[started], NULL, run_thread, &run) != 0) {
+      break;
+    }
+    run.running++;
+  }
+  while (run.running > 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    if (pthread_cond_timedwait(&run.finished, &run.lock, &deadline) == ETIMEDOUT && tick) {
+      pthread_mutex_unlock(&run.lock);
+      tick(argument);
+      pthread_mutex_lock(&run.lock);
+    }
+  }
+  pthread_mutex_unlock(&run.lock);
+  for (int i = 0; i < started; ++i) {
+    pthread_join(ids[i], NULL);
+  }
+  free(ids);
+  if (started == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return 0;
+}
+
+// Walking.
+
+struct walk {
+  int root_fd;
+  off_t max_length;
+  crawl_progress progress;
+
+  // The directories waiting to be read, and how many are being read;
+  // the walk is over when both are none.
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  char** queue;
+  size_t queue_length;
+  size_t queue_capacity;
+  int reading;
+  int failed;
+
+  // What the threads found, merged in as each finishes a directory.
+  struct crawl* crawl;
+  size_t file_capacity;
+  size_t directory_capacity;
+  size_t found;
+  uint64_t found_bytes;
+};
+
+// A thread's finds, collected without the lock.
+struct finds {
+  struct crawl_file* files;
+  size_t count;
+  size_t capacity;
+  char** directories;
+  size_t directory_count;
+  size_t directory_capacity;
+  uint64_t bytes;
+  size_t skipped;
+  char* buffer;  // for getdents64()
+};
+
+static int grow(void** array, size_t* capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) {
+    return 0;
+  }
+  size_t grown = *capacity ? *capacity * 2 : 256;
+  while (grown < needed) {
+    grown *= 2;
+  }
+  void* larger = realloc(*array, grown * size);
+  if (!larger) {
+    return -1;
+  }
+  *array = larger;
+  *capacity = grown;
+  return 0;
+}
+
+static char* join_path(const char* directory, const char* name) {
+  const size_t directory_length = strlen(directory);
+  const size_t name_length = strlen(name);
+  char* path = malloc(directory_length + name_length + 2);
+  if (!path) {
+    return NULL;
+  }
+  if (directory_length > 0) {
+    memcpy(path, directory, directory_length);
+    path[directory_length] = '/';
+    memcpy(path + directory_length + 1, name, name_length + 1);
+  } else {
+    memcpy(path, name, name_length + 1);
+  }
+  return path;
+}
+
+// Note one entry of `directory`, open as `fd`. `type` is a DT_ value.
+static int add_entry(struct walk* walk, struct finds* finds, int fd,
+    const char* directory, const char* name, unsigned char type) {
+  if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+    return 0;
+  }
+  struct stat stat;
+  if (type == DT_UNKNOWN || type == DT_REG) {
+    if (fstatat(fd, name, &stat, AT_SYMLINK_NOFOLLOW) == -1) {
+      return errno == ENOENT ? 0 : -1;
+    }
+    type = S_ISDIR(stat.st_mode) ? DT_DIR : S_ISREG(stat.st_mode) ? DT_REG : DT_LNK;
+  }
+
+  if (type == DT_DIR) {
+    char* path = join_path(directory, name);
+    if (!path || grow((void**)&finds->directories, &finds->directory_capacity,
+          finds->directory_count + 1, sizeof(char*)) == -1) {
+      free(path);
+      return -1;
+    }
+    finds->directories[finds->directory_count++] = path;
+  } else if (type == DT_REG) {
+    if (walk->max_length >= 0 && stat.st_size > walk->max_length) {
+      finds->skipped++;
+      return 0;
+    }
+    char* path = join_path(directory, name);
+    if (!path || grow((void**)&finds->files, &finds->capacity,
+          finds->count + 1, sizeof(*finds->files)) == -1) {
+      free(path);
+      return -1;
+    }
+    finds->files[finds->count].path = path;
+    finds->files[finds->count].length = stat.st_size;
+    finds->count++;
+    finds->bytes += stat.st_size;
+  }
+  return 0;
+}
+
+static int read_directory(struct walk* walk, struct finds* finds, const char* directory) {
+  const int fd = openat(walk->root_fd, *directory ? directory : ".",
+      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) {
+    // Gone since its parent was read, or not ours to read.
+    return errno == ENOENT || errno == EACCES || errno == ENOTDIR ? 0 : -1;
+  }
+  int result = 0;
+#ifdef HAVE_GETDENTS64
+  // The record layout of getdents64(), which libc does not declare.
+  struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+  if (!finds->buffer && !(finds->buffer = malloc(dirent_buffer_size))) {
+    close(fd);
+    return -1;
+  }
+  char* buffer = finds->buffer;
+  for (;;) {
+    const long n = syscall(SYS_getdents64, fd, buffer, dirent_buffer_size);
+    if (n <= 0) {
+      result = n == 0 ? 0 : -1;
+      break;
+    }
+    for (long offset = 0; offset < n && result == 0;) {
+      const struct linux_dirent64* entry = (const struct linux_dirent64*)(buffer + offset);
+      result = add_entry(walk, finds, fd, directory, entry->d_name, entry->d_type);
+      offset += entry->d_reclen;
+    }
+    if (result == -1) {
+      break;
+    }
+  }
+  close(fd);
+#else
+  DIR* stream = fdopendir(fd);
+  if (!stream) {
+    close(fd);
+    return -1;
+  }
+  for (struct dirent* entry; result == 0 && (entry = readdir(stream));) {
+#ifdef DT_UNKNOWN
+    result = add_entry(walk, finds, fd, directory, entry->d_name, entry->d_type);
+#else
+    result = add_entry(walk, finds, fd, directory, entry->d_name, DT_UNKNOWN);
+#endif
+  }
+  closedir(stream);
+#endif
+  return result;
+}
+
+// Hand what a thread found in a directory to the walk, queueing the
+// directories it found.
+static int merge_finds(struct walk* walk, struct finds* finds) {
+  struct crawl* crawl = walk->crawl;
+  if (grow((void**)&crawl->files, &walk->file_capacity,
+        crawl->count + finds->count, sizeof(*crawl->files)) == -1 ||
+      grow((void**)&crawl->directories, &walk->directory_capacity,
+        crawl->directory_count + finds->directory_count, sizeof(char*)) == -1 ||
+      grow((void**)&walk->queue, &walk->queue_capacity,
+        walk->queue_length + finds->directory_count, sizeof(char*)) == -1) {
+    return -1;
+  }
+  memcpy(crawl->files + crawl->count, finds->files, finds->count * sizeof(*finds->files));
+  crawl->count += finds->count;
+  crawl->bytes += finds->bytes;
+  crawl->skipped += finds->skipped;
+  for (size_t i = 0; i < finds->directory_count; ++i) {
+    crawl->directories[crawl->directory_count++] = finds->directories[i];
+    walk->queue[walk->queue_length++] = finds->directories[i];
+  }
+  __atomic_store_n(&walk->found, crawl->count, __ATOMIC_RELAXED);
+  __atomic_store_n(&walk->found_bytes, crawl->bytes, __ATOMIC_RELAXED);
+  finds->count = 0;
+  finds->directory_count = 0;
+  finds->bytes = 0;
+  finds->skipped = 0;
+  return 0;
+}
+
+static void walk_thread(void* argument) {
+  struct walk* walk = argument;
+  struct finds finds;
+  memset(&finds, 0, sizeof(finds));
+
+  pthread_mutex_lock(&walk->lock);
+  for (;;) {
+    while (walk->queue_length == 0 && walk->reading > 0 && !walk->failed) {
+      pthread_cond_wait(&walk->queued, &walk->lock);
+    }
+    if (walk->queue_length == 0 || walk->failed) {
+      break;
+    }
+    const char* directory = walk->queue[--walk->queue_length];
+    walk->reading++;
+    pthread_mutex_unlock(&walk->lock);
+
+    const int result = read_directory(walk, &finds, directory);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->reading--;
+    if (result == -1 || merge_finds(walk, &finds) == -1) {
+      walk->failed = errno ? errno : ENOMEM;
+    }
+    pthread_cond_broadcast(&walk->queued);
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  for (size_t i = 0; i < finds.count; ++i) {
+    free(finds.files[i].path);
+  }
+  for (size_t i = 0; i < finds.directory_count; ++i) {
+    free(finds.directories[i]);
+  }
+  free(finds.files);
+  free(finds.directories);
+  free(finds.buffer);
+}
+
+static void walk_tick(void* argument) {
+  struct walk* walk = argument;
+  walk->progress(__atomic_load_n(&walk->found, __ATOMIC_RELAXED),
+      __atomic_load_n(&walk->found_bytes, __ATOMIC_RELAXED));
+}
+
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(((const struct crawl_file*)a)->path, ((const struct crawl_file*)b)->path);
+}
+
+int crawl_tree(int root_fd, int threads, off_t max_length, struct crawl* crawl,
+    crawl_progress progress) {
+  memset(crawl, 0, sizeof(*crawl));
+  struct walk walk;
+  memset(&walk, 0, sizeof(walk));
+  walk.root_fd = root_fd;
+  walk.max_length = max_length;
+  walk.progress = progress;
+  walk.crawl = crawl;
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.queued, NULL);
+
+  char* root = strdup("");
+  if (!root || grow((void**)&crawl->directories, &walk.directory_capacity, 1, sizeof(char*)) == -1 ||
+      grow((void**)&walk.queue, &walk.queue_capacity, 1, sizeof(char*)) == -1) {
+    free(root);
+    crawl_free(crawl);
+    free(walk.queue);
+    return -1;
+  }
+  crawl->directories[crawl->directory_count++] = root;
+  walk.queue[walk.queue_length++] = root;
+
+  const int result = crawl_run(threads, walk_thread, progress ? walk_tick : NULL, &walk);
+  free(walk.queue);
+  pthread_mutex_destroy(&walk.lock);
+  pthread_cond_destroy(&walk.queued);
+  if (result == -1 || walk.failed) {
+    if (walk.failed) {
+      errno = walk.failed;
+    }
+    crawl_free(crawl);
+    return -1;
+  }
+  qsort(crawl->files, crawl->count, sizeof(*crawl->files), compare_paths);
+  return 0;
+}
+
+void crawl_free(struct crawl* crawl) {
+  for (size_t i = 0; i < crawl->count; ++i) {
+    free(crawl->files[i].path);
+  }
+  for (size_t i = 0; i < crawl->directory_count; ++i) {
+    free(crawl->directories[i]);
+  }
+  free(crawl->files);
+  free(crawl->directories);
+  memset(crawl, 0, sizeof(*crawl));
+}
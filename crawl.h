@@ -0,0 +1,45 @@
+#ifndef CRAWL_H
+#define CRAWL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A parallel walk of a directory tree. Each thread takes a directory
+// from a shared queue, reads its entries with getdents64() on Linux (and
+// readdir() elsewhere), queues the directories it finds and keeps the
+// regular files, so on a big tree the reads of many directories are in
+// flight at once. Symbolic links are not followed.
+
+struct crawl_file {
+  char* path;  // relative to the root, without a leading '/'
+  off_t length;
+};
+
+struct crawl {
+  struct crawl_file* files;  // sorted by path
+  size_t count;
+  char** directories;  // relative to the root, "" for the root itself
+  size_t directory_count;
+  uint64_t bytes;  // in the files
+  size_t skipped;  // files over the limit
+};
+
+// Called about once a second while work is going on, with the numbers
+// so far.
+typedef void (*crawl_progress)(size_t files, uint64_t bytes);
+
+// Find the regular files of at most `max_length` bytes (or any length,
+// if it is negative) under `root_fd` with `threads` threads. Returns 0,
+// or -1 with errno set.
+int crawl_tree(int root_fd, int threads, off_t max_length, struct crawl* crawl,
+    crawl_progress progress);
+
+void crawl_free(struct crawl* crawl);
+
+// Run `work(argument)` on `threads` threads and wait for them all,
+// calling `tick(argument)` about once a second meanwhile, if it is not
+// NULL. Returns 0, or -1 with errno set if no thread could be started.
+int crawl_run(int threads, void (*work)(void*), void (*tick)(void*), void* argument);
+
+#endif
@@ -0,0 +1,30 @@
+#include "embed.h"
+
+// `make embed` packs the site into a bundle and compiles this file with
+// EMBED_BUNDLE naming it. The assembler copies the bundle into read-only
+// data, aligned for the index, so the site is served straight out of the
+// binary's own pages: there is nothing to open or parse at startup, and
+// the kernel shares the pages between every process running the binary.
+
+#ifdef EMBED_BUNDLE
+__asm__(
+    "  .section .rodata\n"
+    "  .balign 64\n"
+    "garcon_embedded_start:\n"
+    "  .incbin \"" EMBED_BUNDLE "\"\n"
+    "garcon_embedded_end:\n"
+    "  .previous\n");
+
+extern const char garcon_embedded_start[];
+extern const char garcon_embedded_end[];
+
+const void* embedded_bundle(size_t* size) {
+  *size = garcon_embedded_end - garcon_embedded_start;
+  return garcon_embedded_start;
+}
+#else
+const void* embedded_bundle(size_t* size) {
+  *size = 0;
+  return NULL;
+}
+#endif
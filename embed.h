@@ -0,0 +1,10 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include <stddef.h>
+
+// The bundle built into the binary by `make embed SITE=<directory>`, or
+// NULL if there is none. Its size is stored through `size`.
+const void* embedded_bundle(size_t* size);
+
+#endif
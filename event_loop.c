@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "event_loop.h"
+
+enum {
+  max_events = 256
+};
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+struct event_loop {
+  int epoll;
+};
+
+static unsigned to_epoll(int events) {
+  unsigned result = 0;
+  if (events & EVENT_READ) result |= EPOLLIN;
+  if (events & EVENT_WRITE) result |= EPOLLOUT;
+  return result;
+}
+
+struct event_loop* event_loop_new(void) {
+  struct event_loop* loop = malloc(sizeof(*loop));
+  if (!loop) {
+    return NULL;
+  }
+  loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll == -1) {
+    free(loop);
+    return NULL;
+  }
+  return loop;
+}
+
+static int control(struct event_loop* loop, int op, int fd, int events, struct event_handler* handler) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = to_epoll(events);
+  event.data.ptr = handler;
+  return epoll_ctl(loop->epoll, op, fd, &event);
+}
+
+int event_add(struct event_loop* loop, int fd, int events, struct event_handler* handler) {
+  return control(loop, EPOLL_CTL_ADD, fd, events, handler);
+}
+
+int event_modify(struct event_loop* loop, int fd, int events, struct event_handler* handler) {
+  return control(loop, EPOLL_CTL_MOD, fd, events, handler);
+}
+
+void event_remove(struct event_loop* loop, int fd) {
+  struct epoll_event event;
+  epoll_ctl(loop->epoll, EPOLL_CTL_DEL, fd, &event);
+}
+
+int event_loop_run_once(struct event_loop* loop, int timeout) {
+  struct epoll_event events[max_events];
+  const int count = epoll_wait(loop->epoll, events, max_events, timeout);
+  for (int i = 0; i < count; ++i) {
+    int ready = 0;
+    if (events[i].events & EPOLLIN) ready |= EVENT_READ;
+    if (events[i].events & EPOLLOUT) ready |= EVENT_WRITE;
+    if (events[i].events & (EPOLLERR | EPOLLHUP)) ready |= EVENT_ERROR;
+    struct event_handler* handler = events[i].data.ptr;
+    handler->callback(handler, ready);
+  }
+  return count;
+}
+
+#else
+
+#include <poll.h>
+
+// Registered descriptors are kept densely in `fds`, with `index`
+// mapping a descriptor back to its position so removal is O(1).
+struct event_loop {
+  struct pollfd* fds;
+  struct event_handler** handlers;
+  int* index;
+  size_t count;
+  size_t capacity;
+  int index_size;
+};
+
+static short to_poll(int events) {
+  short result = 0;
+  if (events & EVENT_READ) result |= POLLIN;
+  if (events & EVENT_WRITE) result |= POLLOUT;
+  return result;
+}
+
+struct event_loop* event_loop_new(void) {
+  return calloc(1, sizeof(struct event_loop));
+}
+
+static int reserve(struct event_loop* loop, int fd) {
+  if (fd >= loop->index_size) {
+    int size = loop->index_size ? loop->index_size : 64;
+    while (size <= fd) {
+      size *= 2;
+    }
+    int* index = realloc(loop->index, size * sizeof(int));
+    if (!index) {
+      return -1;
+    }
+    for (int i = loop->index_size; i < size; ++i) {
+      index[i] = -1;
+    }
+    loop->index = index;
+    loop->index_size = size;
+  }
+  if (loop->count == loop->capacity) {
+    size_t capacity = loop->capacity ? loop->capacity * 2 : 64;
+    struct pollfd* fds = realloc(loop->fds, capacity * sizeof(*fds));
+    if (!fds) {
+      return -1;
+    }
+    loop->fds = fds;
+    struct event_handler** handlers = realloc(loop->handlers, capacity * sizeof(*handlers));
+    if (!handlers) {
+      return -1;
+    }
+    loop->handlers = handlers;
+    loop->capacity = capacity;
+  }
+  return 0;
+}
+
+int event_add(struct event_loop* loop, int fd, int events, struct event_handler* handler) {
+  if (reserve(loop, fd) == -1) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (loop->index[fd] != -1) {
+    errno = EEXIST;
+    return -1;
+  }
+  loop->index[fd] = loop->count;
+  loop->fds[loop->count].fd = fd;
+  loop->fds[loop->count].events = to_poll(events);
+  loop->fds[loop->count].revents = 0;
+  loop->handlers[loop->count] = handler;
+  loop->count++;
+  return 0;
+}
+
+int event_modify(struct event_loop* loop, int fd, int events, struct event_handler* handler) {
+  if (fd >= loop->index_size || loop->index[fd] == -1) {
+    errno = ENOENT;
+    return -1;
+  }
+  loop->fds[loop->index[fd]].events = to_poll(events);
+  loop->handlers[loop->index[fd]] = handler;
+  return 0;
+}
+
+void event_remove(struct event_loop* loop, int fd) {
+  if (fd >= loop->index_size || loop->index[fd] == -1) {
+    return;
+  }
+  const size_t position = loop->index[fd];
+  const size_t last = --loop->count;
+  if (position != last) {
+    loop->fds[position] = loop->fds[last];
+    loop->handlers[position] = loop->handlers[last];
+    loop->index[loop->fds[position].fd] = position;
+  }
+  loop->index[fd] = -1;
+}
+
+int event_loop_run_once(struct event_loop* loop, int timeout) {
+  const int result = poll(loop->fds, loop->count, timeout);
+  if (result <= 0) {
+    return result;
+  }
+
+  // Collect the ready handlers first: callbacks add and remove
+  // descriptors, which reorders `fds`.
+  struct event_handler* handlers[max_events];
+  int ready[max_events];
+  int count = 0;
+  for (size_t i = 0; i < loop->count && count < max_events; ++i) {
+    const short revents = loop->fds[i].revents;
+    if (!revents) {
+      continue;
+    }
+    ready[count] = 0;
+    if (revents & POLLIN) ready[count] |= EVENT_READ;
+    if (revents & POLLOUT) ready[count] |= EVENT_WRITE;
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) ready[count] |= EVENT_ERROR;
+    handlers[count++] = loop->handlers[i];
+  }
+
+  for (int i = 0; i < count; ++i) {
+    handlers[i]->callback(handlers[i], ready[i]);
+  }
+  return count;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// A minimal readiness loop over epoll on Linux and poll() elsewhere.
+// Every registered descriptor carries an event_handler, which is
+// usually embedded in a larger struct and recovered with container_of.
+
+#include <stddef.h>
+
+#define container_of(ptr, type, member) \
+  ((type*)((char*)(ptr) - offsetof(type, member)))
+
+enum {
+  EVENT_READ = 1,
+  EVENT_WRITE = 2,
+  EVENT_ERROR = 4
+};
+
+struct event_handler {
+  void (*callback)(struct event_handler* handler, int events);
+};
+
+struct event_loop;
+
+struct event_loop* event_loop_new(void);
+
+int event_add(struct event_loop* loop, int fd, int events, struct event_handler* handler);
+int event_modify(struct event_loop* loop, int fd, int events, struct event_handler* handler);
+
+// Must be called before `fd` is closed.
+void event_remove(struct event_loop* loop, int fd);
+
+// Wait up to `timeout` milliseconds (-1 for ever) and dispatch the
+// ready handlers. Returns the number dispatched, or -1 with errno set.
+int event_loop_run_once(struct event_loop* loop, int timeout);
+
+#endif
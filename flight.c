@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include "flight.h"
+#include "hash.h"
+
+enum {
+  table_size = 256
+};
+
+struct flight {
+  struct flight* next;
+  struct flight_waiter* waiters;
+  uint64_t hash;
+  char path[];
+};
+
+static struct flight* table[table_size];
+static uint64_t hash_key[2];
+
+int flight_init(void) {
+  hash_random_key(hash_key, 2);
+  return 0;
+}
+
+// The link to the flight for `path`, or to the NULL at the end of its
+// bucket if there is none.
+static struct flight** find(const char* path, size_t length, uint64_t* hash) {
+  *hash = siphash(path, length, hash_key);
+  struct flight** link = &table[*hash & (table_size - 1)];
+  while (*link && ((*link)->hash != *hash || strcmp((*link)->path, path) != 0)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+int flight_begin(const char* path, size_t length, struct flight_waiter* waiter) {
+  uint64_t hash;
+  struct flight** link = find(path, length, &hash);
+  struct flight* flight = *link;
+  if (flight) {
+    waiter->next = flight->waiters;
+    waiter->link = &flight->waiters;
+    if (flight->waiters) {
+      flight->waiters->link = &waiter->next;
+    }
+    flight->waiters = waiter;
+    return 0;
+  }
+
+  // Without memory to track the load, the caller loads alone.
+  flight = malloc(sizeof(*flight) + length + 1);
+  if (flight) {
+    flight->next = NULL;
+    flight->waiters = NULL;
+    flight->hash = hash;
+    memcpy(flight->path, path, length);
+    flight->path[length] = '\0';
+    *link = flight;
+  }
+  return 1;
+}
+
+void flight_end(const char* path) {
+  uint64_t hash;
+  struct flight** link = find(path, strlen(path), &hash);
+  struct flight* flight = *link;
+  if (!flight) {
+    return;
+  }
+  *link = flight->next;
+
+  // The flight is gone before anyone is woken, so a waiter that misses
+  // again can start a new one. The rest of the list is held by `next`,
+  // which flight_leave() updates if a waiter leaves meanwhile.
+  struct flight_waiter* waiter = flight->waiters;
+  free(flight);
+  while (waiter) {
+    struct flight_waiter* next = waiter->next;
+    if (next) {
+      next->link = &next;
+    }
+    waiter->link = NULL;
+    waiter->done(waiter);
+    waiter = next;
+  }
+}
+
+void flight_leave(struct flight_waiter* waiter) {
+  if (!waiter->link) {
+    return;
+  }
+  *waiter->link = waiter->next;
+  if (waiter->next) {
+    waiter->next->link = waiter->link;
+  }
+  waiter->link = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+
+// Single-flight loading: when many requests miss the content cache for
+// the same path at once, only the first (the leader) opens and reads the
+// file, and the rest wait for it rather than each doing the same work.
+// Once the leader has cached the file, or found that it cannot be, the
+// waiters are woken to look again. Only used from the event loop's
+// thread.
+
+struct flight_waiter {
+  struct flight_waiter* next;
+  struct flight_waiter** link;  // the pointer to this waiter
+  void (*done)(struct flight_waiter* waiter);
+};
+
+// Returns -1 if the table cannot be allocated.
+int flight_init(void);
+
+// Returns 1 if the caller is to load `path` and call flight_end() when
+// it is done, or 0 if a load is already under way and `waiter` has been
+// queued to have its `done` called when it ends.
+int flight_begin(const char* path, size_t length, struct flight_waiter* waiter);
+
+// End the load of `path`, waking everything waiting for it.
+void flight_end(const char* path);
+
+// Stop waiting, e.g. because the waiter's connection timed out.
+void flight_leave(struct flight_waiter* waiter);
+
+#endif
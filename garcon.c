@@ -16,17 +16,73 @@
 #include <unistd.h>
 #include <limits.h>
 #include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include "arena.h"
 #include "buffer/buffer.h"
+#include "bundle.h"
+#include "crawl.h"
+#include "embed.h"
+#include "cache.h"
 #include "cmap/map.h"
 #include "commander/commander.h"
+#include "event_loop.h"
+#include "flight.h"
+#include "hosts.h"
+#include "hub.h"
 #include "http_parser.h"
+#include "iopool.h"
+#include "listing.h"
+#include "negcache.h"
+#include "pacing.h"
+#include "pagecache.h"
+#include "path.h"
+#include "ratelimit.h"
+#include "response.h"
+#include "rules.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "watch.h"
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY 1
+#endif
 
 enum {
-  time_buffer_size = 100
+  // Files up to this size are read in and sent in the same write as the
+  // headers; larger ones are sent from the page cache with sendfile().
+  small_body_size = 16 * 1024,
+
+  // The most of a file sent to one connection before the others get a
+  // turn, and how far ahead of the socket a large file is read.
+  send_chunk_size = 512 * 1024,
+  readahead_size = 4 * 1024 * 1024,
+
+  // A paced file waits until at least this much of it may go, rather
+  // than wake for every few packets.
+  pace_quantum = 16 * 1024,
+
+  // The largest file kept in the content cache.
+  cache_max_file = 4 * 1024 * 1024,
+
+  // --preload reads directories and files with two threads per CPU, as
+  // they mostly wait for the disk, up to this many.
+  preload_max_threads = 64,
+
+  // Rendered directory listings are kept up to this size in all. A
+  // listing too large to keep goes out in pieces of about this size,
+  // with room in front of each for its chunk size.
+  listing_cache_size = 8 * 1024 * 1024,
+  listing_piece_size = 64 * 1024,
+  chunk_header_size = 18
 };
 
-static const char default_filename[] = "index.html";
-
 struct parser_data {
   buffer_t *url;
   char *client_address;
@@ -36,6 +92,7 @@ struct parser_data {
     buffer_t* key;
     buffer_t* val;
   } header; // TODO: rename 'header_bufs'
+  char* host;  // the Host header, or NULL
   int complete;
 };
 
@@ -46,6 +103,7 @@ void parser_data_init(struct parser_data* data, const char* client_address) {
   map_set_free_func(data->headers, free);
   data->header.key = buffer_new();
   data->header.val = buffer_new();
+  data->host = NULL;
   data->complete = 0;
 
   // Log the current time
@@ -60,6 +118,7 @@ void parser_data_destroy(struct parser_data* data) {
   destroy_map(&data->headers);
   buffer_free(data->header.key);
   buffer_free(data->header.val);
+  free(data->host);
   memset(&data, 0, sizeof(data));
 }
 
@@ -69,19 +128,32 @@ static int on_message_complete(http_parser* parser) {
   return 0;
 }
 
-static int on_header_field(http_parser * parser, const char *at, size_t len) {
-  struct parser_data *data = parser->data;
-
+// Store the header whose name and value have been read. The Host
+// header, which picks the virtual host, is kept aside whatever its case.
+static void flush_header(struct parser_data *data) {
   if (buffer_length(data->header.val) > 0) {
+    if (!data->host && strcasecmp(data->header.key->data, "Host") == 0) {
+      data->host = strdup(data->header.val->data);
+    }
     map_set(data->headers,  strdup(data->header.key->data),
         strdup(data->header.val->data));
     buffer_clear(data->header.key);
     buffer_clear(data->header.val);
   }
+}
+
+static int on_header_field(http_parser * parser, const char *at, size_t len) {
+  struct parser_data *data = parser->data;
+  flush_header(data);
   buffer_append_n(data->header.key, at, len);
   return 0;
 }
 
+static int on_headers_complete(http_parser * parser) {
+  flush_header(parser->data);
+  return 0;
+}
+
 static int on_header_value(http_parser * parser, const char *at, size_t len) {
   struct parser_data *data = parser->data;
   buffer_append_n(data->header.val, at, len);
@@ -94,147 +166,508 @@ static int on_url(http_parser * parser, const char *at, size_t len) {
   return 0;
 }
 
-struct mime_type_t { const char* ext; const char* mime; } mime_types[] = {
-  { ".htm", "text/html" },
-  { ".html", "text/html" },
-  { ".js", "text/javascript" },
-  { ".css", "text/css" },
-  { ".svg", "image/svg+xml" },
-  { ".jpg", "image/jpeg" },
-  { ".jpeg", "image/jpeg" },
-  { ".png", "image/png" },
-  { ".gif", "image/gif" },
-  { ".pdf", "application/pdf" },
-  { ".xml", "text/xml" },
-  { ".md", "text/markdown" },
-  { ".csv", "text/csv" },
-  { ".mp3", "audio/mpeg" },
-  { ".zip", "application/zip" },
-  { ".gz", "application/gzip" },
-  { ".xhtml", "application/xhtml+xml" }
+// The outcome of opening a requested file, on the event loop or in the
+// I/O pool.
+struct open_result {
+  int file;
+  int error;  // errno, if `file` is -1
+  int regular;
+  off_t length;
 };
 
-static void buffer_set_content_type(buffer_t* buffer, const char* uri)
-{
-  size_t i;
-  const char* ext = strrchr(uri, '.');
-  if (ext == NULL)
-	  return;
-  for (i = 0; i < sizeof(mime_types)/sizeof(mime_types[0]); ++i)
-    if (strcasecmp(ext + 1, mime_types[i].ext + 1) == 0) {
-      buffer_appendf(buffer, "Content-Type: %s\r\n", mime_types[i].mime);
-      break;
-    }
-}
+enum connection_state {
+  reading_request,
+  writing_response,
+  waiting_for_disk,
+  waiting_for_load,
+  waiting_for_zerocopy,
+  waiting_for_pace
+};
 
-static buffer_t* response_headers(int length, int max_age, const struct tm *timeinfo, const char* uri)
-{
-  buffer_t *result = buffer_new();
-  buffer_append(result, "HTTP/1.1 200 OK\r\n");
+struct connection {
+  struct event_handler handler;
+  struct timer timer;
+  enum connection_state state;
+  int socket;
+  uint32_t address;
+  http_parser parser;
+  struct parser_data data;
+  struct request request;
+  uint64_t header_deadline;
+  int head;  // a HEAD request, answered with the headers for GET alone
+  struct host* host;  // the virtual host, or the main root's
+
+  // The response: the memory in `output` (the headers, then the body if
+  // it is in memory), followed by the bytes of `file` from `file_start`
+  // to `file_length`. A `file_borrowed` from a bundle is not closed. The
+  // headers belong to `output_buffer`, or are static for prebuilt
+  // responses. A body in memory is held by a reference to `body`, which
+  // may be shared through the content cache, or is `static_body`, which
+  // is built into the binary.
+  int status;
+  buffer_t *output_buffer;
+  struct cache_entry *body;
+  const char* static_body;
+  size_t static_length;
+  struct iovec output[2];
+  int output_index;
+  int output_count;
+  size_t output_sent;
+  int file;
+  int file_borrowed;
+  off_t file_start;
+  off_t file_offset;
+  off_t file_length;
+  off_t readahead_offset;
+
+  // The file's share of the bandwidth under --pace, if the kernel is not
+  // keeping to it.
+  struct pace_bucket pace;
+
+  // Parts of the file that are not in the page cache are read by the I/O
+  // pool, and `map` is used to ask which parts those are. Up to
+  // `warm_offset` the pool has read the file already.
+  void* map;
+  off_t warm_offset;
+  struct io_job io;
+  ssize_t io_result;
+  int abandoned;
+
+  // The path of a file being opened by the I/O pool, or being read in
+  // for the content cache, which may only take it if nothing has been
+  // invalidated since `cache_generation`.
+  char* path;
+  uint64_t negative_key;
+  struct open_result opened;
+  int cacheable;
+  uint64_t cache_generation;
+
+  // Concurrent misses for the same path are coalesced: the connection
+  // that misses first is `leading` the load of `path`, and the others
+  // wait on it in `flight`, then look in the cache again as `follower`s,
+  // which load the file themselves if it is still not there.
+  int leading;
+  int follower;
+  struct flight_waiter flight;
+
+  // MSG_ZEROCOPY sends whose completions have not arrived. Until they
+  // do, the kernel may still read from the body and headers.
+  int zerocopy;
+  unsigned long zerocopy_pending;
+
+  // A directory listing being read, or being sent a piece at a time from
+  // `listing_text`, starting with entry `listing_next`, because it is
+  // too large to keep. It is only kept if nothing has been invalidated
+  // since `listing_generation`.
+  struct listing* listing;
+  enum listing_format listing_format;
+  uint64_t listing_generation;
+  size_t listing_next;
+  int listing_chunked;
+  struct listing_text listing_text;
+};
 
-  char time_buffer[time_buffer_size];
-  const size_t time_size = strftime(time_buffer, time_buffer_size, "%a, %d %h %Y %T %Z", timeinfo);
+struct options {
+  char* root;
+  long int port;
+  long int header_timeout;
+  long int idle_timeout;
+  long int send_timeout;
+  long int backlog;
+  long int max_connections;
+  struct ratelimit_config rate_limits;
+  long int negative_cache_size;
+  long int negative_ttl;
+  long int io_threads;
+  long int max_io_threads;
+  long int cache_size;
+  long int zerocopy_threshold;
+  long int preload;  // KiB, 0 for off
+  int listings;
+  int huge_pages;  // -1 to allocate cache entries from the heap
+  enum cache_policy cache_policy;
+  char* bundle;
+  char* rules;
+  char* hosts;
+  char* live_reload;  // the path WebSockets for live reload are opened at
+  uint64_t egress_rate;  // bytes a second for the whole server, 0 for no limit
+};
 
-  if (time_size == 0) {
-    fprintf(stderr, "Error formatting time");
-    exit(EXIT_SUCCESS);
-  }
+struct server {
+  struct options options;
+  http_parser_settings settings;
+  struct event_loop* loop;
+  struct timer_wheel timers;
+  struct event_handler listener;
+  struct event_handler watcher;
+  struct event_handler io_handler;
+  int socket;
+  int root_fd;
+  struct host default_host;  // the main root, for requests to no other host
+  struct bundle* bundle;    // NULL unless serving a bundle
+  struct bundle* embedded;  // NULL unless a site is built into the binary
+  struct bundle* preloaded;  // NULL unless --preload
+  struct pace_bucket egress;  // --egress-rate
+
+  // Whether files that are not in the page cache are read by the I/O
+  // pool rather than on the event loop.
+  int io_pool;
+
+  // Whether hot files are kept in the content cache. It needs change
+  // notification to stay fresh.
+  int cache;
+
+  // Held open so that one can be released to accept and close a
+  // connection when the process runs out of descriptors.
+  int reserve_fd;
+};
 
-  // Date: Sun, 07 Sep 2014 14: 51:17 GMT
-  buffer_appendf(result, "Date: %s\r\n", time_buffer);
+static struct server server;
 
-  // TODO:
-  // Last-Modified: Sun, 07 Sep 2014 01: 37:26 GMT
-  // Content-Type:image / gif
+static volatile sig_atomic_t stats_requested;
 
-  max_age = 31536000;
-  buffer_appendf(result, "cache-control: public, max-age=%d\r\n", max_age);
+// `path` within the root of its virtual `host`, without the host's prefix.
+static const char* host_path(const struct host* host, const char* path) {
+  path += host->prefix_length;
+  return path + (*path == '/');
+}
 
-  // Content - Length:459211
+static uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-  buffer_set_content_type(result, uri);
+static uint64_t clock_ms(void) {
+  return clock_ns() / 1000000;
+}
 
-  buffer_appendf(result, "Content-Length: %d\r\n", length);
-  buffer_append(result, "Access-Control-Allow-Methods: GET\r\n");
-  buffer_append(result, "Access-Control-Allow-Origin: *\r\n");
-  buffer_append(result, "Server: Garcon 1.0\r\n");
-  buffer_append(result, "\r\n");
+static void connection_write(struct connection* c);
 
-  return result;
+// Wake the connections waiting for this one to load its file.
+static void connection_end_flight(struct connection* c) {
+  if (c->leading) {
+    c->leading = 0;
+    flight_end(c->path);
+  }
 }
 
-struct request {
-  const char* uri;
-  const char* user_agent;
-  const char* method;
-  const char* client_address;
-  const struct tm* time;
-};
+static void connection_close(struct connection* c) {
+  const uint64_t sent = c->output_sent + c->file_offset - c->file_start;
+  stats.bytes_sent += sent;
+  if (ratelimit_enabled(&server.options.rate_limits)) {
+    ratelimit_charge(c->address, sent, clock_ns());
+  }
+  timer_cancel(&server.timers, &c->timer);
+  connection_end_flight(c);
+  flight_leave(&c->flight);
+  // The socket of a WebSocket has been handed over to the hub.
+  if (c->socket != -1) {
+    event_remove(server.loop, c->socket);
+    if (c->zerocopy_pending) {
+      // Reset the connection rather than leave the kernel sending from
+      // memory that is about to be released.
+      struct linger linger = { 1, 0 };
+      setsockopt(c->socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    } else {
+      shutdown(c->socket, SHUT_RDWR);
+    }
+    close(c->socket);
+  }
+  if (c->file != -1 && !c->file_borrowed) {
+    close(c->file);
+    pagecache_unmap(c->map, c->file_length);
+  }
+  if (c->output_buffer) {
+    buffer_free(c->output_buffer);
+  }
+  if (c->body) {
+    cache_entry_release(c->body);
+  }
+  free(c->path);
+  listing_free(c->listing);
+  listing_text_free(&c->listing_text);
+  parser_data_destroy(&c->data);
+  stats.connections_active--;
+  free(c);
+}
 
-static void log_request(int status, const struct request* request) {
+static ssize_t read_at(int file, void* buffer, size_t length, off_t offset) {
+  ssize_t result;
+  do {
+    result = pread(file, buffer, length, offset);
+  } while (result == -1 && errno == EINTR);
+  return result;
+}
 
-  char time_buffer[time_buffer_size];
-  const size_t time_size = strftime(time_buffer,
-      time_buffer_size, "%FT%T%z", request->time);
+// Start reading `length` bytes of a large file from `offset` into the
+// page cache, so that they are there by the time the socket has room.
+static void file_readahead(int file, off_t offset, off_t length) {
+#ifdef __linux__
+  readahead(file, offset, length);
+#elif defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(file, offset, length, POSIX_FADV_WILLNEED);
+#else
+  (void)file;
+  (void)offset;
+  (void)length;
+#endif
+}
 
-  if (time_size == 0) {
-    // TODO: use longjmp back to the main loop rather than quitting
-    // the server
-    fprintf(stderr, "Error formatting time");
-    exit(EXIT_SUCCESS);
+// Hand the connection to the I/O pool while `work` reads from the disk.
+// Its socket is taken out of the event loop meanwhile, so that nothing
+// else touches the connection until `done` runs.
+static void connection_offload(struct connection* c,
+    void (*work)(struct io_job*), void (*done)(struct io_job*)) {
+  c->state = waiting_for_disk;
+  c->io.work = work;
+  c->io.done = done;
+  event_remove(server.loop, c->socket);
+  if (iopool_submit(&c->io) == -1) {
+    // No pool: do the work here, and carry on as if it had been done.
+    work(&c->io);
+    done(&c->io);
+    return;
   }
+  stats.io_offloaded++;
+}
 
-  // Log request in Apache "Combined Log Format"
-  // http://httpd.apache.org/docs/1.3/logs.html
-  // <ip-address> <identd> <user> [<time>] "<request>" <status> <bytes> "<Referer>" "<User-agent>"
-  // 123.65.150.10 - - [23/Aug/2010:03:50:59 +0000] "POST /wordpress3/wp-admin/admin-ajax.php HTTP/1.1" 200 2 "http://www.example.com/wordpress3/wp-admin/post-new.php" "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_4; en-US) AppleWebKit/534.3 (KHTML, like Gecko) Chrome/6.0.472.25 Safari/534.3"
-  // 127.0.0.1 - frank [10/Oct/2000:13:55:36 -0700] "GET /apache_pb.gif HTTP/1.0" 200 2326 "http://www.example.com/start.html" "Mozilla/4.08 [en] (Win98; I ;Nav)"
-  printf("%s - - [%s] %s %s %d \"%s\"\n",
-      request->client_address,
-      time_buffer,
-      request->method,
-      request->uri,
-      status,
-      request->user_agent);
+// Take the connection back from the I/O pool, or from waiting for
+// another connection's load. Returns 0 if it has been closed instead,
+// because it timed out in the meantime.
+static int connection_reclaim(struct connection* c) {
+  c->state = writing_response;
+  if (c->abandoned ||
+      event_add(server.loop, c->socket, EVENT_WRITE, &c->handler) == -1) {
+    connection_close(c);
+    return 0;
+  }
+  return 1;
 }
 
-static void send_error(int socket, int status, const struct request* request) {
-  buffer_t* buffer = buffer_new();
-  buffer_appendf(buffer, "http error %d", status);
+// Send `c->body` after the headers.
+static void connection_attach_body(struct connection* c) {
+  c->output[1].iov_base = c->body->data;
+  c->output[1].iov_len = c->body->length;
+  c->output_count = 2;
+#ifdef HAVE_ZEROCOPY
+  const long threshold = server.options.zerocopy_threshold;
+  if (threshold > 0 && c->body->length >= threshold * 1024) {
+    const int on = 1;
+    c->zerocopy = setsockopt(c->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+  }
+#endif
+}
 
-  int age = 0;
+// Send the body read into `c->body` in place of the file, and offer it
+// to the content cache.
+static void connection_use_body(struct connection* c) {
+  connection_attach_body(c);
+  close(c->file);
+  c->file = -1;
+  c->file_length = 0;
+
+  if (c->cacheable) {
+    // Take in any change notified while the file was being read, so that
+    // the generation check below sees it. The entry keeps the file's
+    // header lines, so that a hit need not look them up.
+    watch_dispatch();
+    c->body->rules = rules_headers(c->host->rules, host_path(c->host, c->path),
+        strlen(host_path(c->host, c->path)));
+    c->body->quota = c->host->quota.limit ? &c->host->quota : NULL;
+    cache_insert(c->body, c->path, strlen(c->path), c->cache_generation);
+  }
+}
 
-  buffer_t* headers = response_headers(buffer_length(buffer), age, request->time, request->uri);
-  int header_bytes_written = write(socket, headers->data, buffer_length(headers));
-  buffer_free(headers);
+// Pool thread: read a small file that is not in the page cache.
+static void read_body_work(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  c->io_result = read_at(c->file, c->body->data, c->file_length, 0);
+}
 
-  if (header_bytes_written == -1) {
-    fputs("Error -1 writting error headers to socket\n", stderr);
+static void read_body_done(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  if (c->io_result == c->file_length) {
+    connection_use_body(c);
+  } else {
+    cache_entry_release(c->body);
+    c->body = NULL;
   }
+  connection_end_flight(c);
+  if (connection_reclaim(c)) {
+    connection_write(c);
+  }
+}
 
-  int written = write(socket, buffer->data, buffer_length(buffer));
-  if (written == -1){
-    fprintf(stderr, "Error -1 writing error message to socket");
+// Read a small or cacheable file in after the headers, so that the whole
+// response goes out in one write. Returns 1 if it was read, 0 if it is
+// left to sendfile(), or -1 if it is not in the page cache and the I/O
+// pool is reading it, after which the response carries on.
+static int connection_read_body(struct connection* c) {
+  c->body = cache_entry_new(c->file_length);
+  if (!c->body) {
+    return 0;
+  }
+  ssize_t length;
+  if (server.io_pool) {
+    length = pagecache_read(c->file, c->body->data, c->file_length, 0);
+    if (length != c->file_length && (length >= 0 || errno == EAGAIN)) {
+      connection_offload(c, read_body_work, read_body_done);
+      return -1;
+    }
+  } else {
+    length = read_at(c->file, c->body->data, c->file_length, 0);
   }
-  buffer_free(buffer);
-  log_request(status, request);
+  if (length != c->file_length) {
+    cache_entry_release(c->body);
+    c->body = NULL;
+    return 0;
+  }
+  connection_use_body(c);
+  return 1;
 }
 
-static int buffer_endswith_char(buffer_t *self, char ch) {
-  size_t len = buffer_length(self);
-  return len > 0 && buffer_string(self)[len-1] == ch;
+// Pool thread: bring the next chunk of a large file into the page cache.
+static void warm_file_work(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  char buffer[64 * 1024];
+  off_t end = c->file_offset + send_chunk_size;
+  if (end > c->file_length) {
+    end = c->file_length;
+  }
+  file_readahead(c->file, c->file_offset, end - c->file_offset);
+  for (off_t offset = c->file_offset; offset < end; offset += sizeof(buffer)) {
+    if (read_at(c->file, buffer, sizeof(buffer), offset) <= 0) {
+      break;
+    }
+  }
+  c->warm_offset = end;
 }
 
-void remove_query_string(buffer_t **path) {
-  const ssize_t pos = buffer_indexof(*path, "?");
+static void warm_file_done(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  if (connection_reclaim(c)) {
+    connection_write(c);
+  }
+}
 
-  if (pos == -1) {
+// Hold the connection to the --pace rate for the file of `length` bytes
+// at `path` that it is about to be sent, by the kernel if it can.
+static void connection_pace(struct connection* c, const char* path, off_t length) {
+  const uint64_t rate = c->head ? 0 : pacing_rate(path, length);
+  if (rate == 0) {
     return;
   }
+  if (pacing_set_socket_rate(c->socket, rate) == 0) {
+    stats.paced_kernel++;
+  } else {
+    pace_bucket_init(&c->pace, rate);
+    stats.paced_userspace++;
+  }
+}
+
+// Whether the body is larger than a chunk, or is a listing too large to
+// keep, and so waits for --egress-rate.
+static int connection_large_body(const struct connection* c) {
+  const off_t memory = c->body ? (off_t)c->body->length :
+    c->static_body ? (off_t)c->static_length : 0;
+  return c->listing || c->file_length - c->file_start + memory > send_chunk_size;
+}
+
+// How much of the next `length` bytes of the response the connection's
+// own bucket and, for a large body, the server's let go now. If none may
+// yet, returns 0 and sets `*delay` to the nanoseconds until some may.
+static off_t paced_length(struct connection* c, off_t length, uint64_t* delay) {
+  const uint64_t now = clock_ns();
+  const uint64_t least = length < pace_quantum ? length : pace_quantum;
+  length = pace_allowance(&c->pace, now, length, least, delay);
+  if (length > 0 && connection_large_body(c)) {
+    length = pace_allowance(&server.egress, now, length, least, delay);
+  }
+  return length;
+}
+
+static void connection_charge(struct connection* c, uint64_t sent) {
+  if (c->pace.interval || server.egress.interval) {
+    const uint64_t now = clock_ns();
+    pace_charge(&c->pace, now, sent);
+    pace_charge(&server.egress, now, sent);
+  }
+}
+
+// Leave the connection out of the event loop for `delay` nanoseconds,
+// until its buckets let more of the response go.
+static void connection_pause(struct connection* c, uint64_t delay) {
+  c->state = waiting_for_pace;
+  event_modify(server.loop, c->socket, 0, &c->handler);
+  timer_add(&server.timers, &c->timer, clock_ms() + delay / 1000000 + 1);
+  stats.pace_waits++;
+}
+
+// Queue a response and start sending it. `file` is closed
+// once the response is complete.
+static void connection_send(struct connection* c, int status,
+    const char* output, size_t output_length, int file, off_t file_length) {
+  if (c->head) {
+    // The headers, Content-Length and all, are as for GET, but nothing
+    // of the body is read or sent.
+    if (file != -1 && !c->file_borrowed) {
+      close(file);
+    }
+    file = -1;
+    file_length = 0;
+  }
+  c->state = writing_response;
+  c->status = status;
+  c->output[0].iov_base = (char*)output;
+  c->output[0].iov_len = output_length;
+  c->output_index = 0;
+  c->output_count = 1;
+  c->output_sent = 0;
+  c->file = file;
+  c->file_offset = c->file_start;
+  c->file_length = c->file_start + file_length;
+  c->readahead_offset = c->file_start;
+  timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+
+  if (c->head) {
+    // Only the headers go out.
+  } else if (c->body) {
+    connection_attach_body(c);
+  } else if (c->static_body) {
+    c->output[1].iov_base = (char*)c->static_body;
+    c->output[1].iov_len = c->static_length;
+    c->output_count = 2;
+  } else if (file != -1 && file_length > 0 && !c->file_borrowed &&
+      (file_length <= small_body_size || c->cacheable)) {
+    if (connection_read_body(c) == -1) {
+      return;
+    }
+  } else if (file_length > 0 && !c->file_borrowed) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (server.io_pool) {
+      c->map = pagecache_map(file, file_length);
+    }
+  }
+  connection_end_flight(c);
+  connection_write(c);
+}
+
+static void connection_respond(struct connection* c, int status,
+    buffer_t* output, int file, off_t file_length) {
+  c->output_buffer = output;
+  connection_send(c, status, output->data, buffer_length(output), file, file_length);
+}
 
-  buffer_t *result = buffer_slice(*path, 0, pos);
-  buffer_free(*path);
-  *path = result;
+static void send_error(struct connection* c, int status) {
+  size_t length;
+  const char* response = error_response(status, time(NULL), &length);
+  if (c->head) {
+    length = strstr(response, "\r\n\r\n") + 4 - response;
+  }
+  connection_send(c, status, response, length, -1, 0);
 }
 
 // Return 1 if the given file descriptor
@@ -247,242 +680,1568 @@ static int is_regular_file(int fd, off_t *file_length) {
   return S_ISREG(stat.st_mode);
 }
 
-static ssize_t send_file_to_socket(const int fd, const int socket, off_t length) {
+// Send up to `length` bytes of `fd` from `*offset`, advancing `*offset`
+// by the number of bytes sent. Returns that number, or -1 with errno set.
+static ssize_t send_file_to_socket(const int fd, const int socket, off_t *offset, off_t length) {
 #ifdef __linux__
-  off_t off = 0;
-  return sendfile(socket, fd, &off, length);
+  return sendfile(socket, fd, offset, length);
 #else
-  return sendfile(fd, socket, 0, &length, 0, 0);
+  // Darwin reports the bytes sent in `length`, even when the
+  // socket would block part way through.
+  const int result = sendfile(fd, socket, *offset, &length, 0, 0);
+  *offset += length;
+  if (result == -1 && (errno != EAGAIN || length == 0)) {
+    return -1;
+  }
+  return length;
 #endif
 }
 
-
-static void send_file(
-    int socket,
-    const char *root,
-    const struct request *request)
-{
-  buffer_t *buffer = buffer_new();
-  buffer_append(buffer, root);
-  buffer_append(buffer, request->uri);
-  remove_query_string(&buffer);
-  if (buffer_endswith_char(buffer, '/')) {
-    buffer_append(buffer, default_filename);
+// Watch the nearest existing directory above a missing path, so that
+// creating anything on the way to it invalidates the negative cache.
+static void watch_missing_path(const char* path) {
+  char directory[PATH_MAX];
+  size_t length = strlen(path);
+  for (;;) {
+    while (length > 0 && path[length - 1] != '/') {
+      --length;
+    }
+    if (length > 0) {
+      --length;
+    }
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+    if (watch_add(directory) == 0 || length == 0 ||
+        (errno != ENOENT && errno != ENOTDIR)) {
+      return;
+    }
   }
+}
 
-  int file = open(buffer->data, O_RDONLY);
-  if (file <= 0) {
-    send_error(socket, 404, request);
-    return;
-  }
-  buffer_free(buffer);
+// Copy the directory part of `path`, "" for the root, into `directory`.
+static void parent_directory(const char* path, char* directory) {
+  const char* slash = strrchr(path, '/');
+  const size_t length = slash ? (size_t)(slash - path) : 0;
+  memcpy(directory, path, length);
+  directory[length] = '\0';
+}
 
-  off_t file_length;
-  if (!is_regular_file(file, &file_length)) {
-    send_error(socket, 403, request);
-    return;
+static void open_requested(const struct host* host, const char* path, int cached,
+    struct open_result* result) {
+  result->file = open_beneath(host->root_fd, host_path(host, path), cached);
+  result->error = errno;
+  if (result->file != -1) {
+    result->regular = is_regular_file(result->file, &result->length);
   }
+}
 
-  // TODO set a max age header
-  {
-    buffer_t *headers = response_headers(file_length, 0, request->time, request->uri);
-    write(socket, headers->data, buffer_length(headers));
-    buffer_free(headers);
-  }
+// Whether `path` is the index.html that request_path() added to a
+// request for a directory, rather than one that was asked for.
+static int names_directory(const char* uri, const char* path, size_t length) {
+  static const char index[] = "index.html";
+  const size_t index_length = sizeof(index) - 1;
+  const size_t uri_length = strcspn(uri, "?");
+  return length >= index_length &&
+    memcmp(path + length - index_length, index, index_length) == 0 &&
+    (length == index_length || path[length - index_length - 1] == '/') &&
+    !(uri_length >= index_length &&
+        memcmp(uri + uri_length - index_length, index, index_length) == 0);
+}
+
+static void send_listing_body(struct connection* c) {
+  buffer_t* headers = listing_response_headers(c->body->length, 0, c->request.time,
+      listing_content_type(c->listing_format));
+  connection_respond(c, 200, headers, -1, 0);
+}
 
-  ssize_t result = send_file_to_socket(file, socket, file_length);
-  close(file);
+// Answer with the kept listing of the directory `path` ("dir/index.html")
+// is in. A watched directory's listing is dropped when it changes, and
+// any other is checked against the directory's modification time.
+// Returns 0 if there is none.
+static int send_cached_listing(struct connection* c, const char* path) {
+  char directory[PATH_MAX];
+  parent_directory(path, directory);
+  const char* accept = map_get(c->data.headers, "Accept");
+  c->listing_format = accept && strstr(accept, "application/json") ? LISTING_JSON : LISTING_HTML;
 
-  if (result == -1) {
-    perror("sendfile");
-    return;
+  struct stat stat;
+  const int watched = watch_add(directory) == 0;
+  const char* relative = host_path(c->host, directory);
+  if (!watched && fstatat(c->host->root_fd, *relative ? relative : ".", &stat, 0) == -1) {
+    return 0;
+  }
+  c->body = listing_cache_lookup(directory, c->listing_format, watched ? NULL : &stat.st_mtim);
+  if (!c->body) {
+    return 0;
   }
-  log_request(200, request);
+  stats.listing_hits++;
+  send_listing_body(c);
+  return 1;
 }
 
-int open_connection(int port)
-{
-  const int create_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (create_socket < 1) {
-    perror("opening socket\n");
-    exit(EXIT_FAILURE);
+// Render the next piece of a listing that is too large to keep into
+// `output`, framed as a chunk if the client speaks HTTP/1.1. Returns 0
+// once the listing has all been sent.
+static int connection_next_listing_piece(struct connection* c) {
+  struct listing_text* text = &c->listing_text;
+  if (!c->listing || c->listing_next > c->listing->count) {
+    return 0;
   }
-
-  const int yes = 1;
-  if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-    perror("setsockopt");
-    exit(EXIT_FAILURE);
+  const size_t start = c->listing_chunked ? chunk_header_size : 0;
+  text->length = start;
+  const size_t next = listing_render(c->listing, c->listing_format, c->listing_next,
+      start + listing_piece_size, text);
+  if (next == 0) {
+    // Out of memory: cut the response short, which the client can tell.
+    return 0;
   }
+  c->listing_next = next;
+  c->output_index = 0;
+  c->output_count = 1;
+  c->output[0].iov_base = text->data;
+  c->output[0].iov_len = text->length;
+  if (c->listing_chunked) {
+    char header[chunk_header_size + 1];
+    const int header_length = snprintf(header, sizeof(header), "%zx\r\n", text->length - start);
+    c->output[0].iov_base = text->data + start - header_length;
+    c->output[0].iov_len = text->length - start + header_length;
+    memcpy(c->output[0].iov_base, header, header_length);
+    const char* end = c->listing_next > c->listing->count ? "\r\n0\r\n\r\n" : "\r\n";
+    c->output[1].iov_base = (char*)end;
+    c->output[1].iov_len = strlen(end);
+    c->output_count = 2;
+  }
+  return 1;
+}
 
-  struct sockaddr_in address;
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(port);
-
-  const int bound = bind(create_socket, (struct sockaddr *)&address, sizeof(address));
+// Answer with the listing that has been read into `c->listing`. One
+// small enough is rendered and kept; a larger one is rendered a piece
+// at a time as the socket takes it.
+static void send_read_listing(struct connection* c) {
+  if (c->io_result == -1) {
+    const int error = c->opened.error;
+    send_error(c, error == ENOENT || error == ENOTDIR ? 404 : error == ENOMEM ? 503 : 403);
+    return;
+  }
+  stats.listing_reads++;
+
+  const char* type = listing_content_type(c->listing_format);
+  if (c->listing->count > listing_stream_entries) {
+    stats.listing_streamed++;
+    c->listing_chunked = c->parser.http_major > 1 ||
+      (c->parser.http_major == 1 && c->parser.http_minor >= 1);
+    connection_respond(c, 200, listing_response_headers(-1, c->listing_chunked,
+          c->request.time, type), -1, 0);
+    return;
+  }
 
-  if (bound != 0) {
-    fprintf(stderr, "Failed to bind to port %d", port);
-    perror(" ");
-    exit(EXIT_FAILURE);
+  // Take in any change notified while the directory was being read, so
+  // that the generation check sees it.
+  watch_dispatch();
+  c->body = listing_cache_insert(c->listing, c->listing_format, c->listing_generation);
+  listing_free(c->listing);
+  c->listing = NULL;
+  if (!c->body) {
+    send_error(c, 503);
+    return;
   }
+  send_listing_body(c);
+}
 
-  return create_socket;
+// Pool thread: read a directory for its listing.
+static void read_listing_work(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  c->io_result = listing_read(c->host->root_fd, c->listing);
+  c->opened.error = errno;
 }
 
+static void read_listing_done(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  if (connection_reclaim(c)) {
+    send_read_listing(c);
+  }
+}
 
-struct options {
-  char* root;
-  long int port;
-};
+// Answer a request for a directory that has no index.html at `path`
+// with a listing of it.
+static void send_listing(struct connection* c, const char* path) {
+  if (send_cached_listing(c, path)) {
+    return;
+  }
+  char directory[PATH_MAX];
+  parent_directory(path, directory);
+  c->listing_generation = listing_cache_generation();
+  c->listing = listing_new(directory, c->host->prefix_length);
+  if (!c->listing) {
+    send_error(c, 503);
+    return;
+  }
+  if (server.io_pool) {
+    timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+    connection_offload(c, read_listing_work, read_listing_done);
+    return;
+  }
+  c->io_result = listing_read(c->host->root_fd, c->listing);
+  c->opened.error = errno;
+  send_read_listing(c);
+}
 
-static void init_options(struct options* options) {
-  options->port = 8888;
-  options->root = getcwd(0, 0);
+// Send the client to the directory `uri` names, with a slash on the end,
+// so that the links in its listing resolve beneath it.
+static void send_directory_redirect(struct connection* c, const char* uri) {
+  const size_t length = strcspn(uri, "?");
+  buffer_t* location = buffer_new();
+  buffer_append_n(location, uri, length);
+  buffer_append(location, "/");
+  buffer_append(location, uri + length);
+  connection_respond(c, 301, redirect_headers(c->request.time, location->data), -1, 0);
+  buffer_free(location);
 }
 
-static void set_root(command_t *self) {
-  struct options* options = self->data;
-  options->root = realpath(self->arg, NULL);
-  if (!options->root) {
-    fprintf(stderr, "Cannot find directory %s", self->arg);
-    exit(EXIT_FAILURE);
+// Answer a request for `path` once it has been opened, or has failed to.
+static void respond_with_file(struct connection* c, const char* path, uint64_t negative_key) {
+  const struct open_result* opened = &c->opened;
+  if (opened->file == -1 || !opened->regular) {
+    connection_end_flight(c);
+  }
+  if (opened->file == -1) {
+    const int error = opened->error;
+    const int missing = error == ENOENT || error == ENOTDIR;
+    const int denied = error == EACCES || error == EPERM || error == EXDEV || error == ELOOP;
+    if (missing && server.options.listings &&
+        names_directory(c->request.uri, path, strlen(path))) {
+      send_listing(c, path);
+      return;
+    }
+    if (missing && server.options.negative_cache_size > 0 &&
+        negcache_insert(negative_key, clock_ms())) {
+      stats.negative_cache_inserts++;
+      watch_missing_path(path);
+    }
+    send_error(c, denied ? 403 : 404);
+    return;
   }
-}
 
-static void set_port(command_t *self) {
-  struct options* options = self->data;
-  char* endptr = 0;
-  options->port = strtol(self->arg, &endptr, 10);
-  if (*endptr) {
-    fprintf(stderr, "Error: invalid port number: %s\n", self->arg);
-    exit(EXIT_FAILURE);
+  if (!opened->regular) {
+    struct stat stat;
+    const int directory = server.options.listings &&
+      fstat(opened->file, &stat) == 0 && S_ISDIR(stat.st_mode);
+    close(opened->file);
+    if (directory) {
+      send_directory_redirect(c, c->request.uri);
+    } else {
+      send_error(c, 403);
+    }
+    return;
   }
 
-  if (options->port > USHRT_MAX) {
-    fprintf(stderr, "Error: port number %ld is larger than the max %d\n",
-        options->port,
-        USHRT_MAX);
-    exit(EXIT_FAILURE);
+  // Files are only cached in directories that are watched for changes,
+  // and live reload is told of changes to the files it has served.
+  char directory[PATH_MAX];
+  parent_directory(path, directory);
+  if (server.cache && cache_admits(opened->length)) {
+    cache_miss();
+    if (watch_add(directory) == 0 && (c->path || (c->path = strdup(path)))) {
+      c->cacheable = 1;
+    }
+  } else if (server.options.live_reload) {
+    watch_add(directory);
+  }
+  if (!c->cacheable) {
+    connection_end_flight(c);
   }
+
+  const char* relative = host_path(c->host, path);
+  buffer_t *headers = response_headers(opened->length,
+      rules_headers(c->host->rules, relative, strlen(relative)), c->request.time, path);
+  connection_pace(c, relative, opened->length);
+  connection_respond(c, 200, headers, opened->file, opened->length);
 }
 
-int main(int argc, char **argv)
-{
-  struct options options;
-  init_options(&options);
+// Pool thread: open a file whose path is not in the kernel's caches.
+static void open_file_work(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  open_requested(c->host, c->path, 0, &c->opened);
+}
 
-  command_t cmd;
-  cmd.data = &options;
-  command_init(&cmd, argv[0], "0.0.1");
-  command_option(&cmd, "-d", "--directory [arg]", "The root directory to serve files from (default to the current working directory)", set_root);
-  command_option(&cmd, "-p", "--port [arg]", "Which port to listen on (default 8888)", set_port);
-  command_parse(&cmd, argc, argv);
+static void open_file_done(struct io_job* job) {
+  struct connection* c = container_of(job, struct connection, io);
+  if (connection_reclaim(c)) {
+    respond_with_file(c, c->path, c->negative_key);
+  }
+}
 
-  printf("Garçon! Serving content from %s on http://localhost:%ld/\n", options.root, options.port);
+// Whether an Accept-Encoding header allows gzip: it lists "gzip" or
+// "*", without q=0.
+static int accepts_gzip(const char* accept_encoding) {
+  for (const char* token = accept_encoding; token && *token;) {
+    token += strspn(token, " \t,");
+    const size_t length = strcspn(token, " \t,;");
+    const char* end = token + strcspn(token, ",");
+    if ((length == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+        (length == 1 && *token == '*')) {
+      const char* q = strstr(token, "q=");
+      return !(q && q < end && strtod(q + 2, NULL) == 0);
+    }
+    token = end;
+  }
+  return 0;
+}
 
-  const int socket = open_connection(options.port);
+// Answer from a bundle: a hash probe in memory, then sendfile() from
+// the bundle at the file's offset, or a write straight from memory if it
+// is built into the binary. Returns 0 if the path is not in the bundle.
+static int send_packed_file(struct connection* c, const struct bundle* bundle,
+    const char* path, size_t path_length) {
+  struct bundle_file file;
+  if (!bundle_lookup(bundle, path, path_length, &file)) {
+    return 0;
+  }
 
-  http_parser_settings settings;
-  memset(&settings, 0, sizeof(http_parser_settings));
-  settings.on_url = on_url;
-  settings.on_header_value = on_header_value;
-  settings.on_header_field = on_header_field;
-  settings.on_message_complete = on_message_complete;
+  // The compressed variant is a representation of its own, with an ETag
+  // of its own.
+  const int gzip = file.gzip_length > 0 &&
+    accepts_gzip(map_get(c->data.headers, "Accept-Encoding"));
+  const char* etag = gzip ? file.gzip_etag : file.etag;
+  const char* rules = rules_headers(server.default_host.rules, path, path_length);
+  const char* if_none_match = map_get(c->data.headers, "If-None-Match");
+  if (if_none_match && strstr(if_none_match, etag)) {
+    connection_respond(c, 304, not_modified_headers(rules, c->request.time, etag), -1, 0);
+    return 1;
+  }
 
-  if (listen(socket, 10) < 0) {
-    perror("server: listen");
-    exit(EXIT_FAILURE);
+  const off_t offset = gzip ? file.gzip_offset : file.offset;
+  const off_t length = gzip ? file.gzip_length : file.length;
+  buffer_t* headers = packed_response_headers(length, rules, c->request.time,
+      file.content_type, etag, gzip);
+  connection_pace(c, path, length);
+  if (bundle->fd == -1) {
+    c->static_body = bundle->map + offset;
+    c->static_length = length;
+    connection_respond(c, 200, headers, -1, 0);
+    return 1;
+  }
+  c->file_borrowed = 1;
+  c->file_start = offset;
+  if (server.io_pool) {
+    c->map = (void*)bundle->map;
   }
+  connection_respond(c, 200, headers, bundle->fd, length);
+  return 1;
+}
 
-    struct sockaddr_in address;
-    socklen_t addrlen;
+static void send_file(struct connection *c, const struct request *request) {
+  // A virtual host's paths are kept apart from the others' by its prefix.
+  char path[PATH_MAX];
+  struct host* host = c->host;
+  const size_t prefix_length = host->prefix_length ? host->prefix_length + 1 : 0;
+  memcpy(path, host->prefix, host->prefix_length);
+  path[host->prefix_length] = '/';
+  int path_length = request_path(request->uri, path + prefix_length, sizeof(path) - prefix_length);
+  if (path_length == -1) {
+    send_error(c, 400);
+    return;
+  }
+  path_length += prefix_length;
 
-http:
-  for(;;) {
-    //xkcd.com/292/
+  // The site built into the binary comes first; what it does not have
+  // is looked for in the bundle or the directory being served.
+  const int main_root = host == &server.default_host;
+  if (main_root && server.embedded && send_packed_file(c, server.embedded, path, path_length)) {
+    return;
+  }
+  if (main_root && server.preloaded &&
+      send_packed_file(c, server.preloaded, path, path_length)) {
+    return;
+  }
+  if (server.bundle) {
+    if (!send_packed_file(c, server.bundle, path, path_length)) {
+      send_error(c, 404);
+    }
+    return;
+  }
 
-    const int new_socket = accept(socket, (struct sockaddr *)&address, &addrlen);
+  // A repeat listing is answered before looking for the index.html that
+  // was missing when it was made: its directory has not changed since.
+  if (server.options.listings && names_directory(request->uri, path, path_length) &&
+      send_cached_listing(c, path)) {
+    return;
+  }
 
-    if (new_socket <= 0) {
-      perror("accept");
-      exit(EXIT_FAILURE);
+  if (server.cache) {
+    c->body = cache_lookup(path, path_length);
+    if (c->body) {
+      buffer_t* headers = response_headers(c->body->length, c->body->rules, request->time, path);
+      connection_pace(c, host_path(host, path), c->body->length);
+      connection_respond(c, 200, headers, -1, 0);
+      return;
     }
+    c->cache_generation = cache_generation();
+  }
 
-    struct parser_data data;
-    parser_data_init(&data, inet_ntoa(address.sin_addr));
-
-    // TODO: anything to free()?
-    http_parser parser;
-    http_parser_init(&parser, HTTP_REQUEST);
-    parser.data = &data;
+  uint64_t negative_key = 0;
+  if (server.options.negative_cache_size > 0) {
+    negative_key = negcache_key(path, path_length);
+    if (negcache_contains(negative_key, clock_ms())) {
+      stats.negative_cache_hits++;
+      send_error(c, 404);
+      return;
+    }
+  }
 
-    for (;;) {
+  // Of the connections that miss the cache for a path at the same time,
+  // only the first loads the file.
+  if (server.cache && !c->follower && (c->path || (c->path = strdup(path)))) {
+    if (!flight_begin(path, path_length, &c->flight)) {
+      c->state = waiting_for_load;
+      event_remove(server.loop, c->socket);
+      timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+      stats.cache_coalesced++;
+      return;
+    }
+    c->leading = 1;
+  }
 
-      const int len = 1024;
-      char buf[len];
+  // With the I/O pool running, the event loop only opens files whose
+  // paths the kernel can resolve without going to the disk or network.
+  open_requested(host, path, server.io_pool, &c->opened);
+  if (c->opened.file == -1 && c->opened.error == EAGAIN && server.io_pool) {
+    if (c->path || (c->path = strdup(path))) {
+      c->negative_key = negative_key;
+      timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+      connection_offload(c, open_file_work, open_file_done);
+      return;
+    }
+    open_requested(host, path, 0, &c->opened);
+  }
+  respond_with_file(c, path, negative_key);
+}
 
-      // Read data from the socket
-      const ssize_t recved = recv(new_socket, buf, len, 0);
+// The load this connection was waiting for is over: look again.
+static void connection_flight_done(struct flight_waiter* waiter) {
+  struct connection* c = container_of(waiter, struct connection, flight);
+  c->follower = 1;
+  if (connection_reclaim(c)) {
+    send_file(c, &c->request);
+  }
+}
 
-      if (recved == 0) {
-        break;
+// Write as much of the response as the socket will take. The connection
+// is closed once the response is complete or the client goes away.
+static void connection_write(struct connection* c) {
+  int progress = 0;
+  int pieces = 0;
+
+again:
+  while (c->output_index < c->output_count) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = c->output + c->output_index;
+    message.msg_iovlen = c->output_count - c->output_index;
+
+    // A body in memory is held to the buckets as a file is, by sending
+    // only as much of it as they allow.
+    struct iovec paced[2];
+    if (c->pace.interval || server.egress.interval) {
+      off_t length = 0;
+      for (size_t i = 0; i < message.msg_iovlen; ++i) {
+        length += message.msg_iov[i].iov_len;
       }
-
-      if (recved == -1) {
-        perror("Error reading request from network");
-        goto http;
+      uint64_t delay;
+      off_t allowed = paced_length(c, length, &delay);
+      if (allowed == 0) {
+        connection_pause(c, delay);
+        return;
       }
-      // Start up / continue the parser. Note we pass recved==0 to
-      // signal that EOF has been received.
-      const ssize_t nparsed = http_parser_execute(&parser, &settings, buf, recved);
-
-      if (nparsed != recved) {
-        fprintf(stderr, "Error parsing HTTP header\n");
-        goto http;
+      if (allowed < length) {
+        size_t count = 0;
+        for (; allowed > 0; ++count) {
+          paced[count] = message.msg_iov[count];
+          if ((off_t)paced[count].iov_len > allowed) {
+            paced[count].iov_len = allowed;
+          }
+          allowed -= paced[count].iov_len;
+        }
+        message.msg_iov = paced;
+        message.msg_iovlen = count;
       }
+    }
 
-      if (data.complete || http_body_is_final(&parser)) {
-        break;
+    // Hold the headers back until sendfile() follows them with the
+    // start of the file, so that they share a packet.
+    int flags = c->file_offset < c->file_length ? MSG_MORE : 0;
+#ifdef HAVE_ZEROCOPY
+    if (c->zerocopy) {
+      flags |= MSG_ZEROCOPY;
+    }
+#endif
+    ssize_t sent = sendmsg(c->socket, &message, flags);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
       }
+#ifdef HAVE_ZEROCOPY
+      if (c->zerocopy && errno == ENOBUFS) {
+        // Out of memory to pin pages with: copy the rest instead.
+        c->zerocopy = 0;
+        continue;
+      }
+#endif
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        goto blocked;
+      }
+      perror("Error writing response to socket");
+      connection_close(c);
+      return;
+    }
+    c->output_sent += sent;
+    connection_charge(c, sent);
+    progress = 1;
+#ifdef HAVE_ZEROCOPY
+    if (c->zerocopy) {
+      c->zerocopy_pending++;
+      stats.zerocopy_sends++;
+      stats.zerocopy_bytes += sent;
     }
+#endif
 
+    while (c->output_index < c->output_count &&
+        (size_t)sent >= c->output[c->output_index].iov_len) {
+      sent -= c->output[c->output_index].iov_len;
+      c->output_index++;
+    }
+    if (c->output_index < c->output_count) {
+      struct iovec* partial = &c->output[c->output_index];
+      partial->iov_base = (char*)partial->iov_base + sent;
+      partial->iov_len -= sent;
+    }
+  }
 
-     const int headers = 0;
+  // Send the file a chunk at a time, so that one fast client cannot keep
+  // the others waiting, and so that each sendfile() call stays below the
+  // ~2 GiB that Linux will send at once.
+  off_t budget = send_chunk_size;
+  while (c->file_offset < c->file_length) {
+    if (budget == 0) {
+      // The socket is still writable, so the connection's turn comes
+      // round again on the next pass of the event loop.
+      goto blocked;
+    }
 
-    if (headers) {
-      puts("Headers");
-      for (struct map_node_t* node = data.headers->head; node; node = node->next) {
-        if (node->value) {
-          printf("%s: %s\n", node->key, (const char*)node->value);
-        }
-      }
+    if (c->readahead_offset < c->file_length &&
+        c->readahead_offset < c->file_offset + send_chunk_size) {
+      file_readahead(c->file, c->readahead_offset, readahead_size);
+      c->readahead_offset += readahead_size;
     }
 
-    struct request request;
-    request.user_agent = map_get(data.headers, "User-Agent");
-    request.client_address = data.client_address;
-    request.time = &data.timeinfo;
-    request.uri = data.url->data;
-    request.method = http_method_str(parser.method);
-
-    if (parser.http_errno) {
-      request.user_agent = "";
-      request.method = "";
-      request.uri = "BAD REQUEST";
-      send_error(new_socket, 400, &request);
-    } else if (parser.method != HTTP_GET) {
-      send_error(new_socket, 405, &request);
-    } else if (parser.upgrade) {
-      /* handle new protocol */
-    } else {
-      send_file(new_socket, options.root, &request);
+    off_t length = c->file_length - c->file_offset;
+    if (length > budget) {
+      length = budget;
     }
-    parser_data_destroy(&data);
-    shutdown(new_socket, SHUT_RDWR);
-    close(new_socket);
+    if (c->pace.interval || server.egress.interval) {
+      uint64_t delay;
+      length = paced_length(c, length, &delay);
+      if (length == 0) {
+        connection_pause(c, delay);
+        return;
+      }
+    }
+    if (c->file_offset >= c->warm_offset &&
+        !pagecache_resident(c->map, c->file_offset, length)) {
+      if (progress) {
+        timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+      }
+      connection_offload(c, warm_file_work, warm_file_done);
+      return;
+    }
+
+    const ssize_t sent = send_file_to_socket(c->file, c->socket, &c->file_offset, length);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        goto blocked;
+      }
+      perror("sendfile");
+      connection_close(c);
+      return;
+    }
+    if (sent == 0) {
+      // The file was truncated while we were sending it.
+      connection_close(c);
+      return;
+    }
+    connection_charge(c, sent);
+    budget -= sent;
+    progress = 1;
+  }
+
+  // A listing too large to keep is rendered a piece at a time, as the
+  // socket takes the one before.
+  if (c->listing && !c->head && c->listing_next <= c->listing->count) {
+    if (pieces++ == send_chunk_size / listing_piece_size) {
+      goto blocked;
+    }
+    if (connection_next_listing_piece(c)) {
+      goto again;
+    }
+  }
+
+  log_request(c->status, &c->request);
+  if (c->status == 101) {
+    // The hub takes the socket from here.
+    const int socket = c->socket;
+    const char* prefix = c->host->prefix;
+    event_remove(server.loop, socket);
+    c->socket = -1;
+    connection_close(c);
+    hub_subscribe(socket, prefix);
+    return;
+  }
+  if (c->zerocopy_pending) {
+    // Keep the body until the kernel says it has finished with it. The
+    // completions arrive on the error queue, which is always reported.
+    c->state = waiting_for_zerocopy;
+    event_modify(server.loop, c->socket, 0, &c->handler);
+    return;
+  }
+  connection_close(c);
+  return;
+
+blocked:
+  if (progress) {
+    timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+  }
+  event_modify(server.loop, c->socket, EVENT_WRITE, &c->handler);
+}
+
+// Whether `uri` is the path WebSockets for live reload are opened at.
+static int is_live_reload(const char* uri) {
+  const char* path = server.options.live_reload;
+  const size_t length = strcspn(uri, "?");
+  return path && strlen(path) == length && memcmp(uri, path, length) == 0;
+}
+
+// Answer a WebSocket handshake with a 101, after which the hub has the
+// connection.
+static void send_upgrade(struct connection* c) {
+  const char* upgrade = map_get(c->data.headers, "Upgrade");
+  const char* key = map_get(c->data.headers, "Sec-WebSocket-Key");
+  const char* version = map_get(c->data.headers, "Sec-WebSocket-Version");
+  if (c->head || !upgrade || strcasecmp(upgrade, "websocket") != 0 ||
+      !key || strlen(key) != 24 || !version || strcmp(version, "13") != 0) {
+    send_error(c, 400);
+    return;
+  }
+  char accept[hub_accept_size];
+  hub_accept_key(key, accept);
+  connection_respond(c, 101, upgrade_headers(c->request.time, accept), -1, 0);
+}
+
+static void connection_handle_request(struct connection* c) {
+  struct parser_data* data = &c->data;
+  http_parser* parser = &c->parser;
+
+  stats.requests++;
+
+  const int headers = 0;
+
+  if (headers) {
+    puts("Headers");
+    for (struct map_node_t* node = data->headers->head; node; node = node->next) {
+      if (node->value) {
+        printf("%s: %s\n", node->key, (const char*)node->value);
+      }
+    }
+  }
+
+  struct request* request = &c->request;
+  request->user_agent = map_get(data->headers, "User-Agent");
+  request->client_address = data->client_address;
+  request->time = &data->timeinfo;
+  request->uri = data->url->data;
+  request->method = http_method_str(parser->method);
+  c->head = parser->method == HTTP_HEAD && !parser->http_errno;
+  c->host = hosts_find(data->host);
+  if (!c->host) {
+    c->host = &server.default_host;
+  }
+  if (c->head) {
+    stats.requests_head++;
+  }
+
+  if (parser->http_errno) {
+    request->user_agent = "";
+    request->method = "";
+    request->uri = "BAD REQUEST";
+    send_error(c, parser->http_errno == HPE_HEADER_OVERFLOW ? 413 : 400);
+  } else if (parser->method != HTTP_GET && parser->method != HTTP_HEAD) {
+    send_error(c, 405);
+  } else if (parser->upgrade && is_live_reload(request->uri)) {
+    send_upgrade(c);
+  } else if (parser->upgrade) {
+    /* handle new protocol */
+    connection_close(c);
+  } else {
+    send_file(c, request);
+  }
+}
+
+static void connection_read(struct connection* c) {
+  for (;;) {
+    const int len = 4096;
+    char buf[len];
+
+    // Read data from the socket
+    const ssize_t recved = recv(c->socket, buf, len, 0);
+
+    if (recved == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      perror("Error reading request from network");
+      connection_close(c);
+      return;
+    }
+
+    // Start up / continue the parser. Note we pass recved==0 to
+    // signal that EOF has been received.
+    const ssize_t nparsed = http_parser_execute(&c->parser, &server.settings, buf, recved);
+
+    if (c->parser.http_errno || c->parser.upgrade ||
+        c->data.complete || http_body_is_final(&c->parser)) {
+      connection_handle_request(c);
+      return;
+    }
+
+    if (recved == 0 || nparsed != recved) {
+      // The client hung up part way through a request.
+      connection_close(c);
+      return;
+    }
+  }
+
+  // Wait for more of the request: the client gets `idle_timeout` between
+  // reads, but must finish the headers by `header_deadline`.
+  uint64_t deadline = clock_ms() + server.options.idle_timeout * 1000;
+  if (deadline > c->header_deadline) {
+    deadline = c->header_deadline;
+  }
+  timer_add(&server.timers, &c->timer, deadline);
+}
+
+// Collect MSG_ZEROCOPY completions from the socket's error queue.
+// Returns the number of sends completed.
+static unsigned long connection_reap_zerocopy(struct connection* c) {
+  unsigned long completed = 0;
+#ifdef HAVE_ZEROCOPY
+  for (;;) {
+    char control[128];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(c->socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      break;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+      const struct sock_extended_err* error = (const void*)CMSG_DATA(cmsg);
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // Each notification covers a range of sends, numbered from zero.
+      const unsigned long count = error->ee_data - error->ee_info + 1;
+      completed += count;
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        stats.zerocopy_copied += count;
+      }
+    }
+  }
+  c->zerocopy_pending -= completed < c->zerocopy_pending ? completed : c->zerocopy_pending;
+  stats.zerocopy_completions += completed;
+#else
+  (void)c;
+#endif
+  return completed;
+}
+
+static void connection_event(struct event_handler* handler, int events) {
+  struct connection* c = container_of(handler, struct connection, handler);
+  const int completed = c->zerocopy_pending && (events & EVENT_ERROR) &&
+    connection_reap_zerocopy(c);
+  if ((events & EVENT_ERROR) && !completed &&
+      (c->state == waiting_for_zerocopy || c->state == waiting_for_pace)) {
+    // An error or hangup rather than a completion.
+    connection_close(c);
+    return;
+  }
+  if (c->state == reading_request) {
+    connection_read(c);
+  } else if (c->state == waiting_for_zerocopy) {
+    if (!c->zerocopy_pending) {
+      connection_close(c);
+    }
+  } else if (c->state == waiting_for_pace) {
+    // Its timer carries on with the response.
+  } else {
+    connection_write(c);
+  }
+}
+
+static void connection_timeout(struct timer* timer) {
+  struct connection* c = container_of(timer, struct connection, timer);
+  if (c->state == waiting_for_disk) {
+    // The I/O pool still has the connection; it is closed when handed back.
+    stats.timeouts_send++;
+    c->abandoned = 1;
+    return;
+  }
+  if (c->state == waiting_for_pace) {
+    c->state = writing_response;
+    timer_add(&server.timers, &c->timer, clock_ms() + server.options.send_timeout * 1000);
+    connection_write(c);
+    return;
+  }
+  if (c->state != reading_request) {
+    stats.timeouts_send++;
+  } else if (server.timers.now >= c->header_deadline) {
+    stats.timeouts_header++;
+  } else {
+    stats.timeouts_idle++;
+  }
+  connection_close(c);
+}
+
+static void root_changed(const struct watch_event* event) {
+  // Only something appearing can make a missing path exist, but a
+  // watched directory going away means its replacement is not watched.
+  if (event->kind == WATCH_CREATED || event->kind == WATCH_OVERFLOW ||
+      (event->kind == WATCH_REMOVED && !*event->name)) {
+    negcache_invalidate();
+    stats.negative_cache_invalidations++;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s%s", event->directory,
+      *event->directory && *event->name ? "/" : "", event->name);
+  const char* tree = event->kind == WATCH_OVERFLOW ? "" : !*event->name ? path : NULL;
+
+  if (server.cache) {
+    if (tree) {
+      cache_invalidate_tree(tree);
+    } else {
+      cache_invalidate(path);
+    }
+  }
+
+  // Anything happening in a directory changes its listing, and a
+  // directory going away takes the listings beneath it along.
+  if (server.options.listings) {
+    if (tree) {
+      listing_cache_invalidate_tree(tree);
+    } else {
+      listing_cache_invalidate(event->directory);
+      if (event->kind == WATCH_REMOVED) {
+        listing_cache_invalidate_tree(path);
+      }
+    }
+  }
+
+  // A preloaded file that changes is served from the disk from then on.
+  if (server.preloaded) {
+    if (tree) {
+      bundle_invalidate_tree(server.preloaded, tree);
+    } else {
+      bundle_invalidate(server.preloaded, path);
+    }
+  }
+
+  if (server.options.live_reload) {
+    hub_publish(event);
+  }
+}
+
+static void preload_found(size_t files, uint64_t bytes) {
+  printf("Preloading: found %zu files, %ju MiB\n", files, (uintmax_t)(bytes >> 20));
+  fflush(stdout);
+}
+
+static void preload_loaded(size_t files, uint64_t bytes) {
+  printf("Preloading: loaded %zu files, %ju MiB\n", files, (uintmax_t)(bytes >> 20));
+  fflush(stdout);
+}
+
+// Load the files under the root of up to --preload KiB into memory, many
+// directories and files at a time, to be served from there until they
+// change. With `watched`, every directory is watched for changes.
+static void preload(int watched) {
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const int threads = cpus < 2 ? 4 : cpus > preload_max_threads / 2 ? preload_max_threads : cpus * 2;
+  const uint64_t start = clock_ms();
+  struct crawl crawl;
+  if (crawl_tree(server.root_fd, threads, (off_t)server.options.preload << 10,
+        &crawl, preload_found) == -1) {
+    perror("preload");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < crawl.directory_count && watched; ++i) {
+    watched = watch_add(crawl.directories[i]) == 0;
+  }
+  if (!watched) {
+    fprintf(stderr, "Warning: not every directory can be watched, so preloaded files may be served after they change\n");
   }
+  const uint64_t crawled = clock_ms();
+
+  static struct bundle preloaded;
+  if (bundle_load(server.root_fd, &crawl, threads, preload_loaded, &preloaded) == -1) {
+    perror("preload");
+    exit(EXIT_FAILURE);
+  }
+  server.preloaded = &preloaded;
+  printf("Preloaded %zu files, %ju MiB, from %zu directories in %ju ms (%ju ms to find them)",
+      crawl.count, (uintmax_t)(crawl.bytes >> 20), crawl.directory_count,
+      (uintmax_t)(clock_ms() - start), (uintmax_t)(crawled - start));
+  if (crawl.skipped > 0) {
+    printf("; %zu larger files stay on the disk", crawl.skipped);
+  }
+  printf("\n");
+  crawl_free(&crawl);
+}
+
+static void watch_ready(struct event_handler* handler, int events) {
+  (void)handler;
+  (void)events;
+  watch_dispatch();
+}
+
+static void io_ready(struct event_handler* handler, int events) {
+  (void)handler;
+  (void)events;
+  iopool_complete();
+}
+
+static int set_nonblocking(int fd) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int accept_socket(struct sockaddr_in* address) {
+  socklen_t addrlen = sizeof(*address);
+
+#ifdef __linux__
+  return accept4(server.socket, (struct sockaddr *)address, &addrlen,
+      SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  const int new_socket = accept(server.socket, (struct sockaddr *)address, &addrlen);
+  if (new_socket != -1) {
+    set_nonblocking(new_socket);
+  }
+  return new_socket;
+#endif
+}
+
+// Answer a connection with a prebuilt error and close it, without
+// reading or parsing the request.
+static void reject_connection(int socket, int status) {
+  char discard[1024];
+  size_t length;
+  const char* response = error_response(status, time(NULL), &length);
+  send(socket, response, length, 0);
+  // Take what the client has already sent, so that closing the socket
+  // is less likely to reset the connection before the response arrives.
+  recv(socket, discard, sizeof(discard), 0);
   close(socket);
+}
+
+static void shed_connection(int socket) {
+  reject_connection(socket, 503);
+  stats.connections_shed++;
+}
+
+// Out of descriptors: give up the reserve to accept and shed one
+// pending connection, so the backlog drains rather than the listener
+// staying readable and the loop spinning. Returns 0 when there was
+// nothing to accept; accept() reports EMFILE whether or not a
+// connection is pending.
+static int shed_with_reserve_fd(void) {
+  if (server.reserve_fd == -1) {
+    return 0;
+  }
+  close(server.reserve_fd);
+
+  struct sockaddr_in address;
+  const int new_socket = accept_socket(&address);
+  if (new_socket != -1) {
+    shed_connection(new_socket);
+  }
+
+  server.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return new_socket != -1;
+}
+
+static void accept_connections(struct event_handler* handler, int events) {
+  (void)handler;
+  (void)events;
+
+  for (;;) {
+    struct sockaddr_in address;
+    const int new_socket = accept_socket(&address);
+
+    if (new_socket == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE) {
+        stats.accept_fd_exhausted++;
+        if (shed_with_reserve_fd()) {
+          continue;
+        }
+        return;
+      }
+      perror("accept");
+      return;
+    }
+
+    // WebSockets handed to the hub for live reload hold a descriptor
+    // each as well.
+    if (stats.connections_active + hub_subscribers() >=
+        (unsigned long)server.options.max_connections) {
+      shed_connection(new_socket);
+      continue;
+    }
+
+    if (ratelimit_enabled(&server.options.rate_limits) &&
+        !ratelimit_admit(address.sin_addr.s_addr, clock_ns())) {
+      reject_connection(new_socket, 429);
+      stats.requests_throttled++;
+      continue;
+    }
+
+    struct connection* c = calloc(1, sizeof(struct connection));
+    if (!c) {
+      close(new_socket);
+      continue;
+    }
+    c->handler.callback = connection_event;
+    c->timer.callback = connection_timeout;
+    c->state = reading_request;
+    c->socket = new_socket;
+    c->address = address.sin_addr.s_addr;
+    c->file = -1;
+    c->flight.done = connection_flight_done;
+
+    parser_data_init(&c->data, inet_ntoa(address.sin_addr));
+    http_parser_init(&c->parser, HTTP_REQUEST);
+    c->parser.data = &c->data;
+
+    stats.connections_accepted++;
+    stats.connections_active++;
+
+    const uint64_t now = clock_ms();
+    c->header_deadline = now + server.options.header_timeout * 1000;
+    uint64_t deadline = now + server.options.idle_timeout * 1000;
+    if (deadline > c->header_deadline) {
+      deadline = c->header_deadline;
+    }
+    timer_add(&server.timers, &c->timer, deadline);
+
+    if (event_add(server.loop, new_socket, EVENT_READ, &c->handler) == -1) {
+      perror("event_add");
+      connection_close(c);
+    }
+  }
+}
+
+int open_connection(int port)
+{
+  const int create_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (create_socket < 1) {
+    perror("opening socket\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const int yes = 1;
+  if (setsockopt(create_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+    perror("setsockopt");
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_in address;
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+
+  const int bound = bind(create_socket, (struct sockaddr *)&address, sizeof(address));
+
+  if (bound != 0) {
+    fprintf(stderr, "Failed to bind to port %d", port);
+    perror(" ");
+    exit(EXIT_FAILURE);
+  }
+
+  if (set_nonblocking(create_socket) == -1) {
+    perror("fcntl");
+    exit(EXIT_FAILURE);
+  }
+
+  return create_socket;
+}
+
+static void init_options(struct options* options) {
+  options->port = 8888;
+  options->root = getcwd(0, 0);
+  options->header_timeout = 10;
+  options->idle_timeout = 5;
+  options->send_timeout = 30;
+  options->backlog = 128;
+  options->max_connections = 1024;
+  memset(&options->rate_limits, 0, sizeof(options->rate_limits));
+  options->negative_cache_size = 4096;
+  options->negative_ttl = 2;
+  options->io_threads = 2;
+  options->max_io_threads = 32;
+  options->cache_size = 64;
+  options->zerocopy_threshold = 0;
+  options->preload = 0;
+  options->listings = 0;
+  options->huge_pages = -1;
+  options->cache_policy = CACHE_TINYLFU;
+}
+
+// Parse the argument of the current option as a number
+// in [min, max], or exit with an error.
+static long parse_number(command_t *self, const char* name, long min, long max) {
+  char* endptr = 0;
+  const long value = self->arg ? strtol(self->arg, &endptr, 10) : 0;
+  if (!self->arg || !*self->arg || *endptr || value < min || value > max) {
+    fprintf(stderr, "Error: %s must be a number from %ld to %ld\n", name, min, max);
+    exit(EXIT_FAILURE);
+  }
+  return value;
+}
+
+static void set_root(command_t *self) {
+  struct options* options = self->data;
+  options->root = realpath(self->arg, NULL);
+  if (!options->root) {
+    fprintf(stderr, "Cannot find directory %s", self->arg);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void set_port(command_t *self) {
+  struct options* options = self->data;
+  char* endptr = 0;
+  options->port = strtol(self->arg, &endptr, 10);
+  if (*endptr) {
+    fprintf(stderr, "Error: invalid port number: %s\n", self->arg);
+    exit(EXIT_FAILURE);
+  }
+
+  if (options->port > USHRT_MAX) {
+    fprintf(stderr, "Error: port number %ld is larger than the max %d\n",
+        options->port,
+        USHRT_MAX);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void set_header_timeout(command_t *self) {
+  struct options* options = self->data;
+  options->header_timeout = parse_number(self, "--header-timeout", 1, 3600);
+}
+
+static void set_idle_timeout(command_t *self) {
+  struct options* options = self->data;
+  options->idle_timeout = parse_number(self, "--idle-timeout", 1, 3600);
+}
+
+static void set_send_timeout(command_t *self) {
+  struct options* options = self->data;
+  options->send_timeout = parse_number(self, "--send-timeout", 1, 3600);
+}
+
+static void set_backlog(command_t *self) {
+  struct options* options = self->data;
+  options->backlog = parse_number(self, "--backlog", 1, INT_MAX);
+}
+
+static void set_max_connections(command_t *self) {
+  struct options* options = self->data;
+  options->max_connections = parse_number(self, "--max-connections", 1, INT_MAX);
+}
+
+static void set_request_rate(command_t *self) {
+  struct options* options = self->data;
+  options->rate_limits.request_rate = parse_number(self, "--request-rate", 0, 1000000000);
+}
+
+static void set_request_burst(command_t *self) {
+  struct options* options = self->data;
+  options->rate_limits.request_burst = parse_number(self, "--request-burst", 1, 1000000000);
+}
+
+static void set_byte_rate(command_t *self) {
+  struct options* options = self->data;
+  options->rate_limits.byte_rate = parse_number(self, "--byte-rate", 0, LONG_MAX);
+}
+
+static void set_negative_cache_size(command_t *self) {
+  struct options* options = self->data;
+  options->negative_cache_size = parse_number(self, "--negative-cache", 0, 1 << 24);
+}
+
+static void set_negative_ttl(command_t *self) {
+  struct options* options = self->data;
+  options->negative_ttl = parse_number(self, "--negative-ttl", 1, 3600);
+}
+
+static void set_io_threads(command_t *self) {
+  struct options* options = self->data;
+  options->io_threads = parse_number(self, "--io-threads", 0, 256);
+}
+
+static void set_max_io_threads(command_t *self) {
+  struct options* options = self->data;
+  options->max_io_threads = parse_number(self, "--max-io-threads", 1, 256);
+}
+
+static void set_cache_size(command_t *self) {
+  struct options* options = self->data;
+  options->cache_size = parse_number(self, "--cache-size", 0, 1 << 20);
+}
+
+static void set_zerocopy_threshold(command_t *self) {
+  struct options* options = self->data;
+  options->zerocopy_threshold = parse_number(self, "--zerocopy", 0, cache_max_file / 1024);
+}
+
+static void set_preload(command_t *self) {
+  struct options* options = self->data;
+  options->preload = parse_number(self, "--preload", 0, LONG_MAX / 1024);
+}
+
+static void set_listings(command_t *self) {
+  struct options* options = self->data;
+  options->listings = 1;
+}
+
+static void set_cache_policy(command_t *self) {
+  struct options* options = self->data;
+  if (!self->arg || cache_policy_parse(self->arg, &options->cache_policy) == -1) {
+    fprintf(stderr, "Error: --cache-policy must be lru, clock or tinylfu\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void set_huge_pages(command_t *self) {
+  struct options* options = self->data;
+  const char* arg = self->arg ? self->arg : "";
+  if (strcmp(arg, "off") == 0) {
+    options->huge_pages = ARENA_HUGE_NONE;
+  } else if (strcmp(arg, "transparent") == 0) {
+    options->huge_pages = ARENA_HUGE_TRANSPARENT;
+  } else if (strcmp(arg, "explicit") == 0) {
+    options->huge_pages = ARENA_HUGE_EXPLICIT;
+  } else {
+    fprintf(stderr, "Error: --huge-pages must be off, transparent or explicit\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void set_rules(command_t *self) {
+  struct options* options = self->data;
+  options->rules = (char*)self->arg;
+}
+
+static void set_hosts(command_t *self) {
+  struct options* options = self->data;
+  options->hosts = (char*)self->arg;
+}
+
+static void set_live_reload(command_t *self) {
+  struct options* options = self->data;
+  options->live_reload = (char*)self->arg;
+  if (options->live_reload[0] != '/') {
+    fprintf(stderr, "--live-reload takes a path, such as /.live\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void add_pace(command_t *self) {
+  if (pacing_add(self->arg) == -1) {
+    fprintf(stderr, "--pace takes a rate, such as 2M, after /prefix= or a size= if it is only for some files: %s\n",
+        self->arg);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void set_egress_rate(command_t *self) {
+  struct options* options = self->data;
+  if (pacing_parse_size(self->arg, &options->egress_rate) == -1) {
+    fprintf(stderr, "--egress-rate takes a rate, such as 100M: %s\n", self->arg);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void set_bundle(command_t *self) {
+  struct options* options = self->data;
+  options->bundle = (char*)self->arg;
+}
+
+static void request_stats(int signal) {
+  (void)signal;
+  stats_requested = 1;
+}
+
+int main(int argc, char **argv)
+{
+  // `garcon pack <directory> <bundle>` writes a bundle for --bundle.
+  if (argc >= 2 && strcmp(argv[1], "pack") == 0) {
+    if (argc != 4) {
+      fprintf(stderr, "Usage: %s pack <directory> <bundle>\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+    return bundle_pack(argv[2], argv[3]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  struct options* options = &server.options;
+  init_options(options);
+
+  command_t cmd;
+  cmd.data = options;
+  command_init(&cmd, argv[0], "0.0.1");
+  command_option(&cmd, "-d", "--directory [arg]", "The root directory to serve files from (default to the current working directory)", set_root);
+  command_option(&cmd, "-p", "--port [arg]", "Which port to listen on (default 8888)", set_port);
+  command_option(&cmd, "-r", "--header-timeout [arg]", "Seconds a client has to send the request headers (default 10)", set_header_timeout);
+  command_option(&cmd, "-i", "--idle-timeout [arg]", "Seconds a client may send nothing while sending a request (default 5)", set_idle_timeout);
+  command_option(&cmd, "-s", "--send-timeout [arg]", "Seconds a client may accept nothing while receiving a response (default 30)", set_send_timeout);
+  command_option(&cmd, "-b", "--backlog [arg]", "Length of the queue of connections waiting to be accepted (default 128)", set_backlog);
+  command_option(&cmd, "-c", "--max-connections [arg]", "Connections served at once, live reload WebSockets included; more are sent a 503 (default 1024)", set_max_connections);
+  command_option(&cmd, "-q", "--request-rate [arg]", "Requests per second allowed from each client address; more are sent a 429 (default unlimited)", set_request_rate);
+  command_option(&cmd, "-u", "--request-burst [arg]", "Requests a client may make at once before --request-rate applies (default one second's worth)", set_request_burst);
+  command_option(&cmd, "-k", "--byte-rate [arg]", "Response bytes per second allowed to each client address (default unlimited)", set_byte_rate);
+  command_option(&cmd, "-n", "--negative-cache [arg]", "Missing paths remembered so that repeated 404s skip the filesystem (default 4096, 0 to disable)", set_negative_cache_size);
+  command_option(&cmd, "-e", "--negative-ttl [arg]", "Seconds a missing path is remembered for (default 2)", set_negative_ttl);
+  command_option(&cmd, "-w", "--io-threads [arg]", "Threads kept for opening and reading files that are not in the kernel's caches, so that the event loop never waits for the disk (default 2, 0 to do it on the event loop)", set_io_threads);
+  command_option(&cmd, "-m", "--max-io-threads [arg]", "Threads the I/O pool may grow to when reads queue up (default 32)", set_max_io_threads);
+  command_option(&cmd, "-C", "--cache-size [arg]", "MiB of memory for keeping hot files of up to 4 MiB, needs change notification (default 64, 0 to disable)", set_cache_size);
+  command_option(&cmd, "-P", "--cache-policy [arg]", "How the content cache chooses files to drop: 'lru', 'clock' or 'tinylfu', which keeps a crawl from flushing the hot files (default tinylfu)", set_cache_policy);
+  command_option(&cmd, "-H", "--huge-pages [arg]", "Keep the content cache in one region with its own allocator, backed by 'transparent' or 'explicit' (hugetlbfs) huge pages, or 'off' for normal pages (default: entries come from malloc)", set_huge_pages);
+  command_option(&cmd, "-B", "--bundle [arg]", "Serve the files packed into this bundle by `garcon pack <directory> <bundle>` instead of a directory", set_bundle);
+  command_option(&cmd, "-L", "--preload [arg]", "Load every file of up to this many KiB under the root into memory at startup, so that none waits for the disk (default 0, off)", set_preload);
+  command_option(&cmd, "-R", "--rules [arg]", "File of Cache-Control and other headers to send by path prefix or suffix (default: a Cache-Control max-age of a year)", set_rules);
+  command_option(&cmd, "-v", "--hosts [arg]", "File of virtual host names, each with the directory to serve it from and, optionally, a cache quota and rules file of its own", set_hosts);
+  command_option(&cmd, "-W", "--live-reload [arg]", "Accept WebSockets at this path, such as /.live, and send them a message whenever a file under the root changes", set_live_reload);
+  command_option(&cmd, "-g", "--pace [arg]", "Bytes a second, such as 2M, to send each file at: alone for every file, after /prefix= for files under a path, or after size= for files at least that large; may be repeated, and the lowest rate that matches wins", add_pace);
+  command_option(&cmd, "-G", "--egress-rate [arg]", "Bytes a second, such as 100M, that the server sends in all; responses of up to 512 KiB are counted but never held back (default unlimited)", set_egress_rate);
+  command_option(&cmd, "-l", "--listings", "List the contents of directories that have no index.html, as HTML or, for clients that accept it, JSON", set_listings);
+  command_option(&cmd, "-z", "--zerocopy [arg]", "Send cached files of at least this many KiB with MSG_ZEROCOPY on Linux (default 0, off)", set_zerocopy_threshold);
+  command_parse(&cmd, argc, argv);
+
+  struct host* main_host = &server.default_host;
+  main_host->prefix = "";
+  if (options->rules && !(main_host->rules = rules_load(options->rules))) {
+    exit(EXIT_FAILURE);
+  }
+  if (options->hosts) {
+    if (options->bundle) {
+      fprintf(stderr, "--hosts serves directories, so it cannot be used with --bundle\n");
+      exit(EXIT_FAILURE);
+    }
+    if (hosts_load(options->hosts, main_host->rules) == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct ratelimit_config* rate_limits = &options->rate_limits;
+  if (!rate_limits->request_burst) {
+    rate_limits->request_burst = rate_limits->request_rate;
+  }
+  rate_limits->byte_burst = rate_limits->byte_rate;
+  if (ratelimit_enabled(rate_limits)) {
+    ratelimit_init(rate_limits);
+  }
+  pace_bucket_init(&server.egress, options->egress_rate);
+
+  static struct bundle bundle, embedded;
+  if (options->bundle) {
+    if (bundle_open(&bundle, options->bundle) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    server.bundle = &bundle;
+  }
+  size_t embedded_size;
+  const void* embedded_data = embedded_bundle(&embedded_size);
+  if (embedded_data) {
+    if (bundle_attach(&embedded, embedded_data, embedded_size) == -1) {
+      fprintf(stderr, "The site built into %s is not a bundle it can serve\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    server.embedded = &embedded;
+    printf("Serving %zu files built into %s\n", bundle_count(&embedded), argv[0]);
+  }
+
+  printf("Garçon! Serving content from %s on http://localhost:%ld/\n",
+      options->bundle ? options->bundle : options->root, options->port);
+  for (size_t i = 0; i < hosts_count(); ++i) {
+    const struct host* host = hosts_get(i);
+    printf("Serving %s from %s\n", host->prefix + 1, host->root);
+  }
+
+  // Write errors are handled where they happen.
+  signal(SIGPIPE, SIG_IGN);
+
+  // `kill -USR1` prints the counters to stderr.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_stats;
+  sigaction(SIGUSR1, &action, NULL);
+
+  error_responses_init();
+
+  server.root_fd = open(options->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (server.root_fd == -1) {
+    fprintf(stderr, "Cannot open directory %s", options->root);
+    perror(" ");
+    exit(EXIT_FAILURE);
+  }
+  main_host->root = options->root;
+  main_host->root_fd = server.root_fd;
+
+  if (options->negative_cache_size > 0 &&
+      negcache_init(options->negative_cache_size, options->negative_ttl * 1000) == -1) {
+    perror("negative cache");
+    exit(EXIT_FAILURE);
+  }
+
+  if (options->listings && listing_cache_init(listing_cache_size) == -1) {
+    perror("listings");
+    exit(EXIT_FAILURE);
+  }
+
+  server.socket = open_connection(options->port);
+
+  http_parser_settings* settings = &server.settings;
+  memset(settings, 0, sizeof(http_parser_settings));
+  settings->on_url = on_url;
+  settings->on_header_value = on_header_value;
+  settings->on_header_field = on_header_field;
+  settings->on_headers_complete = on_headers_complete;
+  settings->on_message_complete = on_message_complete;
+
+  if (listen(server.socket, options->backlog) < 0) {
+    perror("server: listen");
+    exit(EXIT_FAILURE);
+  }
+
+  server.reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  server.loop = event_loop_new();
+  if (!server.loop) {
+    perror("event loop");
+    exit(EXIT_FAILURE);
+  }
+  timer_wheel_init(&server.timers, clock_ms());
+
+  server.listener.callback = accept_connections;
+  if (event_add(server.loop, server.socket, EVENT_READ, &server.listener) == -1) {
+    perror("event_add");
+    exit(EXIT_FAILURE);
+  }
+
+  // Without change notification, negative cache
+  // entries are only dropped when they expire.
+  const int watch_fd = watch_init(options->root);
+  if (watch_fd != -1) {
+    for (size_t i = 0; i < hosts_count(); ++i) {
+      const struct host* host = hosts_get(i);
+      if (watch_mount(host->prefix, host->root) == -1) {
+        perror("watch");
+        exit(EXIT_FAILURE);
+      }
+    }
+    watch_subscribe(root_changed);
+    server.watcher.callback = watch_ready;
+    if (event_add(server.loop, watch_fd, EVENT_READ, &server.watcher) == -1) {
+      perror("event_add");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (options->live_reload) {
+    if (watch_fd == -1) {
+      fprintf(stderr, "Warning: change notification is unavailable, so live reload will never send a message\n");
+    }
+    hub_init(server.loop, &server.timers);
+  }
+
+  if (options->preload > 0 && !options->bundle) {
+    preload(watch_fd != -1);
+  }
+
+  // A bundle is served from the page cache, which needs no help.
+  if (options->cache_size > 0 && watch_fd != -1 && !options->bundle) {
+    // An eighth more than the budget leaves room for fragmentation, so
+    // that the eviction policy rather than the arena decides what goes.
+    const size_t arena_size = ((size_t)options->cache_size << 20) / 8 * 9;
+    if (options->huge_pages != -1 && arena_init(arena_size, options->huge_pages) == -1) {
+      perror("cache arena");
+      exit(EXIT_FAILURE);
+    }
+    if (cache_init((size_t)options->cache_size << 20, cache_max_file,
+          options->cache_policy) == -1 || flight_init() == -1) {
+      perror("content cache");
+      exit(EXIT_FAILURE);
+    }
+    server.cache = 1;
+  }
+
+  if (options->io_threads > 0) {
+    const int io_fd = iopool_init(options->io_threads, options->max_io_threads);
+    if (io_fd == -1) {
+      perror("I/O threads");
+      exit(EXIT_FAILURE);
+    }
+    server.io_handler.callback = io_ready;
+    if (event_add(server.loop, io_fd, EVENT_READ, &server.io_handler) == -1) {
+      perror("event_add");
+      exit(EXIT_FAILURE);
+    }
+    server.io_pool = 1;
+  }
+
+  for (;;) {
+    const int timeout = timer_wheel_timeout(&server.timers, clock_ms());
+    if (event_loop_run_once(server.loop, timeout) == -1 && errno != EINTR) {
+      perror("event loop");
+      exit(EXIT_FAILURE);
+    }
+    timer_wheel_advance(&server.timers, clock_ms());
+
+    if (stats_requested) {
+      stats_requested = 0;
+      if (server.io_pool) {
+        iopool_metrics(&stats.io_pool);
+      }
+      if (server.cache) {
+        cache_metrics(&stats.cache);
+        arena_metrics(&stats.arena);
+      }
+      if (options->live_reload) {
+        hub_metrics(&stats.live_reload);
+      }
+      stats_print(stderr);
+    }
+  }
+  close(server.socket);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,138 @@
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hash.h"
+
+#define rotl(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define sipround(v0, v1, v2, v3) do { \
+  v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+  v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+  v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+  v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+} while (0)
+
+uint64_t siphash(const void* data, size_t length, const uint64_t key[2]) {
+  const unsigned char* in = data;
+  uint64_t v0 = 0x736f6d6570736575ull ^ key[0];
+  uint64_t v1 = 0x646f72616e646f6dull ^ key[1];
+  uint64_t v2 = 0x6c7967656e657261ull ^ key[0];
+  uint64_t v3 = 0x7465646279746573ull ^ key[1];
+
+  const unsigned char* end = in + (length & ~(size_t)7);
+  for (; in != end; in += 8) {
+    uint64_t m = 0;
+    for (int i = 0; i < 8; ++i) {
+      m |= (uint64_t)in[i] << (8 * i);
+    }
+    v3 ^= m;
+    sipround(v0, v1, v2, v3);
+    sipround(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  uint64_t last = (uint64_t)length << 56;
+  for (size_t i = 0; i < (length & 7); ++i) {
+    last |= (uint64_t)in[i] << (8 * i);
+  }
+  v3 ^= last;
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  sipround(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void hash_random_key(uint64_t* key, size_t words) {
+  const int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  const ssize_t wanted = words * sizeof(uint64_t);
+  if (fd != -1 && read(fd, key, wanted) == wanted) {
+    close(fd);
+    return;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  for (size_t i = 0; i < words; ++i) {
+    key[i] = ((uint64_t)now.tv_nsec << 32 ^ (uint64_t)now.tv_sec ^ (uint64_t)getpid() << 16)
+      * (0x9e3779b97f4a7c15ull + 2 * i);
+  }
+}
+
+#define rotl32(x, b) (((x) << (b)) | ((x) >> (32 - (b))))
+
+static void sha1_block(uint32_t state[5], const unsigned char* block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+      (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (int i = 16; i < 80; ++i) {
+    w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    const uint32_t t = rotl32(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl32(b, 30);
+    b = a;
+    a = t;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1(const void* data, size_t length, unsigned char digest[20]) {
+  uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  const unsigned char* in = data;
+  size_t left = length;
+  for (; left >= 64; in += 64, left -= 64) {
+    sha1_block(state, in);
+  }
+
+  // The rest, a 1 bit, zeros, and the length in bits, in one block or two.
+  unsigned char tail[128] = { 0 };
+  memcpy(tail, in, left);
+  tail[left] = 0x80;
+  const size_t tail_length = left < 56 ? 64 : 128;
+  const uint64_t bits = (uint64_t)length * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[tail_length - 1 - i] = (unsigned char)(bits >> (8 * i));
+  }
+  sha1_block(state, tail);
+  if (tail_length == 128) {
+    sha1_block(state, tail + 64);
+  }
+  for (int i = 0; i < 5; ++i) {
+    digest[4 * i] = (unsigned char)(state[i] >> 24);
+    digest[4 * i + 1] = (unsigned char)(state[i] >> 16);
+    digest[4 * i + 2] = (unsigned char)(state[i] >> 8);
+    digest[4 * i + 3] = (unsigned char)state[i];
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SipHash-2-4 of `length` bytes under a 128-bit secret key. Tables that
+// hash client-supplied strings use it with a key from hash_random_key(),
+// so that clients cannot pick inputs that collide.
+uint64_t siphash(const void* data, size_t length, const uint64_t key[2]);
+
+// Fill `key` with bytes from /dev/urandom, or from the clock and pid if
+// that cannot be read.
+void hash_random_key(uint64_t* key, size_t words);
+
+// SHA-1 of `length` bytes, which the WebSocket handshake calls for. Not
+// for anything that needs to resist collisions.
+void sha1(const void* data, size_t length, unsigned char digest[20]);
+
+#endif
@@ -0,0 +1,245 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hash.h"
+#include "hosts.h"
+#include "rules.h"
+
+enum {
+  max_name_length = 253
+};
+
+struct host_name {
+  char* name;  // NULL when the slot is empty
+  size_t length;
+  struct host* host;
+};
+
+static struct host** hosts;
+static size_t host_count;
+
+// Names are found by an open-addressing table with linear probing, kept
+// under half full, so a lookup is one hash and a probe or two.
+static struct host_name* names;
+static size_t name_mask;
+static size_t name_count;
+static uint64_t hash_key[2];
+
+static char* trim(char* text) {
+  while (isspace((unsigned char)*text)) {
+    ++text;
+  }
+  size_t length = strlen(text);
+  while (length > 0 && isspace((unsigned char)text[length - 1])) {
+    text[--length] = '\0';
+  }
+  return text;
+}
+
+// Lowercase the host name at the start of `value` into `name`, without
+// a port or a trailing dot. Returns its length, or 0 if it is not one.
+static size_t normalize(const char* value, char* name) {
+  size_t length = 0;
+  for (; *value && *value != ':'; ++value) {
+    const char c = tolower((unsigned char)*value);
+    if (length == max_name_length || !(isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_')) {
+      return 0;
+    }
+    name[length++] = c;
+  }
+  if (length > 0 && name[length - 1] == '.') {
+    --length;
+  }
+  name[length] = '\0';
+  return length;
+}
+
+static struct host_name* probe(const char* name, size_t length) {
+  size_t slot = siphash(name, length, hash_key) & name_mask;
+  while (names[slot].name &&
+      !(names[slot].length == length && memcmp(names[slot].name, name, length) == 0)) {
+    slot = (slot + 1) & name_mask;
+  }
+  return &names[slot];
+}
+
+static int grow_names(void) {
+  const size_t capacity = names ? (name_mask + 1) * 2 : 16;
+  struct host_name* old = names;
+  const size_t old_capacity = names ? name_mask + 1 : 0;
+  names = calloc(capacity, sizeof(*names));
+  if (!names) {
+    names = old;
+    return -1;
+  }
+  name_mask = capacity - 1;
+  for (size_t i = 0; i < old_capacity; ++i) {
+    if (old[i].name) {
+      *probe(old[i].name, old[i].length) = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+// The host already serving `root`, or a new one for it.
+static struct host* find_host(const char* root, const char* name, int* created) {
+  *created = 0;
+  for (size_t i = 0; i < host_count; ++i) {
+    if (strcmp(hosts[i]->root, root) == 0) {
+      return hosts[i];
+    }
+  }
+  struct host** larger = realloc(hosts, (host_count + 1) * sizeof(*hosts));
+  if (!larger) {
+    return NULL;
+  }
+  hosts = larger;
+  struct host* host = calloc(1, sizeof(*host));
+  char* prefix = malloc(strlen(name) + 2);
+  if (!host || !prefix || !(host->root = strdup(root))) {
+    free(host);
+    free(prefix);
+    return NULL;
+  }
+  sprintf(prefix, "/%s", name);
+  host->prefix = prefix;
+  host->prefix_length = strlen(prefix);
+  host->root_fd = -1;
+  hosts[host_count++] = host;
+  *created = 1;
+  return host;
+}
+
+// Parse one line of the hosts file. Returns an error message, or NULL.
+static const char* parse_line(char* line, struct rules* default_rules) {
+  line = trim(line);
+  if (!*line || *line == '#') {
+    return NULL;
+  }
+  char* fields[4];
+  size_t count = 0;
+  for (char* field = strtok(line, " \t"); field; field = strtok(NULL, " \t")) {
+    if (count == sizeof(fields) / sizeof(fields[0])) {
+      return "expected a name, a directory, and at most cache= and rules= after them";
+    }
+    fields[count++] = field;
+  }
+  if (count < 2) {
+    return "expected a name and then the directory to serve it from";
+  }
+
+  char name[max_name_length + 1];
+  const size_t length = normalize(fields[0], name);
+  if (length == 0 || strchr(fields[0], ':')) {
+    return "the name is not a host name";
+  }
+  if (name_count + 1 > (name_mask + 1) / 2 && grow_names() == -1) {
+    return strerror(ENOMEM);
+  }
+  struct host_name* slot = probe(name, length);
+  if (slot->name) {
+    return "the name is already given";
+  }
+
+  char root[PATH_MAX];
+  if (!realpath(fields[1], root)) {
+    return strerror(errno);
+  }
+  int created;
+  struct host* host = find_host(root, name, &created);
+  if (!host) {
+    return strerror(ENOMEM);
+  }
+  if (created) {
+    host->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (host->root_fd == -1) {
+      return strerror(errno);
+    }
+    host->rules = default_rules;
+  } else if (count > 2) {
+    return "the options for a directory go on the first line for it";
+  }
+
+  for (size_t i = 2; i < count; ++i) {
+    char* end;
+    if (strncmp(fields[i], "cache=", 6) == 0) {
+      errno = 0;
+      const long megabytes = strtol(fields[i] + 6, &end, 10);
+      if (errno || end == fields[i] + 6 || *end || megabytes <= 0 ||
+          (unsigned long)megabytes > SIZE_MAX >> 20) {
+        return "cache= takes a size in MiB";
+      }
+      host->quota.limit = (size_t)megabytes << 20;
+    } else if (strncmp(fields[i], "rules=", 6) == 0) {
+      host->rules = rules_load(fields[i] + 6);
+      if (!host->rules) {
+        return "the rules file cannot be used";
+      }
+    } else {
+      return "the options are cache= and rules=";
+    }
+  }
+
+  slot->name = strdup(name);
+  if (!slot->name) {
+    return strerror(ENOMEM);
+  }
+  slot->length = length;
+  slot->host = host;
+  name_count++;
+  return NULL;
+}
+
+int hosts_load(const char* path, struct rules* default_rules) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Cannot open hosts file %s", path);
+    perror(" ");
+    return -1;
+  }
+  hash_random_key(hash_key, 2);
+  if (grow_names() == -1) {
+    perror("hosts");
+    fclose(file);
+    return -1;
+  }
+  char line[4096];
+  for (int number = 1; fgets(line, sizeof(line), file); ++number) {
+    const char* error = strchr(line, '\n') || feof(file) ? parse_line(line, default_rules) :
+      "the line is too long";
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", path, number, error);
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+struct host* hosts_find(const char* value) {
+  char name[max_name_length + 1];
+  if (name_count == 0 || !value) {
+    return NULL;
+  }
+  const size_t length = normalize(value, name);
+  if (length == 0) {
+    return NULL;
+  }
+  return probe(name, length)->host;
+}
+
+size_t hosts_count(void) {
+  return host_count;
+}
+
+struct host* hosts_get(size_t index) {
+  return hosts[index];
+}
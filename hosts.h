@@ -0,0 +1,48 @@
+#ifndef HOSTS_H
+#define HOSTS_H
+
+#include <stddef.h>
+#include "cache.h"
+
+struct rules;
+
+// Virtual hosts, chosen by the Host header, from a hosts file (--hosts)
+// of lines like these:
+//
+//   # name            root              options
+//   example.com       /srv/example      cache=64 rules=example.rules
+//   www.example.com   /srv/example
+//   static.example    /srv/static       cache=256
+//
+// Names that share a root are one host. The options go on the first line
+// for a root: `cache` caps what the host's files may take of the content
+// cache, in MiB, and `rules` gives it a rules file of its own in place of
+// --rules. A request naming no host, or one not in the file, is served
+// from the main root.
+//
+// Every host's paths live in the one namespace of the caches and the
+// watches, under a prefix of "/" and its first name, which no request
+// path can start with.
+
+struct host {
+  char* root;  // absolute
+  int root_fd;
+  const char* prefix;  // "" for the main root
+  size_t prefix_length;
+  struct rules* rules;  // NULL for the default headers
+  struct cache_quota quota;  // a limit of 0 for none
+};
+
+// Load the hosts in the file at `path`, whose hosts without a rules file
+// of their own use `default_rules`. Returns -1 after reporting the
+// problem on stderr.
+int hosts_load(const char* path, struct rules* default_rules);
+
+// The host with the name in a Host header's `value`, which may have a
+// port after it, or NULL if there is none.
+struct host* hosts_find(const char* value);
+
+size_t hosts_count(void);
+struct host* hosts_get(size_t index);
+
+#endif
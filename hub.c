@@ -0,0 +1,432 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "event_loop.h"
+#include "hash.h"
+#include "hub.h"
+#include "timer_wheel.h"
+#include "watch.h"
+
+enum {
+  max_subscribers = 16384,
+  // Frames a subscriber may have yet to take before it is dropped.
+  queue_length = 16,
+  // Enough for any control frame a client may send.
+  input_size = 256,
+  ping_interval_ms = 30 * 1000,
+
+  opcode_text = 0x1,
+  opcode_close = 0x8,
+  opcode_ping = 0x9,
+  opcode_pong = 0xa
+};
+
+// A frame as it goes on the wire, shared by the subscribers it is sent to.
+struct frame {
+  size_t refs;
+  size_t length;
+  unsigned char data[];
+};
+
+struct subscriber {
+  struct event_handler handler;
+  int socket;
+  const char* prefix;
+  size_t prefix_length;
+  struct subscriber* prev;
+  struct subscriber* next;
+
+  // Frames not yet written, oldest first, of which the first `sent`
+  // bytes of the oldest have been.
+  struct frame* queue[queue_length];
+  size_t queue_head;
+  size_t queue_count;
+  size_t sent;
+  int writing;  // waiting for the socket to take more
+  int closing;  // dropped, and to be closed by its own event
+
+  // The start of a frame from the client.
+  unsigned char input[input_size];
+  size_t input_length;
+};
+
+static struct event_loop* loop;
+static struct timer_wheel* timers;
+static struct timer ping_timer;
+static struct subscriber subscribers = { .prev = &subscribers, .next = &subscribers };
+static struct hub_metrics metrics;
+
+static struct frame* frame_new(int opcode, const void* payload, size_t length) {
+  struct frame* frame = malloc(sizeof(*frame) + length + 10);
+  if (!frame) {
+    return NULL;
+  }
+  unsigned char* out = frame->data;
+  *out++ = 0x80 | opcode;
+  if (length < 126) {
+    *out++ = (unsigned char)length;
+  } else if (length <= 0xffff) {
+    *out++ = 126;
+    *out++ = (unsigned char)(length >> 8);
+    *out++ = (unsigned char)length;
+  } else {
+    *out++ = 127;
+    for (int i = 7; i >= 0; --i) {
+      *out++ = (unsigned char)((uint64_t)length >> (8 * i));
+    }
+  }
+  if (length > 0) {
+    memcpy(out, payload, length);
+  }
+  frame->refs = 1;
+  frame->length = out + length - frame->data;
+  return frame;
+}
+
+static void frame_release(struct frame* frame) {
+  if (frame && --frame->refs == 0) {
+    free(frame);
+  }
+}
+
+// Stop sending to `s`. A broadcast may drop subscribers whose events are
+// waiting in the same pass of the event loop, so they are not freed here:
+// shutting the socket down makes it report a hangup, and the subscriber
+// is closed when its own event comes.
+static void subscriber_drop(struct subscriber* s) {
+  for (size_t i = 0; i < s->queue_count; ++i) {
+    frame_release(s->queue[(s->queue_head + i) % queue_length]);
+  }
+  s->queue_count = 0;
+  s->closing = 1;
+  shutdown(s->socket, SHUT_RDWR);
+}
+
+static void subscriber_close(struct subscriber* s) {
+  subscriber_drop(s);
+  event_remove(loop, s->socket);
+  close(s->socket);
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+  free(s);
+  metrics.subscribers--;
+}
+
+// Write what the socket will take of the queued frames. Returns -1 if
+// the subscriber has been dropped.
+static int subscriber_flush(struct subscriber* s) {
+  while (s->queue_count > 0) {
+    struct frame* frame = s->queue[s->queue_head];
+    const ssize_t sent = send(s->socket, frame->data + s->sent, frame->length - s->sent, 0);
+    if (sent == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      subscriber_drop(s);
+      return -1;
+    }
+    s->sent += sent;
+    if (s->sent == frame->length) {
+      frame_release(frame);
+      s->queue_head = (s->queue_head + 1) % queue_length;
+      s->queue_count--;
+      s->sent = 0;
+    }
+  }
+  const int writing = s->queue_count > 0;
+  if (writing != s->writing) {
+    s->writing = writing;
+    if (event_modify(loop, s->socket, writing ? EVENT_READ | EVENT_WRITE : EVENT_READ,
+          &s->handler) == -1) {
+      subscriber_drop(s);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Queue `frame` for `s` and write it if nothing is ahead of it. Returns
+// -1 if the subscriber has been dropped.
+static int subscriber_send(struct subscriber* s, struct frame* frame) {
+  if (s->queue_count == queue_length) {
+    metrics.dropped++;
+    subscriber_drop(s);
+    return -1;
+  }
+  frame->refs++;
+  s->queue[(s->queue_head + s->queue_count) % queue_length] = frame;
+  if (s->queue_count++ > 0) {
+    return 0;
+  }
+  return subscriber_flush(s);
+}
+
+// Answer the control frames in what the client has sent. Returns -1 if
+// the subscriber has been dropped.
+static int subscriber_parse(struct subscriber* s) {
+  while (s->input_length >= 2) {
+    unsigned char* in = s->input;
+    const int opcode = in[0] & 0x0f;
+    size_t length = in[1] & 0x7f;
+    size_t header = 6;
+    if (length == 126) {
+      header = 8;
+      if (s->input_length < 4) {
+        return 0;
+      }
+      length = (size_t)in[2] << 8 | in[3];
+    }
+    // Frames from clients are always masked, and the hub expects nothing
+    // larger than a control frame from them.
+    if (!(in[1] & 0x80) || length == 127 || header + length > input_size) {
+      subscriber_drop(s);
+      return -1;
+    }
+    if (s->input_length < header + length) {
+      return 0;
+    }
+    unsigned char* payload = in + header;
+    for (size_t i = 0; i < length; ++i) {
+      payload[i] ^= in[header - 4 + i % 4];
+    }
+
+    if (opcode == opcode_close) {
+      // Echo the status code, if the socket will take it, and hang up.
+      struct frame* frame = s->queue_count ? NULL :
+        frame_new(opcode_close, payload, length < 2 ? length : 2);
+      if (frame) {
+        send(s->socket, frame->data, frame->length, 0);
+        frame_release(frame);
+      }
+      subscriber_drop(s);
+      return -1;
+    }
+    if (opcode == opcode_ping) {
+      struct frame* frame = frame_new(opcode_pong, payload, length);
+      const int result = frame ? subscriber_send(s, frame) : 0;
+      frame_release(frame);
+      if (result == -1) {
+        return -1;
+      }
+    }
+
+    s->input_length -= header + length;
+    memmove(in, in + header + length, s->input_length);
+  }
+  return 0;
+}
+
+static void subscriber_read(struct subscriber* s) {
+  for (;;) {
+    const ssize_t got = recv(s->socket, s->input + s->input_length,
+        input_size - s->input_length, 0);
+    if (got == -1 && errno == EINTR) {
+      continue;
+    }
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (got <= 0) {
+      subscriber_drop(s);
+      return;
+    }
+    s->input_length += got;
+    if (subscriber_parse(s) == -1) {
+      return;
+    }
+  }
+}
+
+static void subscriber_event(struct event_handler* handler, int events) {
+  struct subscriber* s = container_of(handler, struct subscriber, handler);
+  if (events & EVENT_ERROR) {
+    s->closing = 1;
+  }
+  if (!s->closing && (events & EVENT_WRITE)) {
+    subscriber_flush(s);
+  }
+  if (!s->closing && (events & EVENT_READ)) {
+    subscriber_read(s);
+  }
+  if (s->closing) {
+    subscriber_close(s);
+  }
+}
+
+// Send `frame` to the subscribers of the host with the prefix of
+// `length` bytes at `prefix`, or to all of them if it is NULL. Returns
+// how many it went to.
+static unsigned long broadcast(struct frame* frame, const char* prefix, size_t length) {
+  unsigned long count = 0;
+  for (struct subscriber* s = subscribers.next; s != &subscribers; s = s->next) {
+    if (!s->closing &&
+        (!prefix || (s->prefix_length == length && memcmp(s->prefix, prefix, length) == 0))) {
+      count += subscriber_send(s, frame) == 0;
+    }
+  }
+  return count;
+}
+
+static void ping(struct timer* timer) {
+  if (subscribers.next != &subscribers) {
+    struct frame* frame = frame_new(opcode_ping, NULL, 0);
+    if (frame) {
+      broadcast(frame, NULL, 0);
+      frame_release(frame);
+    }
+  }
+  timer_add(timers, timer, timers->now + ping_interval_ms);
+}
+
+void hub_init(struct event_loop* event_loop, struct timer_wheel* timer_wheel) {
+  loop = event_loop;
+  timers = timer_wheel;
+  ping_timer.callback = ping;
+  timer_add(timers, &ping_timer, timers->now + ping_interval_ms);
+}
+
+void hub_accept_key(const char* key, char accept[hub_accept_size]) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char text[128];
+  const int length = snprintf(text, sizeof(text), "%.64s%s", key, guid);
+  unsigned char digest[21] = { 0 };
+  sha1(text, length, digest);
+  char* out = accept;
+  for (int i = 0; i < 21; i += 3) {
+    const uint32_t group = (uint32_t)digest[i] << 16 | (uint32_t)digest[i + 1] << 8 | digest[i + 2];
+    *out++ = base64[group >> 18 & 63];
+    *out++ = base64[group >> 12 & 63];
+    *out++ = base64[group >> 6 & 63];
+    *out++ = base64[group & 63];
+  }
+  // 20 bytes make 27 characters and a '=' of padding.
+  accept[27] = '=';
+  accept[28] = '\0';
+}
+
+void hub_subscribe(int socket, const char* prefix) {
+  struct subscriber* s = metrics.subscribers < max_subscribers ? calloc(1, sizeof(*s)) : NULL;
+  if (!s) {
+    close(socket);
+    return;
+  }
+  s->handler.callback = subscriber_event;
+  s->socket = socket;
+  s->prefix = prefix;
+  s->prefix_length = strlen(prefix);
+  if (event_add(loop, socket, EVENT_READ, &s->handler) == -1) {
+    close(socket);
+    free(s);
+    return;
+  }
+  // Messages are small and should go out as soon as they are written.
+  const int on = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  s->next = &subscribers;
+  s->prev = subscribers.prev;
+  s->prev->next = s;
+  subscribers.prev = s;
+  metrics.subscribers++;
+}
+
+// Append `text` to `out` as the inside of a JSON string. A frame of text
+// must be valid UTF-8, so a name that is not has U+FFFD put in place of
+// each byte that cannot be decoded.
+static char* put_json(char* out, const char* text) {
+  const unsigned char* in = (const unsigned char*)text;
+  while (*in) {
+    const unsigned char c = *in;
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = c;
+      ++in;
+    } else if (c < 0x20) {
+      out += sprintf(out, "\\u%04x", c);
+      ++in;
+    } else if (c < 0x80) {
+      *out++ = c;
+      ++in;
+    } else {
+      const size_t length = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 :
+        c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+      const unsigned char low = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+      const unsigned char high = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+      size_t valid = length > 0 && in[1] >= low && in[1] <= high;
+      for (size_t i = 2; valid && i < length; ++i) {
+        valid = (in[i] & 0xc0) == 0x80;
+      }
+      if (valid) {
+        memcpy(out, in, length);
+        out += length;
+        in += length;
+      } else {
+        out += sprintf(out, "\\ufffd");
+        ++in;
+      }
+    }
+  }
+  return out;
+}
+
+void hub_publish(const struct watch_event* event) {
+  static const char* const kinds[] = {
+    [WATCH_CREATED] = "created",
+    [WATCH_REMOVED] = "removed",
+    [WATCH_MODIFIED] = "modified",
+    [WATCH_OVERFLOW] = "overflow"
+  };
+  if (subscribers.next == &subscribers) {
+    return;
+  }
+
+  // A virtual host's directories start with its prefix, "/" and its name.
+  const char* directory = event->directory;
+  const size_t prefix_length = *directory == '/' ? 1 + strcspn(directory + 1, "/") : 0;
+  directory += prefix_length;
+  directory += *directory == '/';
+
+  // Each byte of a name takes at most six in JSON.
+  const size_t size = 64 + 6 * (strlen(directory) + strlen(event->name));
+  char* message = malloc(size);
+  if (!message) {
+    return;
+  }
+  char* out = message + sprintf(message, "{\"event\":\"%s\",\"path\":\"/", kinds[event->kind]);
+  out = put_json(out, directory);
+  if (*directory && *event->name) {
+    *out++ = '/';
+  }
+  out = put_json(out, event->name);
+  out += sprintf(out, "\"}");
+
+  struct frame* frame = frame_new(opcode_text, message, out - message);
+  free(message);
+  if (!frame) {
+    return;
+  }
+  // Events were lost, so every host may have changed.
+  const int everyone = event->kind == WATCH_OVERFLOW;
+  if (broadcast(frame, everyone ? NULL : event->directory, prefix_length) > 0) {
+    metrics.messages++;
+  }
+  frame_release(frame);
+}
+
+void hub_metrics(struct hub_metrics* out) {
+  *out = metrics;
+}
+
+unsigned long hub_subscribers(void) {
+  return metrics.subscribers;
+}
@@ -0,0 +1,54 @@
+#ifndef HUB_H
+#define HUB_H
+
+#include <stddef.h>
+
+struct event_loop;
+struct timer_wheel;
+struct watch_event;
+
+// Live reload: browsers open a WebSocket to a reserved path (--live-reload)
+// and are sent a text message whenever a file they may have loaded
+// changes, such as
+//
+//   {"event":"modified","path":"/css/site.css"}
+//
+// so that a page can reload itself without polling. The hub owns the
+// sockets once they have been sent the 101 response. Each change is
+// framed once into a shared, reference-counted frame, which is written
+// to every subscriber straight away; a subscriber whose socket is full
+// keeps references to the frames it has yet to take, and one that falls
+// too far behind is dropped. Every subscriber is pinged now and then, so
+// that proxies keep the connection open and dead peers are noticed.
+
+enum {
+  // The length of the Sec-WebSocket-Accept value, with its terminator.
+  hub_accept_size = 29
+};
+
+struct hub_metrics {
+  unsigned long subscribers;
+  unsigned long messages;  // changes published to at least one subscriber
+  unsigned long dropped;   // subscribers that fell too far behind
+};
+
+void hub_init(struct event_loop* loop, struct timer_wheel* timers);
+
+// The Sec-WebSocket-Accept value for a Sec-WebSocket-Key.
+void hub_accept_key(const char* key, char accept[hub_accept_size]);
+
+// Take over `socket`, which has been sent the 101 response, to hear of
+// changes beneath the virtual host with `prefix` ("" for the main root).
+// The socket is closed if there are too many subscribers already.
+void hub_subscribe(int socket, const char* prefix);
+
+// Tell the subscribers of the host the change is under about it.
+void hub_publish(const struct watch_event* event);
+
+void hub_metrics(struct hub_metrics* metrics);
+
+// The sockets the hub has taken over, which still count against the
+// server's connection limit.
+unsigned long hub_subscribers(void);
+
+#endif
@@ -0,0 +1,285 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "iopool.h"
+
+enum {
+  max_workers = 256,
+  idle_exit_seconds = 10,       // an extra thread exits after this long without work
+  wait_target_ns = 2 * 1000000  // add a thread when jobs wait longer than this
+};
+
+struct worker {
+  pthread_mutex_t lock;
+  struct io_job* head;
+  struct io_job* tail;
+};
+
+static struct worker workers[max_workers];
+
+// Guarded by `sleep_lock`, which idle threads wait on.
+static pthread_mutex_t sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int alive[max_workers];
+static int threads;
+static int idle;
+static int min_threads;
+static int max_threads;
+
+// Queues below `slot_count` may hold jobs. It only grows.
+static int slot_count;
+static unsigned next_queue;
+
+static size_t pending;
+static unsigned long completed;
+static uint64_t wait_total;
+static uint64_t wait_max;
+static uint64_t last_wait;
+
+// Finished jobs, pushed by the pool threads without a lock and taken all
+// at once by the event loop.
+static struct io_job* finished;
+
+// An eventfd on Linux; elsewhere the two ends of a pipe.
+static int notify_read = -1;
+static int notify_write = -1;
+
+static uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void notify(void) {
+#ifdef __linux__
+  const uint64_t one = 1;
+#else
+  const char one = 1;
+#endif
+  while (write(notify_write, &one, sizeof(one)) == -1 && errno == EINTR) {
+  }
+}
+
+static void finish(struct io_job* job) {
+  struct io_job* head = __atomic_load_n(&finished, __ATOMIC_RELAXED);
+  do {
+    job->next = head;
+  } while (!__atomic_compare_exchange_n(&finished, &head, job, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  // The loop takes the whole list after draining the descriptor, so it
+  // only needs waking for the first job on an empty list.
+  if (!head) {
+    notify();
+  }
+}
+
+static struct io_job* pop(struct worker* worker) {
+  pthread_mutex_lock(&worker->lock);
+  struct io_job* job = worker->head;
+  if (job) {
+    worker->head = job->next;
+    if (!worker->head) {
+      worker->tail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return job;
+}
+
+// Take the oldest job from our own queue, or failing that from the
+// first of the others that has one.
+static struct io_job* take(int self) {
+  const int slots = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < slots; ++i) {
+    struct io_job* job = pop(&workers[(self + i) % slots]);
+    if (job) {
+      __atomic_fetch_sub(&pending, 1, __ATOMIC_RELAXED);
+      return job;
+    }
+  }
+  return NULL;
+}
+
+static void record_wait(uint64_t wait) {
+  __atomic_fetch_add(&wait_total, wait, __ATOMIC_RELAXED);
+  __atomic_store_n(&last_wait, wait, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&wait_max, __ATOMIC_RELAXED);
+  while (wait > max && !__atomic_compare_exchange_n(&wait_max, &max, wait, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Sleep until there is work. Returns 0 if the thread should exit instead.
+static int wait_for_work(int self) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += idle_exit_seconds;
+
+  pthread_mutex_lock(&sleep_lock);
+  int timed_out = 0;
+  while (__atomic_load_n(&pending, __ATOMIC_RELAXED) == 0 && !timed_out) {
+    idle++;
+    timed_out = pthread_cond_timedwait(&wake, &sleep_lock, &deadline) == ETIMEDOUT;
+    idle--;
+  }
+  const int exit = timed_out && __atomic_load_n(&pending, __ATOMIC_RELAXED) == 0 &&
+    threads > min_threads;
+  if (exit) {
+    threads--;
+    alive[self] = 0;
+  }
+  pthread_mutex_unlock(&sleep_lock);
+  return !exit;
+}
+
+static void* worker_main(void* argument) {
+  const int self = (int)(intptr_t)argument;
+  for (;;) {
+    struct io_job* job = take(self);
+    if (!job) {
+      if (!wait_for_work(self)) {
+        return NULL;
+      }
+      continue;
+    }
+    record_wait(clock_ns() - job->submitted);
+    job->work(job);
+    __atomic_fetch_add(&completed, 1, __ATOMIC_RELAXED);
+    finish(job);
+  }
+}
+
+// Start a thread in a free slot. Called with `sleep_lock` held.
+static int grow(void) {
+  int slot = 0;
+  while (slot < max_threads && alive[slot]) {
+    ++slot;
+  }
+  if (slot == max_threads) {
+    return -1;
+  }
+
+  pthread_t thread;
+  const int error = pthread_create(&thread, NULL, worker_main, (void*)(intptr_t)slot);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  pthread_detach(thread);
+  alive[slot] = 1;
+  threads++;
+  if (slot >= slot_count) {
+    __atomic_store_n(&slot_count, slot + 1, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+int iopool_init(int min, int max) {
+#ifdef __linux__
+  notify_read = notify_write = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (notify_read == -1) {
+    return -1;
+  }
+#else
+  int fds[2];
+  if (pipe(fds) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  notify_read = fds[0];
+  notify_write = fds[1];
+#endif
+
+  min_threads = min;
+  max_threads = max < min ? min : max;
+  if (max_threads > max_workers) {
+    max_threads = max_workers;
+  }
+  for (int i = 0; i < max_threads; ++i) {
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+
+  pthread_mutex_lock(&sleep_lock);
+  int result = 0;
+  for (int i = 0; i < min_threads && result == 0; ++i) {
+    result = grow();
+  }
+  pthread_mutex_unlock(&sleep_lock);
+  return result == -1 ? -1 : notify_read;
+}
+
+int iopool_submit(struct io_job* job) {
+  // Without iopool_init() there are no queues to take the job.
+  const int slots = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+  if (slots == 0) {
+    errno = ENOSYS;
+    return -1;
+  }
+  job->next = NULL;
+  job->submitted = clock_ns();
+
+  struct worker* worker = &workers[next_queue++ % slots];
+  pthread_mutex_lock(&worker->lock);
+  if (worker->tail) {
+    worker->tail->next = job;
+  } else {
+    worker->head = job;
+  }
+  worker->tail = job;
+  pthread_mutex_unlock(&worker->lock);
+
+  pthread_mutex_lock(&sleep_lock);
+  const size_t queued = __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+  if (idle > 0) {
+    pthread_cond_signal(&wake);
+  }
+
+  // A thread that has been woken still counts as idle until it runs, so
+  // compare the backlog with the idle threads rather than trusting them
+  // to be free. If a new thread cannot be started the job still runs,
+  // only later.
+  if (queued > (size_t)idle && threads < max_threads &&
+      (queued > (size_t)threads ||
+       __atomic_load_n(&last_wait, __ATOMIC_RELAXED) > wait_target_ns)) {
+    grow();
+  }
+  pthread_mutex_unlock(&sleep_lock);
+  return 0;
+}
+
+void iopool_complete(void) {
+  char drain[64];
+  while (read(notify_read, drain, sizeof(drain)) > 0) {
+  }
+
+  struct io_job* job = __atomic_exchange_n(&finished, NULL, __ATOMIC_ACQUIRE);
+  while (job) {
+    struct io_job* next = job->next;
+    job->done(job);
+    job = next;
+  }
+}
+
+void iopool_metrics(struct iopool_metrics* metrics) {
+  pthread_mutex_lock(&sleep_lock);
+  metrics->threads = threads;
+  metrics->idle = idle;
+  pthread_mutex_unlock(&sleep_lock);
+
+  metrics->queued = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+  metrics->completed = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+  const uint64_t total = __atomic_load_n(&wait_total, __ATOMIC_RELAXED);
+  metrics->wait_average_us = metrics->completed ? total / metrics->completed / 1000 : 0;
+  metrics->wait_max_us = __atomic_exchange_n(&wait_max, 0, __ATOMIC_RELAXED) / 1000;
+}
@@ -0,0 +1,47 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <stdint.h>
+
+// A pool of threads for file I/O that may block on the disk or network,
+// so that the event loop never waits for it. A job's `work` runs on a
+// pool thread; its `done` then runs on the event loop's thread, from
+// iopool_complete(), which the loop calls when the descriptor returned
+// by iopool_init() is readable.
+//
+// Each thread has its own queue, and a thread whose queue is empty takes
+// work from the others, so one slow job does not hold up those queued
+// behind it. The pool starts with its minimum number of threads, adds
+// one when jobs queue up or wait too long, and lets extra threads exit
+// once they have been idle for a while.
+
+struct io_job {
+  struct io_job* next;
+  uint64_t submitted;
+  void (*work)(struct io_job* job);
+  void (*done)(struct io_job* job);
+};
+
+struct iopool_metrics {
+  unsigned long threads;
+  unsigned long idle;
+  unsigned long queued;
+  unsigned long completed;
+  unsigned long wait_average_us;  // from submission until a thread starts the job
+  unsigned long wait_max_us;      // since the last call to iopool_metrics()
+};
+
+// Start `min_threads` threads, growing to at most `max_threads`. Returns
+// the descriptor to watch for finished jobs, or -1 with errno set.
+int iopool_init(int min_threads, int max_threads);
+
+// Queue a job. Only the event loop's thread may submit. Returns -1 if
+// the pool has not been started.
+int iopool_submit(struct io_job* job);
+
+// Call `done` for every finished job.
+void iopool_complete(void);
+
+void iopool_metrics(struct iopool_metrics* metrics);
+
+#endif
@@ -0,0 +1,577 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_getdents64
+#define HAVE_GETDENTS64 1
+#endif
+#endif
+#include "cache.h"
+#include "listing.h"
+#include "path.h"
+#include "radix.h"
+
+enum {
+  dirent_buffer_size = 32 * 1024,
+
+  // Room for the fixed parts of an entry or of the start of a listing,
+  // beyond its escaped name or path.
+  entry_room = 256,
+  head_room = 512
+};
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+// Reading.
+
+struct listing* listing_new(const char* directory, size_t host_length) {
+  struct listing* listing = calloc(1, sizeof(*listing));
+  if (!listing) {
+    return NULL;
+  }
+  listing->directory = strdup(directory);
+  if (!listing->directory) {
+    free(listing);
+    return NULL;
+  }
+  listing->path = listing->directory + host_length;
+  listing->path += *listing->path == '/';
+  return listing;
+}
+
+void listing_free(struct listing* listing) {
+  if (listing) {
+    free(listing->directory);
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+  }
+}
+
+static int grow(void** array, size_t* capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) {
+    return 0;
+  }
+  size_t grown = *capacity ? *capacity * 2 : 64;
+  while (grown < needed) {
+    grown *= 2;
+  }
+  void* larger = realloc(*array, grown * size);
+  if (!larger) {
+    return -1;
+  }
+  *array = larger;
+  *capacity = grown;
+  return 0;
+}
+
+// Add one entry of the directory open as `fd`. The names are kept one
+// after another in `names`, which moves as it grows, so the entries only
+// point into it once they have all been read.
+static int add_entry(struct listing* listing, int fd, const char* name) {
+  if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+    return 0;
+  }
+  struct stat stat;
+  if (fstatat(fd, name, &stat, 0) == -1) {
+    // Gone since the directory was read, or a dangling link.
+    return 0;
+  }
+  if (!S_ISDIR(stat.st_mode) && !S_ISREG(stat.st_mode)) {
+    return 0;
+  }
+  const size_t length = strlen(name) + 1;
+  if (grow((void**)&listing->entries, &listing->capacity, listing->count + 1,
+        sizeof(*listing->entries)) == -1 ||
+      grow((void**)&listing->names, &listing->names_capacity,
+        listing->names_length + length, 1) == -1) {
+    return -1;
+  }
+  memcpy(listing->names + listing->names_length, name, length);
+  listing->names_length += length;
+  struct listing_entry* entry = &listing->entries[listing->count++];
+  entry->name = NULL;
+  entry->size = stat.st_size;
+  entry->mtime = stat.st_mtime;
+  entry->directory = S_ISDIR(stat.st_mode);
+  return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+  const struct listing_entry* x = a;
+  const struct listing_entry* y = b;
+  if (x->directory != y->directory) {
+    return y->directory - x->directory;
+  }
+  return strcmp(x->name, y->name);
+}
+
+static int read_entries(struct listing* listing, int fd) {
+  int result = 0;
+#ifdef HAVE_GETDENTS64
+  // The record layout of getdents64(), which libc does not declare.
+  struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+  char* buffer = malloc(dirent_buffer_size);
+  if (!buffer) {
+    return -1;
+  }
+  for (;;) {
+    const long n = syscall(SYS_getdents64, fd, buffer, dirent_buffer_size);
+    if (n <= 0) {
+      result = n == 0 ? 0 : -1;
+      break;
+    }
+    for (long offset = 0; offset < n && result == 0;) {
+      const struct linux_dirent64* entry = (const struct linux_dirent64*)(buffer + offset);
+      result = add_entry(listing, fd, entry->d_name);
+      offset += entry->d_reclen;
+    }
+    if (result == -1) {
+      break;
+    }
+  }
+  free(buffer);
+#else
+  const int stream_fd = dup(fd);
+  DIR* stream = stream_fd == -1 ? NULL : fdopendir(stream_fd);
+  if (!stream) {
+    if (stream_fd != -1) {
+      close(stream_fd);
+    }
+    return -1;
+  }
+  for (struct dirent* entry; result == 0 && (entry = readdir(stream));) {
+    result = add_entry(listing, fd, entry->d_name);
+  }
+  closedir(stream);
+#endif
+  return result;
+}
+
+int listing_read(int root_fd, struct listing* listing) {
+  const int fd = open_beneath(root_fd, *listing->path ? listing->path : ".", 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat stat;
+  if (fstat(fd, &stat) == -1 || !S_ISDIR(stat.st_mode)) {
+    close(fd);
+    errno = ENOTDIR;
+    return -1;
+  }
+  // The time is taken before the entries, so a change while they are
+  // being read makes the listing out of date rather than hiding it.
+  listing->mtime = stat.st_mtim;
+  const int result = read_entries(listing, fd);
+  const int error = errno;
+  close(fd);
+  if (result == -1) {
+    errno = error;
+    return -1;
+  }
+
+  char* name = listing->names;
+  for (size_t i = 0; i < listing->count; ++i) {
+    listing->entries[i].name = name;
+    name += strlen(name) + 1;
+  }
+  if (listing->count > 1) {
+    qsort(listing->entries, listing->count, sizeof(*listing->entries), compare_entries);
+  }
+  return 0;
+}
+
+// Rendering. Room is made for the most that a piece can take before it
+// is written, so the writes themselves cannot fail.
+
+static int reserve(struct listing_text* text, size_t length) {
+  if (text->length + length <= text->capacity) {
+    return 0;
+  }
+  size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+  while (capacity < text->length + length) {
+    capacity *= 2;
+  }
+  char* data = realloc(text->data, capacity);
+  if (!data) {
+    return -1;
+  }
+  text->data = data;
+  text->capacity = capacity;
+  return 0;
+}
+
+static void put(struct listing_text* text, const char* data, size_t length) {
+  memcpy(text->data + text->length, data, length);
+  text->length += length;
+}
+
+static void put_string(struct listing_text* text, const char* string) {
+  put(text, string, strlen(string));
+}
+
+// At most six bytes for each byte of the name.
+static void put_html(struct listing_text* text, const char* string) {
+  for (const char* c = string; *c; ++c) {
+    switch (*c) {
+      case '&': put_string(text, "&amp;"); break;
+      case '<': put_string(text, "&lt;"); break;
+      case '>': put_string(text, "&gt;"); break;
+      case '"': put_string(text, "&quot;"); break;
+      case '\'': put_string(text, "&#39;"); break;
+      default: put(text, c, 1);
+    }
+  }
+}
+
+// At most three bytes for each byte of the name. Everything but the
+// unreserved characters is escaped, which also makes it safe to put in
+// an attribute.
+static void put_href(struct listing_text* text, const char* string) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (const unsigned char* c = (const unsigned char*)string; *c; ++c) {
+    if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+        (*c >= '0' && *c <= '9') || *c == '-' || *c == '.' || *c == '_' || *c == '~') {
+      put(text, (const char*)c, 1);
+    } else {
+      const char escape[3] = { '%', hex[*c >> 4], hex[*c & 15] };
+      put(text, escape, 3);
+    }
+  }
+}
+
+// At most six bytes for each byte of the name.
+static void put_json(struct listing_text* text, const char* string) {
+  for (const unsigned char* c = (const unsigned char*)string; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      const char escape[2] = { '\\', (char)*c };
+      put(text, escape, 2);
+    } else if (*c < 0x20) {
+      char escape[7];
+      snprintf(escape, sizeof(escape), "\\u%04x", *c);
+      put(text, escape, 6);
+    } else {
+      put(text, (const char*)c, 1);
+    }
+  }
+}
+
+static void put_time(struct listing_text* text, time_t time) {
+  struct tm tm;
+  char formatted[32];
+  gmtime_r(&time, &tm);
+  put(text, formatted, strftime(formatted, sizeof(formatted), "%Y-%m-%d %H:%M", &tm));
+}
+
+static void put_number(struct listing_text* text, intmax_t number) {
+  char formatted[24];
+  put(text, formatted, snprintf(formatted, sizeof(formatted), "%jd", number));
+}
+
+static int render_head(const struct listing* listing, enum listing_format format,
+    struct listing_text* text) {
+  if (reserve(text, strlen(listing->path) * 12 + head_room) == -1) {
+    return -1;
+  }
+  if (format == LISTING_JSON) {
+    put_string(text, "{\"directory\":\"/");
+    put_json(text, listing->path);
+    put_string(text, *listing->path ? "/\",\"entries\":[" : "\",\"entries\":[");
+    return 0;
+  }
+  put_string(text, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Index of /");
+  put_html(text, listing->path);
+  put_string(text, *listing->path ? "/</title>\n</head>\n<body>\n<h1>Index of /" :
+      "</title>\n</head>\n<body>\n<h1>Index of /");
+  put_html(text, listing->path);
+  put_string(text, *listing->path ? "/</h1>\n" : "</h1>\n");
+  put_string(text, "<table>\n<tr><th>Name</th><th>Size</th><th>Modified</th></tr>\n");
+  if (*listing->path) {
+    put_string(text, "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n");
+  }
+  return 0;
+}
+
+static int render_entry(const struct listing_entry* entry, enum listing_format format,
+    int first, struct listing_text* text) {
+  if (reserve(text, strlen(entry->name) * 9 + entry_room) == -1) {
+    return -1;
+  }
+  if (format == LISTING_JSON) {
+    put_string(text, first ? "{\"name\":\"" : ",{\"name\":\"");
+    put_json(text, entry->name);
+    put_string(text, entry->directory ? "\",\"type\":\"directory\",\"size\":" :
+        "\",\"type\":\"file\",\"size\":");
+    put_number(text, entry->directory ? 0 : entry->size);
+    put_string(text, ",\"mtime\":");
+    put_number(text, entry->mtime);
+    put_string(text, "}");
+    return 0;
+  }
+  const char* slash = entry->directory ? "/" : "";
+  put_string(text, "<tr><td><a href=\"");
+  put_href(text, entry->name);
+  put_string(text, slash);
+  put_string(text, "\">");
+  put_html(text, entry->name);
+  put_string(text, slash);
+  put_string(text, "</a></td><td>");
+  if (entry->directory) {
+    put_string(text, "-");
+  } else {
+    put_number(text, entry->size);
+  }
+  put_string(text, "</td><td>");
+  put_time(text, entry->mtime);
+  put_string(text, "</td></tr>\n");
+  return 0;
+}
+
+static int render_tail(enum listing_format format, struct listing_text* text) {
+  if (reserve(text, entry_room) == -1) {
+    return -1;
+  }
+  put_string(text, format == LISTING_JSON ? "]}\n" : "</table>\n</body>\n</html>\n");
+  return 0;
+}
+
+size_t listing_render(const struct listing* listing, enum listing_format format,
+    size_t from, size_t limit, struct listing_text* text) {
+  if (from == 0 && render_head(listing, format, text) == -1) {
+    return 0;
+  }
+  // At least one entry goes in, so that the listing moves on.
+  size_t i = from;
+  for (; i < listing->count && (i == from || text->length < limit); ++i) {
+    if (render_entry(&listing->entries[i], format, i == 0, text) == -1) {
+      return 0;
+    }
+  }
+  if (i == listing->count) {
+    if (render_tail(format, text) == -1) {
+      return 0;
+    }
+    ++i;
+  }
+  return i;
+}
+
+void listing_text_free(struct listing_text* text) {
+  free(text->data);
+  memset(text, 0, sizeof(*text));
+}
+
+const char* listing_content_type(enum listing_format format) {
+  return format == LISTING_JSON ? "application/json" : "text/html; charset=utf-8";
+}
+
+// The cache of rendered listings, by directory, least recently used
+// dropped first.
+
+struct cached_listing {
+  struct cached_listing* prev;
+  struct cached_listing* next;
+  struct radix_node* node;
+  struct cache_entry* bodies[listing_formats];
+  struct timespec mtime;
+};
+
+static struct radix directories;
+static struct cached_listing lru;
+static size_t budget;
+static size_t used;
+static uint64_t generation;
+
+int listing_cache_init(size_t budget_bytes) {
+  if (radix_init(&directories) == -1) {
+    return -1;
+  }
+  lru.prev = lru.next = &lru;
+  budget = budget_bytes;
+  used = 0;
+  return 0;
+}
+
+static void unlink_cached(struct cached_listing* cached) {
+  cached->prev->next = cached->next;
+  cached->next->prev = cached->prev;
+}
+
+static void push_front(struct cached_listing* cached) {
+  cached->prev = &lru;
+  cached->next = lru.next;
+  lru.next->prev = cached;
+  lru.next = cached;
+}
+
+static void drop_bodies(struct cached_listing* cached) {
+  for (int i = 0; i < listing_formats; ++i) {
+    if (cached->bodies[i]) {
+      used -= cached->bodies[i]->length;
+      cache_entry_release(cached->bodies[i]);
+      cached->bodies[i] = NULL;
+    }
+  }
+}
+
+static void remove_cached(struct cached_listing* cached) {
+  radix_remove(&directories, cached->node);
+  unlink_cached(cached);
+  drop_bodies(cached);
+  free(cached);
+}
+
+static int same_time(const struct timespec* a, const struct timespec* b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+struct cache_entry* listing_cache_lookup(const char* directory,
+    enum listing_format format, const struct timespec* mtime) {
+  if (!directories.root) {
+    return NULL;
+  }
+  struct radix_node* node = radix_find(&directories, directory, strlen(directory));
+  if (!node) {
+    return NULL;
+  }
+  struct cached_listing* cached = node->value;
+  if (mtime && !same_time(mtime, &cached->mtime)) {
+    remove_cached(cached);
+    return NULL;
+  }
+  struct cache_entry* body = cached->bodies[format];
+  if (!body) {
+    return NULL;
+  }
+  unlink_cached(cached);
+  push_front(cached);
+  cache_entry_retain(body);
+  return body;
+}
+
+uint64_t listing_cache_generation(void) {
+  return generation;
+}
+
+struct cache_entry* listing_cache_insert(const struct listing* listing,
+    enum listing_format format, uint64_t since) {
+  struct listing_text text = { NULL, 0, 0 };
+  if (listing_render(listing, format, 0, SIZE_MAX, &text) == 0) {
+    listing_text_free(&text);
+    return NULL;
+  }
+  struct cache_entry* body = cache_entry_adopt(text.data, text.length);
+  if (!body || !directories.root || since != generation || (size_t)body->length > budget) {
+    return body;
+  }
+
+  const size_t length = strlen(listing->directory);
+  struct radix_node* node = radix_find(&directories, listing->directory, length);
+  struct cached_listing* cached = node ? node->value : NULL;
+  if (!cached) {
+    cached = calloc(1, sizeof(*cached));
+    if (!cached) {
+      return body;
+    }
+    cached->node = radix_insert(&directories, listing->directory, length, cached);
+    if (!cached->node) {
+      free(cached);
+      return body;
+    }
+    push_front(cached);
+  }
+  if (!same_time(&cached->mtime, &listing->mtime)) {
+    // The other format was rendered from the directory as it was before.
+    drop_bodies(cached);
+    cached->mtime = listing->mtime;
+  }
+  if (cached->bodies[format]) {
+    used -= cached->bodies[format]->length;
+    cache_entry_release(cached->bodies[format]);
+  }
+  cache_entry_retain(body);
+  cached->bodies[format] = body;
+  used += body->length;
+  unlink_cached(cached);
+  push_front(cached);
+
+  while (used > budget && lru.prev != cached) {
+    remove_cached(lru.prev);
+  }
+  return body;
+}
+
+void listing_cache_invalidate(const char* directory) {
+  generation++;
+  if (!directories.root) {
+    return;
+  }
+  struct radix_node* node = radix_find(&directories, directory, strlen(directory));
+  if (node) {
+    remove_cached(node->value);
+  }
+}
+
+struct removal {
+  struct cached_listing** listings;
+  size_t count;
+  size_t capacity;
+  int incomplete;
+};
+
+static int collect_listing(const char* key, size_t length, struct radix_node* node, void* argument) {
+  (void)key;
+  (void)length;
+  struct removal* removal = argument;
+  if (grow((void**)&removal->listings, &removal->capacity, removal->count + 1,
+        sizeof(*removal->listings)) == -1) {
+    removal->incomplete = 1;
+    return 1;
+  }
+  removal->listings[removal->count++] = node->value;
+  return 0;
+}
+
+void listing_cache_invalidate_tree(const char* directory) {
+  listing_cache_invalidate(directory);
+  if (!directories.root) {
+    return;
+  }
+  char prefix[PATH_MAX];
+  size_t length = strlen(directory);
+  if (length + 1 >= sizeof(prefix)) {
+    return;
+  }
+  memcpy(prefix, directory, length);
+  if (length > 0) {
+    prefix[length++] = '/';
+  }
+  struct removal removal = { NULL, 0, 0, 0 };
+  const int walked = radix_walk(&directories, prefix, length, collect_listing, &removal);
+  for (size_t i = 0; i < removal.count; ++i) {
+    remove_cached(removal.listings[i]);
+  }
+  free(removal.listings);
+  if (walked == -1 || removal.incomplete) {
+    // Out of memory part way: drop the lot rather than keep a stale one.
+    while (lru.next != &lru) {
+      remove_cached(lru.next);
+    }
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct cache_entry;
+
+// Listings of directories that have no index.html, as an HTML page or as
+// JSON. A directory is read with getdents64() on Linux (and readdir()
+// elsewhere), its entries are sorted with the directories first, then by
+// name, and rendered into one body, which is kept in a cache keyed by
+// the directory's path, so a repeat listing touches nothing on disk.
+// Directories with too many entries to keep are rendered a piece at a
+// time instead, as the socket takes them.
+
+enum listing_format {
+  LISTING_HTML,
+  LISTING_JSON,
+  listing_formats
+};
+
+struct listing_entry {
+  const char* name;
+  off_t size;
+  time_t mtime;
+  int directory;
+};
+
+struct listing {
+  char* directory;  // relative to the root, "" for the root itself
+  const char* path;  // the same within its virtual host's root
+  struct listing_entry* entries;  // directories first, then by name
+  size_t count;
+  struct timespec mtime;  // of the directory, as it was read
+  char* names;
+  size_t names_length;
+  size_t capacity;
+  size_t names_capacity;
+};
+
+// Rendered output, grown as needed.
+struct listing_text {
+  char* data;
+  size_t length;
+  size_t capacity;
+};
+
+enum {
+  // Directories with more entries than this are streamed, not cached.
+  listing_stream_entries = 4096
+};
+
+// A listing of `directory`, not yet read, whose first `host_length`
+// bytes name the virtual host it is in. Returns NULL if out of memory.
+struct listing* listing_new(const char* directory, size_t host_length);
+
+// Read and sort the entries of the listing's `path` beneath `root_fd`,
+// its host's root. Entries that cannot be looked at are left out. Returns 0,
+// or -1 with errno set.
+int listing_read(int root_fd, struct listing* listing);
+
+void listing_free(struct listing* listing);
+
+// Append to `text` the start of the listing, the entries from `from` on
+// until `text` is at least `limit` bytes long, and the end of the listing
+// if every entry is in. Returns the index of the next entry, which is
+// `count` + 1 once the end is in. Returns 0 if out of memory.
+size_t listing_render(const struct listing* listing, enum listing_format format,
+    size_t from, size_t limit, struct listing_text* text);
+
+void listing_text_free(struct listing_text* text);
+
+// The MIME type of a format.
+const char* listing_content_type(enum listing_format format);
+
+// Keep rendered listings of up to `budget` bytes in all. Returns -1 if
+// out of memory.
+int listing_cache_init(size_t budget);
+
+// The rendered listing of `directory`, with a reference taken, or NULL.
+// With `mtime`, a listing read when the directory had a different
+// modification time is dropped instead; without, it is trusted to have
+// been invalidated when the directory changed.
+struct cache_entry* listing_cache_lookup(const char* directory,
+    enum listing_format format, const struct timespec* mtime);
+
+// Incremented by every invalidation, as for cache_generation().
+uint64_t listing_cache_generation(void);
+
+// Render `listing` in full and keep it, unless the generation has moved
+// on from `generation`. Returns the body with a reference for the
+// caller, or NULL if out of memory.
+struct cache_entry* listing_cache_insert(const struct listing* listing,
+    enum listing_format format, uint64_t generation);
+
+// Drop the listing of `directory`, or of it and every directory beneath
+// it ("" for all of them).
+void listing_cache_invalidate(const char* directory);
+void listing_cache_invalidate_tree(const char* directory);
+
+#endif
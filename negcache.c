@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include "hash.h"
+#include "negcache.h"
+
+enum {
+  ways = 4,            // entries per bucket
+  max_hits = 255,
+  doorkeeper_ratio = 8 // doorkeeper bits per entry
+};
+
+struct negative_entry {
+  uint64_t key;        // 0 when empty
+  uint64_t expires;
+  uint32_t generation;
+  uint32_t hits;
+};
+
+static struct negative_entry* entries;
+static size_t bucket_mask;
+static uint64_t ttl;
+static uint32_t generation = 1;
+static uint64_t hash_key[2];
+
+// Two bits per path are set on its first miss; a path whose bits are
+// both already set is admitted. The bitmap is cleared once an eighth of
+// it has been set, which keeps false admissions to a few percent.
+static uint64_t* doorkeeper;
+static size_t doorkeeper_mask;
+static size_t doorkeeper_inserts;
+
+static size_t round_up_pow2(size_t n) {
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+
+int negcache_init(size_t size, uint64_t ttl_ms) {
+  const size_t buckets = round_up_pow2((size + ways - 1) / ways);
+  entries = calloc(buckets * ways, sizeof(struct negative_entry));
+  const size_t bits = round_up_pow2(buckets * ways * doorkeeper_ratio);
+  doorkeeper = calloc(bits < 64 ? 1 : bits / 64, sizeof(uint64_t));
+  if (!entries || !doorkeeper) {
+    free(entries);
+    free(doorkeeper);
+    entries = NULL;
+    return -1;
+  }
+  bucket_mask = buckets - 1;
+  doorkeeper_mask = (bits < 64 ? 64 : bits) - 1;
+  ttl = ttl_ms;
+  hash_random_key(hash_key, 2);
+  return 0;
+}
+
+uint64_t negcache_key(const char* path, size_t length) {
+  const uint64_t key = siphash(path, length, hash_key);
+  return key ? key : 1;
+}
+
+static int is_live(const struct negative_entry* entry, uint64_t now) {
+  return entry->key && entry->generation == generation && entry->expires > now;
+}
+
+int negcache_contains(uint64_t key, uint64_t now) {
+  struct negative_entry* bucket = &entries[(key & bucket_mask) * ways];
+  for (int i = 0; i < ways; ++i) {
+    if (bucket[i].key == key && is_live(&bucket[i], now)) {
+      if (bucket[i].hits < max_hits) {
+        bucket[i].hits++;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Set the path's doorkeeper bits, returning 1 if they were already set.
+static int seen_before(uint64_t key) {
+  const size_t a = (key >> 20) & doorkeeper_mask;
+  const size_t b = (key >> 42) & doorkeeper_mask;
+  const uint64_t bit_a = (uint64_t)1 << (a & 63);
+  const uint64_t bit_b = (uint64_t)1 << (b & 63);
+  if ((doorkeeper[a / 64] & bit_a) && (doorkeeper[b / 64] & bit_b)) {
+    return 1;
+  }
+
+  doorkeeper[a / 64] |= bit_a;
+  doorkeeper[b / 64] |= bit_b;
+  if (++doorkeeper_inserts > (doorkeeper_mask + 1) / doorkeeper_ratio) {
+    for (size_t i = 0; i <= doorkeeper_mask / 64; ++i) {
+      doorkeeper[i] = 0;
+    }
+    doorkeeper_inserts = 0;
+  }
+  return 0;
+}
+
+int negcache_insert(uint64_t key, uint64_t now) {
+  if (!seen_before(key)) {
+    return 0;
+  }
+
+  // Take a free or dead entry if the bucket has one. Otherwise evict the
+  // entry with the fewest hits, and age the others so that paths that
+  // were popular once do not stay for ever.
+  struct negative_entry* bucket = &entries[(key & bucket_mask) * ways];
+  struct negative_entry* victim = NULL;
+  for (int i = 0; i < ways; ++i) {
+    if (bucket[i].key == key || !is_live(&bucket[i], now)) {
+      victim = &bucket[i];
+      break;
+    }
+  }
+  if (!victim) {
+    victim = &bucket[0];
+    for (int i = 1; i < ways; ++i) {
+      if (bucket[i].hits < victim->hits) {
+        victim = &bucket[i];
+      }
+    }
+    for (int i = 0; i < ways; ++i) {
+      bucket[i].hits /= 2;
+    }
+  }
+
+  victim->key = key;
+  victim->expires = now + ttl;
+  victim->generation = generation;
+  victim->hits = 0;
+  return 1;
+}
+
+void negcache_invalidate(void) {
+  ++generation;
+}
@@ -0,0 +1,32 @@
+#ifndef NEGCACHE_H
+#define NEGCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A bounded cache of paths that do not exist, so that repeated requests
+// for them (favicons, scanner probes, stale bundle hashes) are answered
+// without touching the filesystem.
+//
+// Paths are stored as 64-bit keyed hashes, so an entry costs the same
+// whatever the length of its path. A path is only admitted on its second
+// miss, so a flood of random URLs churns a small bitmap rather than the
+// cache, and entries that are hit often are the last to be evicted.
+// Entries expire after a TTL, and negcache_invalidate() drops them all.
+
+// Returns -1 if the cache cannot be allocated.
+int negcache_init(size_t entries, uint64_t ttl_ms);
+
+uint64_t negcache_key(const char* path, size_t length);
+
+// Returns 1 if the path with `key` is known not to exist at `now`.
+int negcache_contains(uint64_t key, uint64_t now);
+
+// Record that the path with `key` does not exist. Returns 1 if it was
+// admitted to the cache, or 0 if this is the first miss seen for it.
+int negcache_insert(uint64_t key, uint64_t now);
+
+// Forget every entry, after something was created under the root.
+void negcache_invalidate(void);
+
+#endif
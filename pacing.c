@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "pacing.h"
+
+enum {
+  max_rules = 64,
+
+  // A bucket holds this long's worth of bytes, but never less than
+  // min_burst, so that a slow connection is not woken for every packet.
+  burst_ms = 50,
+  min_burst = 32 * 1024
+};
+
+struct pace_rule {
+  char* prefix;  // without its leading '/', or NULL for a size rule
+  size_t prefix_length;
+  uint64_t min_length;
+  uint64_t rate;
+};
+
+static struct pace_rule rules[max_rules];
+static size_t rule_count;
+
+int pacing_parse_size(const char* text, uint64_t* bytes) {
+  char* end;
+  errno = 0;
+  const unsigned long long number = strtoull(text, &end, 10);
+  if (errno || end == text || *text == '-') {
+    return -1;
+  }
+  int shift = 0;
+  switch (*end) {
+    case 'K': case 'k': shift = 10; ++end; break;
+    case 'M': case 'm': shift = 20; ++end; break;
+    case 'G': case 'g': shift = 30; ++end; break;
+  }
+  if (*end || number > UINT64_MAX >> shift) {
+    return -1;
+  }
+  *bytes = (uint64_t)number << shift;
+  return 0;
+}
+
+int pacing_add(const char* spec) {
+  if (rule_count == max_rules) {
+    return -1;
+  }
+  struct pace_rule rule = { NULL, 0, 0, 0 };
+  const char* rate = strrchr(spec, '=');
+  if (!rate) {
+    rate = spec;
+  } else if (*spec == '/') {
+    rule.prefix_length = rate - spec - 1;
+    rule.prefix = strndup(spec + 1, rule.prefix_length);
+    if (!rule.prefix) {
+      return -1;
+    }
+    ++rate;
+  } else {
+    char size[32];
+    if ((size_t)(rate - spec) >= sizeof(size)) {
+      return -1;
+    }
+    memcpy(size, spec, rate - spec);
+    size[rate - spec] = '\0';
+    if (pacing_parse_size(size, &rule.min_length) == -1) {
+      return -1;
+    }
+    ++rate;
+  }
+  if (pacing_parse_size(rate, &rule.rate) == -1 || rule.rate == 0) {
+    free(rule.prefix);
+    return -1;
+  }
+  rules[rule_count++] = rule;
+  return 0;
+}
+
+int pacing_enabled(void) {
+  return rule_count > 0;
+}
+
+uint64_t pacing_rate(const char* path, off_t length) {
+  uint64_t rate = 0;
+  for (size_t i = 0; i < rule_count; ++i) {
+    const struct pace_rule* rule = &rules[i];
+    const int matches = rule->prefix ?
+      strncmp(path, rule->prefix, rule->prefix_length) == 0 :
+      (uint64_t)length >= rule->min_length;
+    if (matches && (rate == 0 || rule->rate < rate)) {
+      rate = rule->rate;
+    }
+  }
+  return rate;
+}
+
+int pacing_set_socket_rate(int socket, uint64_t rate) {
+#ifdef SO_MAX_PACING_RATE
+  // The option takes 32 bits on older kernels, and ~0 means no limit.
+  const uint32_t value = rate < UINT32_MAX ? rate : UINT32_MAX - 1;
+  return setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value));
+#else
+  (void)socket;
+  (void)rate;
+  return -1;
+#endif
+}
+
+void pace_bucket_init(struct pace_bucket* bucket, uint64_t rate) {
+  bucket->full_at = 0;
+  if (rate == 0) {
+    bucket->interval = 0;
+    bucket->window = 0;
+    return;
+  }
+  uint64_t burst = rate * burst_ms / 1000;
+  if (burst < min_burst) {
+    burst = min_burst;
+  }
+  bucket->interval = 1e9 / rate;
+  bucket->window = burst * bucket->interval;
+}
+
+uint64_t pace_allowance(const struct pace_bucket* bucket, uint64_t now,
+    uint64_t wanted, uint64_t least, uint64_t* delay) {
+  if (bucket->interval == 0) {
+    return wanted;
+  }
+  const double debt = bucket->full_at > now ? bucket->full_at - now : 0;
+  const double room = (bucket->window - debt) / bucket->interval;
+  if (least > bucket->window / bucket->interval) {
+    least = bucket->window / bucket->interval;
+  }
+  if (room < least) {
+    *delay = debt - (bucket->window - least * bucket->interval);
+    return 0;
+  }
+  return room < wanted ? (uint64_t)room : wanted;
+}
+
+void pace_charge(struct pace_bucket* bucket, uint64_t now, uint64_t bytes) {
+  if (bucket->interval != 0) {
+    bucket->full_at = (bucket->full_at > now ? bucket->full_at : now) +
+      (uint64_t)(bytes * bucket->interval);
+  }
+}
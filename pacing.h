@@ -0,0 +1,64 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Bandwidth pacing for large downloads, so that a few clients fetching
+// huge files cannot take the whole uplink from everyone else. Rules
+// (--pace, which may be given many times) cap the rate of each
+// connection by the path or the size of the file it is sent:
+//
+//   --pace /downloads/=2M   files under /downloads/ at 2 MiB/s
+//   --pace 100M=5M          files of at least 100 MiB at 5 MiB/s
+//   --pace 8M               every file at 8 MiB/s
+//
+// and when several rules match a file the lowest rate wins. Sizes and
+// rates are in bytes, or KiB, MiB or GiB with a K, M or G after them.
+//
+// A connection's rate is handed to the kernel with SO_MAX_PACING_RATE,
+// which spaces its packets out (with the fq qdisc, or TCP's own pacing
+// without it). Where that is not available, the send loop keeps to the
+// rate with a token bucket of its own. A server-wide cap on the bytes
+// sent (--egress-rate) is always kept by such a bucket: every response
+// is charged to it, but only bodies larger than one chunk wait for it,
+// so that small files keep their latency while large downloads share
+// what is left.
+
+// A token bucket in the GCRA form: the time at which it will be full
+// again, which is in the future while it is in debt.
+struct pace_bucket {
+  double interval;  // nanoseconds a byte, 0 for no limit
+  double window;    // nanoseconds of bytes that may go at once
+  uint64_t full_at;
+};
+
+// Add the rule in `spec`. Returns -1 if it is not one.
+int pacing_add(const char* spec);
+
+int pacing_enabled(void);
+
+// The rate in bytes a second for the file at `path` (as made by
+// request_path()) of `length` bytes, or 0 for none.
+uint64_t pacing_rate(const char* path, off_t length);
+
+// Parse a size or rate such as 512K or 2M into bytes. Returns -1 if it
+// is not one.
+int pacing_parse_size(const char* text, uint64_t* bytes);
+
+// Have the kernel pace `socket` at `rate` bytes a second. Returns -1 if
+// it cannot, and the caller has to.
+int pacing_set_socket_rate(int socket, uint64_t rate);
+
+void pace_bucket_init(struct pace_bucket* bucket, uint64_t rate);
+
+// How many of the next `wanted` bytes the bucket lets go at `now`, in
+// nanoseconds. If that is fewer than `least`, none may go yet, and
+// `*delay` is set to how long to wait until `least` may.
+uint64_t pace_allowance(const struct pace_bucket* bucket, uint64_t now,
+    uint64_t wanted, uint64_t least, uint64_t* delay);
+
+// Take `bytes` from the bucket, which may go into debt.
+void pace_charge(struct pace_bucket* bucket, uint64_t now, uint64_t bytes);
+
+#endif
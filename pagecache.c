@@ -0,0 +1,81 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "pagecache.h"
+
+enum { vector_size = 256 };
+
+void* pagecache_map(int file, off_t length) {
+#ifdef __linux__
+  void* map = mmap(NULL, length, PROT_READ, MAP_SHARED, file, 0);
+  return map == MAP_FAILED ? NULL : map;
+#else
+  (void)file;
+  (void)length;
+  return NULL;
+#endif
+}
+
+void pagecache_unmap(void* map, off_t length) {
+  if (map) {
+    munmap(map, length);
+  }
+}
+
+int pagecache_resident(void* map, off_t offset, off_t length) {
+#ifdef __linux__
+  if (!map || length <= 0) {
+    return 1;
+  }
+  const off_t page_size = sysconf(_SC_PAGESIZE);
+  off_t start = offset & ~(page_size - 1);
+  const off_t end = offset + length;
+
+  // mincore() fills in a byte for each page, so ask in batches.
+  unsigned char vector[vector_size];
+  while (start < end) {
+    off_t pages = (end - start + page_size - 1) / page_size;
+    if (pages > vector_size) {
+      pages = vector_size;
+    }
+    if (mincore((char*)map + start, pages * page_size, vector) == -1) {
+      return 1;
+    }
+    for (off_t i = 0; i < pages; ++i) {
+      if (!(vector[i] & 1)) {
+        return 0;
+      }
+    }
+    start += pages * page_size;
+  }
+#else
+  (void)map;
+  (void)offset;
+  (void)length;
+#endif
+  return 1;
+}
+
+ssize_t pagecache_read(int file, void* buffer, size_t length, off_t offset) {
+#ifdef RWF_NOWAIT
+  // Not every filesystem supports RWF_NOWAIT; stop asking once one says so.
+  static int have_nowait = 1;
+  if (have_nowait) {
+    struct iovec iov = { buffer, length };
+    ssize_t result;
+    do {
+      result = preadv2(file, &iov, 1, offset, RWF_NOWAIT);
+    } while (result == -1 && errno == EINTR);
+    if (result != -1 || errno != EOPNOTSUPP) {
+      return result;
+    }
+    have_nowait = 0;
+  }
+#endif
+  ssize_t result;
+  do {
+    result = pread(file, buffer, length, offset);
+  } while (result == -1 && errno == EINTR);
+  return result;
+}
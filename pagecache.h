@@ -0,0 +1,26 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <sys/types.h>
+
+// Whether parts of a file are in the page cache, so that the event loop
+// can send what is resident and leave the rest to be read by another
+// thread. Where the system cannot tell, everything is resident.
+
+// Map `length` bytes of `file` to ask about with pagecache_resident().
+// Nothing is read. Returns NULL if the file cannot be mapped.
+void* pagecache_map(int file, off_t length);
+
+void pagecache_unmap(void* map, off_t length);
+
+// Returns 1 if all of the `length` bytes from `offset` in `map` are in
+// the page cache, and 0 if reading them would wait for the disk.
+int pagecache_resident(void* map, off_t offset, off_t length);
+
+// Read `length` bytes of `file` from `offset` without waiting for the
+// disk. Returns the number of bytes read, which is short if the rest are
+// not resident, or -1 with errno set to EAGAIN if none are. Where that
+// cannot be done, this is pread().
+ssize_t pagecache_read(int file, void* buffer, size_t length, off_t offset);
+
+#endif
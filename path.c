@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#define HAVE_OPENAT2 1
+#ifndef RESOLVE_CACHED
+#define RESOLVE_CACHED 0x20
+#endif
+#endif
+#endif
+#include "path.h"
+
+static const char default_filename[] = "index.html";
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Drop the segment that starts at `segment` if it is empty or ".", or
+// it and its parent if it is "..". Returns 1 if the segment was dropped,
+// 0 if it is an ordinary name, and -1 if ".." would leave the root.
+static int resolve_segment(const char* out, size_t* length, size_t segment) {
+  const size_t n = *length - segment;
+  if (n == 0 || (n == 1 && out[segment] == '.')) {
+    *length = segment;
+    return 1;
+  }
+  if (n == 2 && out[segment] == '.' && out[segment + 1] == '.') {
+    if (segment == 0) {
+      return -1;
+    }
+    *length = segment - 1;
+    while (*length > 0 && out[*length - 1] != '/') {
+      --*length;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int request_path(const char* uri, char* out, size_t size) {
+  if (*uri++ != '/' || size == 0) {
+    return -1;
+  }
+
+  // `out` holds the finished segments, each followed by a '/', and then
+  // the segment being read, which starts at `segment`.
+  size_t length = 0;
+  size_t segment = 0;
+
+  for (;;) {
+    char c = *uri++;
+
+    if (c == '\0' || c == '?' || c == '#') {
+      break;
+    }
+
+    // Decode before looking for separators, so that an escaped '/' or
+    // "." cannot smuggle a ".." segment past the checks below.
+    if (c == '%') {
+      const int high = hex_value(uri[0]);
+      const int low = high == -1 ? -1 : hex_value(uri[1]);
+      if (low == -1 || (high == 0 && low == 0)) {
+        return -1;
+      }
+      c = (char)(high << 4 | low);
+      uri += 2;
+    }
+
+    if (c == '/') {
+      const int resolved = resolve_segment(out, &length, segment);
+      if (resolved == -1) {
+        return -1;
+      }
+      if (resolved == 0) {
+        out[length++] = '/';
+      }
+      segment = length;
+      continue;
+    }
+
+    if (length + 1 >= size) {
+      return -1;
+    }
+    out[length++] = c;
+  }
+
+  // A trailing "." or ".." names a directory, like a trailing '/'.
+  if (length > segment && resolve_segment(out, &length, segment) == -1) {
+    return -1;
+  }
+
+  if (length == 0 || out[length - 1] == '/') {
+    if (length + sizeof(default_filename) > size) {
+      return -1;
+    }
+    memcpy(out + length, default_filename, sizeof(default_filename));
+    return length + sizeof(default_filename) - 1;
+  }
+
+  out[length] = '\0';
+  return length;
+}
+
+int open_beneath(int root_fd, const char* path, int cached) {
+#ifdef HAVE_OPENAT2
+  // Both are read and cleared from the I/O threads as well as the loop.
+  static int have_openat2 = 1;
+  static int have_cached = 1;
+  if (__atomic_load_n(&have_openat2, __ATOMIC_RELAXED) &&
+      (!cached || __atomic_load_n(&have_cached, __ATOMIC_RELAXED))) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | (cached ? RESOLVE_CACHED : 0);
+    const int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd != -1 || (errno != ENOSYS && !(cached && errno == EINVAL))) {
+      return fd;
+    }
+    if (errno == ENOSYS) {
+      // Older kernel: fall back to openat(). The path has no ".." left in
+      // it, but symlinks are followed as before.
+      __atomic_store_n(&have_openat2, 0, __ATOMIC_RELAXED);
+    } else {
+      // RESOLVE_CACHED arrived after openat2() itself.
+      __atomic_store_n(&have_cached, 0, __ATOMIC_RELAXED);
+    }
+  }
+#endif
+  if (cached) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return openat(root_fd, path, O_RDONLY | O_CLOEXEC);
+}
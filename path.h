@@ -0,0 +1,24 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+// Turn the target of a request ("/a/./b/../c%20d.html?q=1") into a path
+// relative to the document root ("a/c d.html"). Percent-escapes are
+// decoded and "." and ".." segments resolved in a single pass, and a
+// path naming a directory gets "index.html" appended. Returns the length
+// of the path written to `out`, or -1 if the target is malformed, would
+// climb out of the root, or does not fit in `size` bytes.
+int request_path(const char* uri, char* out, size_t size);
+
+// Open `path` for reading relative to the directory `root_fd`. Where the
+// kernel supports openat2(), resolution may not leave the root, by ".."
+// or by symlink, and magic links such as /proc/self/fd are refused.
+//
+// If `cached` is set, fail with EAGAIN rather than wait for the disk or
+// the network: the path must be resolved from the kernel's caches alone
+// (RESOLVE_CACHED, Linux 5.12). Where that cannot be asked for, a cached
+// open always fails with EAGAIN.
+int open_beneath(int root_fd, const char* path, int cached);
+
+#endif
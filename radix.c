@@ -0,0 +1,645 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "radix.h"
+
+// The arrays of children. The first two kinds keep the bytes sorted next
+// to the children; node48 has a slot number (plus one) for every byte;
+// node256 has a child for every byte.
+enum {
+  kind_none,
+  kind_4,
+  kind_16,
+  kind_48,
+  kind_256
+};
+
+struct children4 {
+  unsigned char keys[4];
+  struct radix_node* nodes[4];
+};
+
+struct children16 {
+  unsigned char keys[16];
+  struct radix_node* nodes[16];
+};
+
+struct children48 {
+  unsigned char slots[256];
+  struct radix_node* nodes[48];
+};
+
+struct children256 {
+  struct radix_node* nodes[256];
+};
+
+static const int capacities[] = { 0, 4, 16, 48, 256 };
+
+// A node shrinks to the next smaller kind once this many children are
+// left, which is less than that kind holds, so that a node with about
+// as many children as a kind holds does not flip back and forth.
+static const int shrink_at[] = { 0, 0, 3, 12, 40 };
+
+static const size_t children_sizes[] = {
+  0,
+  sizeof(struct children4),
+  sizeof(struct children16),
+  sizeof(struct children48),
+  sizeof(struct children256)
+};
+
+static const char* prefix_of(const struct radix_node* node) {
+  return node->prefix;
+}
+
+static size_t node_size(size_t capacity) {
+  return offsetof(struct radix_node, prefix) + capacity;
+}
+
+// A node with room for just `length` bytes of prefix, which is all that
+// most nodes, the ends of keys, will ever need.
+static struct radix_node* new_node(struct radix* tree, const char* prefix, size_t length) {
+  if (length > UINT16_MAX) {
+    return NULL;
+  }
+  struct radix_node* node = malloc(node_size(length));
+  if (!node) {
+    return NULL;
+  }
+  memset(node, 0, sizeof(*node));
+  if (length > 0) {
+    memcpy(node->prefix, prefix, length);
+  }
+  node->prefix_length = length;
+  node->capacity = length;
+  tree->bytes += node_size(length);
+  return node;
+}
+
+static void free_node(struct radix* tree, struct radix_node* node) {
+  tree->bytes -= children_sizes[node->kind] + node_size(node->capacity);
+  free(node->children);
+  free(node);
+}
+
+static struct radix_node** find_child(const struct radix_node* node, unsigned char byte) {
+  switch (node->kind) {
+    case kind_4: {
+      struct children4* children = node->children;
+      for (int i = 0; i < node->count; ++i) {
+        if (children->keys[i] == byte) {
+          return &children->nodes[i];
+        }
+      }
+      return NULL;
+    }
+    case kind_16: {
+      struct children16* children = node->children;
+#ifdef __SSE2__
+      const __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte),
+          _mm_loadu_si128((const __m128i*)children->keys));
+      const unsigned mask = _mm_movemask_epi8(matches) & ((1u << node->count) - 1);
+      return mask ? &children->nodes[__builtin_ctz(mask)] : NULL;
+#else
+      for (int i = 0; i < node->count; ++i) {
+        if (children->keys[i] == byte) {
+          return &children->nodes[i];
+        }
+      }
+      return NULL;
+#endif
+    }
+    case kind_48: {
+      struct children48* children = node->children;
+      const int slot = children->slots[byte];
+      return slot ? &children->nodes[slot - 1] : NULL;
+    }
+    case kind_256: {
+      struct children256* children = node->children;
+      return children->nodes[byte] ? &children->nodes[byte] : NULL;
+    }
+  }
+  return NULL;
+}
+
+// The children in byte order, as `count` bytes and nodes.
+static int list_children(const struct radix_node* node, unsigned char* keys,
+    struct radix_node** nodes) {
+  int count = 0;
+  switch (node->kind) {
+    case kind_4:
+    case kind_16: {
+      const unsigned char* from_keys = node->kind == kind_4 ?
+        ((struct children4*)node->children)->keys : ((struct children16*)node->children)->keys;
+      struct radix_node* const* from_nodes = node->kind == kind_4 ?
+        ((struct children4*)node->children)->nodes : ((struct children16*)node->children)->nodes;
+      memcpy(keys, from_keys, node->count);
+      memcpy(nodes, from_nodes, node->count * sizeof(*nodes));
+      count = node->count;
+      break;
+    }
+    case kind_48: {
+      struct children48* children = node->children;
+      for (int byte = 0; byte < 256; ++byte) {
+        if (children->slots[byte]) {
+          keys[count] = byte;
+          nodes[count++] = children->nodes[children->slots[byte] - 1];
+        }
+      }
+      break;
+    }
+    case kind_256: {
+      struct children256* children = node->children;
+      for (int byte = 0; byte < 256; ++byte) {
+        if (children->nodes[byte]) {
+          keys[count] = byte;
+          nodes[count++] = children->nodes[byte];
+        }
+      }
+      break;
+    }
+  }
+  return count;
+}
+
+// Rebuild the children in an array of `kind`, from the sorted list.
+static int set_children(struct radix* tree, struct radix_node* node, int kind,
+    const unsigned char* keys, struct radix_node* const* nodes, int count) {
+  void* array = NULL;
+  if (kind != kind_none) {
+    array = calloc(1, children_sizes[kind]);
+    if (!array) {
+      return -1;
+    }
+  }
+  switch (count > 0 ? kind : kind_none) {
+    case kind_4:
+      memcpy(((struct children4*)array)->keys, keys, count);
+      memcpy(((struct children4*)array)->nodes, nodes, count * sizeof(*nodes));
+      break;
+    case kind_16:
+      memcpy(((struct children16*)array)->keys, keys, count);
+      memcpy(((struct children16*)array)->nodes, nodes, count * sizeof(*nodes));
+      break;
+    case kind_48:
+      for (int i = 0; i < count; ++i) {
+        ((struct children48*)array)->slots[keys[i]] = i + 1;
+        ((struct children48*)array)->nodes[i] = nodes[i];
+      }
+      break;
+    case kind_256:
+      for (int i = 0; i < count; ++i) {
+        ((struct children256*)array)->nodes[keys[i]] = nodes[i];
+      }
+      break;
+  }
+  tree->bytes += children_sizes[kind];
+  tree->bytes -= children_sizes[node->kind];
+  free(node->children);
+  node->children = array;
+  node->kind = kind;
+  node->count = count;
+  return 0;
+}
+
+static int add_child(struct radix* tree, struct radix_node* node, unsigned char byte,
+    struct radix_node* child) {
+  child->parent = node;
+  child->edge = byte;
+  if (node->count == capacities[node->kind]) {
+    unsigned char keys[256];
+    struct radix_node* nodes[256];
+    const int count = list_children(node, keys, nodes);
+    if (set_children(tree, node, node->kind + 1, keys, nodes, count) == -1) {
+      return -1;
+    }
+  }
+  switch (node->kind) {
+    case kind_4:
+    case kind_16: {
+      unsigned char* keys = node->kind == kind_4 ?
+        ((struct children4*)node->children)->keys : ((struct children16*)node->children)->keys;
+      struct radix_node** nodes = node->kind == kind_4 ?
+        ((struct children4*)node->children)->nodes : ((struct children16*)node->children)->nodes;
+      int i = node->count;
+      for (; i > 0 && keys[i - 1] > byte; --i) {
+        keys[i] = keys[i - 1];
+        nodes[i] = nodes[i - 1];
+      }
+      keys[i] = byte;
+      nodes[i] = child;
+      break;
+    }
+    case kind_48: {
+      struct children48* children = node->children;
+      children->nodes[node->count] = child;
+      children->slots[byte] = node->count + 1;
+      break;
+    }
+    case kind_256:
+      ((struct children256*)node->children)->nodes[byte] = child;
+      break;
+  }
+  node->count++;
+  return 0;
+}
+
+static void remove_child(struct radix* tree, struct radix_node* node, unsigned char byte) {
+  const int count = node->count - 1;
+  if (count == 0 || count <= shrink_at[node->kind]) {
+    unsigned char keys[256];
+    struct radix_node* nodes[256];
+    list_children(node, keys, nodes);
+    int i = 0;
+    while (keys[i] != byte) {
+      ++i;
+    }
+    memmove(keys + i, keys + i + 1, count - i);
+    memmove(nodes + i, nodes + i + 1, (count - i) * sizeof(*nodes));
+    if (set_children(tree, node, count == 0 ? kind_none : node->kind - 1, keys, nodes, count) == 0) {
+      return;
+    }
+  }
+
+  // Without memory to shrink, or no need to, take the child out in place.
+  switch (node->kind) {
+    case kind_4:
+    case kind_16: {
+      unsigned char* keys = node->kind == kind_4 ?
+        ((struct children4*)node->children)->keys : ((struct children16*)node->children)->keys;
+      struct radix_node** nodes = node->kind == kind_4 ?
+        ((struct children4*)node->children)->nodes : ((struct children16*)node->children)->nodes;
+      int i = 0;
+      while (keys[i] != byte) {
+        ++i;
+      }
+      memmove(keys + i, keys + i + 1, count - i);
+      memmove(nodes + i, nodes + i + 1, (count - i) * sizeof(*nodes));
+      break;
+    }
+    case kind_48: {
+      // Move the last child into the freed slot.
+      struct children48* children = node->children;
+      const int slot = children->slots[byte] - 1;
+      children->nodes[slot] = children->nodes[count];
+      children->slots[children->nodes[slot]->edge] = slot + 1;
+      children->slots[byte] = 0;
+      children->nodes[count] = NULL;
+      break;
+    }
+    case kind_256:
+      ((struct children256*)node->children)->nodes[byte] = NULL;
+      break;
+  }
+  node->count = count;
+}
+
+// The first child whose byte is `from` or later, with its byte in `key`.
+static struct radix_node* next_child(const struct radix_node* node, int from, unsigned char* key) {
+  switch (node->kind) {
+    case kind_4:
+    case kind_16: {
+      const unsigned char* keys = node->kind == kind_4 ?
+        ((struct children4*)node->children)->keys : ((struct children16*)node->children)->keys;
+      struct radix_node* const* nodes = node->kind == kind_4 ?
+        ((struct children4*)node->children)->nodes : ((struct children16*)node->children)->nodes;
+      for (int i = 0; i < node->count; ++i) {
+        if (keys[i] >= from) {
+          *key = keys[i];
+          return nodes[i];
+        }
+      }
+      return NULL;
+    }
+    case kind_48: {
+      struct children48* children = node->children;
+      for (int byte = from; byte < 256; ++byte) {
+        if (children->slots[byte]) {
+          *key = byte;
+          return children->nodes[children->slots[byte] - 1];
+        }
+      }
+      return NULL;
+    }
+    case kind_256: {
+      struct children256* children = node->children;
+      for (int byte = from; byte < 256; ++byte) {
+        if (children->nodes[byte]) {
+          *key = byte;
+          return children->nodes[byte];
+        }
+      }
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int radix_init(struct radix* tree) {
+  memset(tree, 0, sizeof(*tree));
+  tree->root = new_node(tree, NULL, 0);
+  return tree->root ? 0 : -1;
+}
+
+static void clear_node(struct radix* tree, struct radix_node* node) {
+  unsigned char key;
+  for (struct radix_node* child = next_child(node, 0, &key); child;
+      child = key < 255 ? next_child(node, key + 1, &key) : NULL) {
+    clear_node(tree, child);
+    free_node(tree, child);
+  }
+}
+
+void radix_clear(struct radix* tree) {
+  if (tree->root) {
+    clear_node(tree, tree->root);
+    free_node(tree, tree->root);
+  }
+  memset(tree, 0, sizeof(*tree));
+}
+
+struct radix_node* radix_find(const struct radix* tree, const char* key, size_t length) {
+  const struct radix_node* node = tree->root;
+  size_t position = 0;
+  for (;;) {
+    const size_t prefix_length = node->prefix_length;
+    if (length - position < prefix_length ||
+        memcmp(prefix_of(node), key + position, prefix_length) != 0) {
+      return NULL;
+    }
+    position += prefix_length;
+    if (position == length) {
+      return node->value ? (struct radix_node*)node : NULL;
+    }
+    struct radix_node** child = find_child(node, key[position++]);
+    if (!child) {
+      return NULL;
+    }
+    node = *child;
+  }
+}
+
+struct radix_node* radix_match(const struct radix* tree, const char* key, size_t length) {
+  const struct radix_node* node = tree->root;
+  const struct radix_node* longest = NULL;
+  size_t position = 0;
+  for (;;) {
+    const size_t prefix_length = node->prefix_length;
+    if (length - position < prefix_length ||
+        memcmp(prefix_of(node), key + position, prefix_length) != 0) {
+      return (struct radix_node*)longest;
+    }
+    position += prefix_length;
+    if (node->value) {
+      longest = node;
+    }
+    if (position == length) {
+      return (struct radix_node*)longest;
+    }
+    struct radix_node** child = find_child(node, key[position++]);
+    if (!child) {
+      return (struct radix_node*)longest;
+    }
+    node = *child;
+  }
+}
+
+struct radix_node* radix_insert(struct radix* tree, const char* key, size_t length, void* value) {
+  struct radix_node* node = tree->root;
+  size_t position = 0;
+  if (length > UINT16_MAX) {
+    return NULL;
+  }
+  for (;;) {
+    const char* prefix = prefix_of(node);
+    const size_t prefix_length = node->prefix_length;
+    size_t matched = 0;
+    while (matched < prefix_length && position + matched < length &&
+        prefix[matched] == key[position + matched]) {
+      ++matched;
+    }
+
+    if (matched < prefix_length) {
+      // The key leaves the prefix part way: put a node for the part they
+      // share above this one.
+      // Everything that can fail is done before the tree is changed. The
+      // lower node keeps its place, and the rest of its prefix.
+      struct radix_node* parent = node->parent;
+      const unsigned char edge = node->edge;
+      const unsigned char split = prefix[matched];
+      struct radix_node* upper = new_node(tree, prefix, matched);
+      if (!upper || set_children(tree, upper, kind_4, NULL, NULL, 0) == -1) {
+        if (upper) {
+          free_node(tree, upper);
+        }
+        return NULL;
+      }
+      node->prefix_length = prefix_length - matched - 1;
+      memmove(node->prefix, node->prefix + matched + 1, node->prefix_length);
+      add_child(tree, upper, split, node);
+      *find_child(parent, edge) = upper;
+      upper->parent = parent;
+      upper->edge = edge;
+      node = upper;
+    }
+
+    position += matched;
+    if (position == length) {
+      tree->count += node->value == NULL;
+      node->value = value;
+      return node;
+    }
+
+    struct radix_node** child = find_child(node, key[position]);
+    if (child) {
+      node = *child;
+      ++position;
+      continue;
+    }
+
+    struct radix_node* leaf = new_node(tree, key + position + 1, length - position - 1);
+    if (!leaf || add_child(tree, node, key[position], leaf) == -1) {
+      if (leaf) {
+        free_node(tree, leaf);
+      }
+      return NULL;
+    }
+    leaf->value = value;
+    tree->count++;
+    return leaf;
+  }
+}
+
+// Fold `node`, which has no key and one child, into the child: the
+// child's prefix becomes the node's, the child's edge byte, then its own.
+// A child with a key stays where it is, as its node is the key's handle,
+// so if the longer prefix does not fit the node is left in the tree.
+static void merge_child(struct radix* tree, struct radix_node* node) {
+  unsigned char edge;
+  struct radix_node* child = next_child(node, 0, &edge);
+  const size_t length = node->prefix_length + 1 + child->prefix_length;
+  if (length > child->capacity) {
+    if (child->value || length > UINT16_MAX) {
+      return;
+    }
+    struct radix_node* moved = realloc(child, node_size(length));
+    if (!moved) {
+      return;
+    }
+    tree->bytes += length - moved->capacity;
+    moved->capacity = length;
+    unsigned char key;
+    for (struct radix_node* grandchild = next_child(moved, 0, &key); grandchild;
+        grandchild = key < 255 ? next_child(moved, key + 1, &key) : NULL) {
+      grandchild->parent = moved;
+    }
+    child = moved;
+  }
+  memmove(child->prefix + node->prefix_length + 1, child->prefix, child->prefix_length);
+  memcpy(child->prefix, node->prefix, node->prefix_length);
+  child->prefix[node->prefix_length] = (char)edge;
+  child->prefix_length = length;
+
+  *find_child(node->parent, node->edge) = child;
+  child->parent = node->parent;
+  child->edge = node->edge;
+  free_node(tree, node);
+}
+
+void radix_remove(struct radix* tree, struct radix_node* node) {
+  node->value = NULL;
+  tree->count--;
+
+  // Drop nodes that no key needs any more, and fold a node left with one
+  // child into that child.
+  while (node != tree->root && !node->value) {
+    struct radix_node* parent = node->parent;
+    if (node->count == 0) {
+      remove_child(tree, parent, node->edge);
+      free_node(tree, node);
+      node = parent;
+      continue;
+    }
+    if (node->count == 1) {
+      merge_child(tree, node);
+    }
+    break;
+  }
+}
+
+size_t radix_key(const struct radix_node* node, char* buffer, size_t size) {
+  size_t length = 0;
+  for (const struct radix_node* n = node; n->parent; n = n->parent) {
+    length += n->prefix_length + 1;
+  }
+  size_t end = length;
+  for (const struct radix_node* n = node; n->parent; n = n->parent) {
+    end -= n->prefix_length;
+    if (end + n->prefix_length <= size) {
+      memcpy(buffer + end, prefix_of(n), n->prefix_length);
+    }
+    --end;
+    if (end < size) {
+      buffer[end] = (char)n->edge;
+    }
+  }
+  return length;
+}
+
+struct walk {
+  char* key;
+  size_t length;
+  size_t capacity;
+  radix_visitor visit;
+  void* argument;
+};
+
+static int append(struct walk* walk, const char* bytes, size_t length) {
+  if (length == 0) {
+    return 0;
+  }
+  if (walk->length + length > walk->capacity) {
+    size_t capacity = walk->capacity ? walk->capacity * 2 : 256;
+    while (capacity < walk->length + length) {
+      capacity *= 2;
+    }
+    char* key = realloc(walk->key, capacity);
+    if (!key) {
+      return -1;
+    }
+    walk->key = key;
+    walk->capacity = capacity;
+  }
+  memcpy(walk->key + walk->length, bytes, length);
+  walk->length += length;
+  return 0;
+}
+
+// Visit the keys at and below `node`, whose prefix has been added to the
+// key already. Returns 1 if the walk is stopped, or -1 with no memory.
+static int walk_node(struct walk* walk, struct radix_node* node) {
+  if (node->value) {
+    const int stop = walk->visit(walk->key, walk->length, node, walk->argument);
+    if (stop) {
+      return 1;
+    }
+  }
+  unsigned char key;
+  for (struct radix_node* child = next_child(node, 0, &key); child;
+      child = key < 255 ? next_child(node, key + 1, &key) : NULL) {
+    const size_t length = walk->length;
+    const char edge = (char)key;
+    if (append(walk, &edge, 1) == -1 ||
+        append(walk, prefix_of(child), child->prefix_length) == -1) {
+      return -1;
+    }
+    const int result = walk_node(walk, child);
+    walk->length = length;
+    if (result != 0) {
+      return result;
+    }
+  }
+  return 0;
+}
+
+int radix_walk(const struct radix* tree, const char* prefix, size_t length,
+    radix_visitor visit, void* argument) {
+  struct walk walk = { NULL, 0, 0, visit, argument };
+
+  // Find the highest node whose keys all start with `prefix`.
+  struct radix_node* node = tree->root;
+  size_t position = 0;
+  for (;;) {
+    const size_t prefix_length = node->prefix_length;
+    const size_t compare = length - position < prefix_length ? length - position : prefix_length;
+    if (memcmp(prefix_of(node), prefix + position, compare) != 0) {
+      return 0;
+    }
+    if (append(&walk, prefix_of(node), prefix_length) == -1) {
+      free(walk.key);
+      return -1;
+    }
+    position += compare;
+    if (position == length) {
+      break;
+    }
+    struct radix_node** child = find_child(node, prefix[position]);
+    if (!child) {
+      free(walk.key);
+      return 0;
+    }
+    const char edge = prefix[position++];
+    if (append(&walk, &edge, 1) == -1) {
+      free(walk.key);
+      return -1;
+    }
+    node = *child;
+  }
+
+  const int result = walk_node(&walk, node);
+  free(walk.key);
+  return result == -1 ? -1 : 0;
+}
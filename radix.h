@@ -0,0 +1,76 @@
+#ifndef RADIX_H
+#define RADIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A compressed radix trie from strings (paths) to values, in the style
+// of the adaptive radix tree: a node's children are kept in an array
+// sized for 4, 16, 48 or 256 of them, grown and shrunk as they come and
+// go, and a chain of nodes with one child each is folded into a single
+// node with the bytes it spans as its prefix. Keys with a common prefix
+// store it once, but every key has a node of its own, and every node
+// with children an array of them besides, so a tree of paths takes about
+// as much memory as a copy of each path would.
+//
+// Every key ends at a node of its own, which stays at the same address
+// for as long as the key is in the tree, so a node can be kept as a
+// handle for the key, and removed without looking it up again. Keys are
+// visited in byte order, so the keys under a directory are a prefix
+// walk.
+
+struct radix_node {
+  // Private to the tree.
+  struct radix_node* parent;
+  void* value;  // NULL if no key ends here
+  void* children;
+  uint16_t prefix_length;
+  uint16_t capacity;  // for the prefix
+  uint16_t count;
+  uint8_t kind;
+  unsigned char edge;  // the byte that leads here from the parent
+  char prefix[];
+};
+
+struct radix {
+  struct radix_node* root;
+  size_t count;  // keys
+  size_t bytes;  // asked of malloc() for nodes and their children, before its overhead
+};
+
+// Returns -1 if there is no memory for the tree.
+int radix_init(struct radix* tree);
+
+// Free the tree's nodes. radix_init() makes it ready to use again.
+void radix_clear(struct radix* tree);
+
+// The node for `key`, or NULL if it is not in the tree.
+struct radix_node* radix_find(const struct radix* tree, const char* key, size_t length);
+
+// The node of the longest key in the tree that `key` starts with, or
+// NULL if there is none.
+struct radix_node* radix_match(const struct radix* tree, const char* key, size_t length);
+
+// Map `key` to `value`, which must not be NULL, replacing any value it
+// had. Returns the key's node, or NULL if there is no memory for it or
+// the key is longer than 64 KiB.
+struct radix_node* radix_insert(struct radix* tree, const char* key, size_t length, void* value);
+
+// Remove the key that ends at `node`.
+void radix_remove(struct radix* tree, struct radix_node* node);
+
+// Write the key that ends at `node` to `buffer`, returning its length,
+// which may be more than `size` if it did not fit.
+size_t radix_key(const struct radix_node* node, char* buffer, size_t size);
+
+// Called with each key in order, its length and its node, which must not
+// be removed during the walk. Returns nonzero to stop the walk.
+typedef int (*radix_visitor)(const char* key, size_t length,
+    struct radix_node* node, void* argument);
+
+// Visit every key that starts with `prefix`. Returns -1 if there is no
+// memory to build the keys in, or 0.
+int radix_walk(const struct radix* tree, const char* prefix, size_t length,
+    radix_visitor visit, void* argument);
+
+#endif
@@ -0,0 +1,139 @@
+#include "hash.h"
+#include "ratelimit.h"
+
+enum {
+  table_size = 1 << 14,  // 384 KiB
+  probe_limit = 8
+};
+
+struct client_buckets {
+  uint64_t key;          // address plus a marker bit, 0 when free
+  uint64_t request_tat;  // times at which each bucket is full again
+  uint64_t byte_tat;
+};
+
+static struct client_buckets table[table_size];
+static struct ratelimit_config limits;
+static uint64_t seed;
+
+// Bucket costs and capacities, in nanoseconds.
+static uint64_t request_interval;
+static uint64_t request_window;
+static double byte_interval;
+static uint64_t byte_window;
+
+void ratelimit_init(const struct ratelimit_config* config) {
+  limits = *config;
+  if (limits.request_rate) {
+    request_interval = 1000000000 / limits.request_rate;
+    request_window = (limits.request_burst ? limits.request_burst : 1) * request_interval;
+  }
+  if (limits.byte_rate) {
+    byte_interval = 1e9 / limits.byte_rate;
+    byte_window = (limits.byte_burst ? limits.byte_burst : 1) * byte_interval;
+  }
+
+  // A secret seed keeps clients from choosing addresses that collide.
+  hash_random_key(&seed, 1);
+}
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+static uint64_t load(const uint64_t* value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+static int claim(uint64_t* key, uint64_t expected, uint64_t desired) {
+  return __atomic_compare_exchange_n(key, &expected, desired, 0,
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// A client whose buckets are both full has nothing worth keeping.
+static int is_stale(const struct client_buckets* buckets, uint64_t now) {
+  return load(&buckets->request_tat) <= now && load(&buckets->byte_tat) <= now;
+}
+
+// Find the client's buckets, taking a free or stale slot near its hash
+// if it has none. Returns NULL if every slot in the probe window belongs
+// to a client that is being limited; the caller lets the request through
+// rather than penalise an innocent client.
+//
+// A slot is reclaimed with a compare-and-swap of its key and then reset,
+// so a request racing with the reclaim can at worst be charged to the
+// client that took the slot over.
+static struct client_buckets* find_buckets(uint32_t address, uint64_t now) {
+  const uint64_t key = (uint64_t)address | ((uint64_t)1 << 32);
+  const uint64_t hash = mix(key ^ seed);
+
+  for (int i = 0; i < probe_limit; ++i) {
+    struct client_buckets* buckets = &table[(hash + i) & (table_size - 1)];
+    if (load(&buckets->key) == key) {
+      return buckets;
+    }
+  }
+
+  for (int i = 0; i < probe_limit; ++i) {
+    struct client_buckets* buckets = &table[(hash + i) & (table_size - 1)];
+    const uint64_t current = load(&buckets->key);
+    if (current == key) {
+      return buckets;
+    }
+    if (current != 0 && !is_stale(buckets, now)) {
+      continue;
+    }
+    if (claim(&buckets->key, current, key)) {
+      __atomic_store_n(&buckets->request_tat, 0, __ATOMIC_RELEASE);
+      __atomic_store_n(&buckets->byte_tat, 0, __ATOMIC_RELEASE);
+      return buckets;
+    }
+  }
+  return NULL;
+}
+
+// Take `cost` from the bucket whose full time is `*tat`. Unless `force`
+// is set, fail rather than take the bucket below empty.
+static int take(uint64_t* tat, uint64_t cost, uint64_t window, uint64_t now, int force) {
+  uint64_t current = load(tat);
+  for (;;) {
+    const uint64_t next = (current > now ? current : now) + cost;
+    if (!force && next - now > window) {
+      return 0;
+    }
+    if (__atomic_compare_exchange_n(tat, &current, next, 1,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return 1;
+    }
+  }
+}
+
+int ratelimit_admit(uint32_t address, uint64_t now) {
+  struct client_buckets* buckets = find_buckets(address, now);
+  if (!buckets) {
+    return 1;
+  }
+  if (limits.byte_rate && load(&buckets->byte_tat) >= now + byte_window) {
+    return 0;
+  }
+  if (limits.request_rate &&
+      !take(&buckets->request_tat, request_interval, request_window, now, 0)) {
+    return 0;
+  }
+  return 1;
+}
+
+void ratelimit_charge(uint32_t address, uint64_t bytes, uint64_t now) {
+  if (!limits.byte_rate || bytes == 0) {
+    return;
+  }
+  struct client_buckets* buckets = find_buckets(address, now);
+  if (buckets) {
+    take(&buckets->byte_tat, (uint64_t)(bytes * byte_interval), byte_window, now, 1);
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Per-client request and byte rate limits.
+//
+// Each client address has two token buckets, one counting requests and
+// one counting response bytes. A bucket is stored as the time at which
+// it will be full again (the GCRA form of a token bucket), so taking
+// tokens is a single compare-and-swap. Buckets live in a fixed-size
+// open-addressed table, updated only with atomic operations, so it is
+// safe to share between threads without a lock. A client whose buckets
+// have refilled carries no state, and its slot is reclaimed by the next
+// client that hashes near it.
+
+struct ratelimit_config {
+  uint64_t request_rate;   // requests per second, 0 for no limit
+  uint64_t request_burst;  // requests allowed at once
+  uint64_t byte_rate;      // bytes per second, 0 for no limit
+  uint64_t byte_burst;     // bytes allowed at once
+};
+
+void ratelimit_init(const struct ratelimit_config* config);
+
+static inline int ratelimit_enabled(const struct ratelimit_config* config) {
+  return config->request_rate || config->byte_rate;
+}
+
+// Take a request token for the client with IPv4 address `address`
+// (network byte order) at monotonic time `now` in nanoseconds. Returns
+// 1 if the request may proceed, or 0 if the client is over either of
+// its limits.
+int ratelimit_admit(uint32_t address, uint64_t now);
+
+// Take `bytes` byte tokens from the client after a response. The byte
+// bucket may go into debt; the client is refused until it is repaid.
+void ratelimit_charge(uint32_t address, uint64_t bytes, uint64_t now);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include "response.h"
+
+struct mime_type_t { const char* ext; const char* mime; } mime_types[] = {
+  { ".htm", "text/html" },
+  { ".html", "text/html" },
+  { ".js", "text/javascript" },
+  { ".css", "text/css" },
+  { ".svg", "image/svg+xml" },
+  { ".jpg", "image/jpeg" },
+  { ".jpeg", "image/jpeg" },
+  { ".png", "image/png" },
+  { ".gif", "image/gif" },
+  { ".pdf", "application/pdf" },
+  { ".xml", "text/xml" },
+  { ".md", "text/markdown" },
+  { ".csv", "text/csv" },
+  { ".mp3", "audio/mpeg" },
+  { ".zip", "application/zip" },
+  { ".gz", "application/gzip" },
+  { ".xhtml", "application/xhtml+xml" }
+};
+
+const char* content_type(const char* uri)
+{
+  size_t i;
+  const char* ext = strrchr(uri, '.');
+  if (ext == NULL)
+	  return NULL;
+  for (i = 0; i < sizeof(mime_types)/sizeof(mime_types[0]); ++i)
+    if (strcasecmp(ext + 1, mime_types[i].ext + 1) == 0)
+      return mime_types[i].mime;
+  return NULL;
+}
+
+void buffer_set_content_type(buffer_t* buffer, const char* uri)
+{
+  const char* mime = content_type(uri);
+  if (mime)
+    buffer_appendf(buffer, "Content-Type: %s\r\n", mime);
+}
+
+static void append_date(buffer_t* buffer, const struct tm *timeinfo)
+{
+  char time_buffer[time_buffer_size];
+  const size_t time_size = strftime(time_buffer, time_buffer_size, "%a, %d %h %Y %T %Z", timeinfo);
+
+  if (time_size == 0) {
+    fprintf(stderr, "Error formatting time");
+    exit(EXIT_SUCCESS);
+  }
+
+  // Date: Sun, 07 Sep 2014 14: 51:17 GMT
+  buffer_appendf(buffer, "Date: %s\r\n", time_buffer);
+}
+
+buffer_t* response_headers(off_t length, const char* rules, const struct tm *timeinfo, const char* uri)
+{
+  buffer_t *result = buffer_new();
+  buffer_append(result, "HTTP/1.1 200 OK\r\n");
+  append_date(result, timeinfo);
+
+  // TODO:
+  // Last-Modified: Sun, 07 Sep 2014 01: 37:26 GMT
+
+  buffer_append(result, rules);
+
+  // Content - Length:459211
+
+  buffer_set_content_type(result, uri);
+
+  buffer_appendf(result, "Content-Length: %jd\r\n", (intmax_t)length);
+  buffer_append(result, "Access-Control-Allow-Methods: GET, HEAD\r\n");
+  buffer_append(result, "Access-Control-Allow-Origin: *\r\n");
+  buffer_append(result, "Server: Garcon 1.0\r\n");
+  buffer_append(result, "\r\n");
+
+  return result;
+}
+
+buffer_t* packed_response_headers(off_t length, const char* rules,
+    const struct tm *timeinfo, const char* type, const char* etag, int gzip)
+{
+  buffer_t *result = buffer_new();
+  buffer_append(result, "HTTP/1.1 200 OK\r\n");
+  append_date(result, timeinfo);
+  buffer_append(result, rules);
+  if (type) {
+    buffer_appendf(result, "Content-Type: %s\r\n", type);
+  }
+  if (gzip) {
+    buffer_append(result, "Content-Encoding: gzip\r\n");
+  }
+  buffer_append(result, "Vary: Accept-Encoding\r\n");
+  buffer_appendf(result, "ETag: %s\r\n", etag);
+  buffer_appendf(result, "Content-Length: %jd\r\n", (intmax_t)length);
+  buffer_append(result, "Access-Control-Allow-Methods: GET, HEAD\r\n");
+  buffer_append(result, "Access-Control-Allow-Origin: *\r\n");
+  buffer_append(result, "Server: Garcon 1.0\r\n");
+  buffer_append(result, "\r\n");
+
+  return result;
+}
+
+buffer_t* listing_response_headers(off_t length, int chunked,
+    const struct tm *timeinfo, const char* type)
+{
+  buffer_t *result = buffer_new();
+  buffer_append(result, "HTTP/1.1 200 OK\r\n");
+  append_date(result, timeinfo);
+  buffer_append(result, "cache-control: no-cache\r\n");
+  buffer_appendf(result, "Content-Type: %s\r\n", type);
+  buffer_append(result, "Vary: Accept\r\n");
+  if (length >= 0) {
+    buffer_appendf(result, "Content-Length: %jd\r\n", (intmax_t)length);
+  } else if (chunked) {
+    buffer_append(result, "Transfer-Encoding: chunked\r\n");
+  } else {
+    buffer_append(result, "Connection: close\r\n");
+  }
+  buffer_append(result, "Access-Control-Allow-Methods: GET, HEAD\r\n");
+  buffer_append(result, "Access-Control-Allow-Origin: *\r\n");
+  buffer_append(result, "Server: Garcon 1.0\r\n");
+  buffer_append(result, "\r\n");
+
+  return result;
+}
+
+buffer_t* redirect_headers(const struct tm *timeinfo, const char* location)
+{
+  buffer_t *result = buffer_new();
+  buffer_append(result, "HTTP/1.1 301 Moved Permanently\r\n");
+  append_date(result, timeinfo);
+  buffer_appendf(result, "Location: %s\r\n", location);
+  buffer_append(result, "Content-Length: 0\r\n");
+  buffer_append(result, "Server: Garcon 1.0\r\n");
+  buffer_append(result, "\r\n");
+
+  return result;
+}
+
+buffer_t* upgrade_headers(const struct tm *timeinfo, const char* accept)
+{
+  buffer_t *result = buffer_new();
+  buffer_append(result, "HTTP/1.1 101 Switching Protocols\r\n");
+  append_date(result, timeinfo);
+  buffer_append(result, "Upgrade: websocket\r\n");
+  buffer_append(result, "Connection: Upgrade\r\n");
+  buffer_appendf(result, "Sec-WebSocket-Accept: %s\r\n", accept);
+  buffer_append(result, "Server: Garcon 1.0\r\n");
+  buffer_append(result, "\r\n");
+
+  return result;
+}
+
+buffer_t* not_modified_headers(const char* rules, const struct tm *timeinfo,
+    const char* etag)
+{
+  buffer_t *result = buffer_new();
+  buffer_append(result, "HTTP/1.1 304 Not Modified\r\n");
+  append_date(result, timeinfo);
+  buffer_append(result, rules);
+  buffer_append(result, "Vary: Accept-Encoding\r\n");
+  buffer_appendf(result, "ETag: %s\r\n", etag);
+  buffer_append(result, "Server: Garcon 1.0\r\n");
+  buffer_append(result, "\r\n");
+
+  return result;
+}
+
+struct error_response {
+  int status;
+  const char* reason;
+  const char* extra_headers;
+  char data[512];
+  size_t length;
+  size_t date_offset;
+};
+
+static struct error_response error_responses[] = {
+  { 400, "Bad Request", "", "", 0, 0 },
+  { 403, "Forbidden", "", "", 0, 0 },
+  { 404, "Not Found", "", "", 0, 0 },
+  { 405, "Method Not Allowed", "Allow: GET, HEAD\r\n", "", 0, 0 },
+  { 413, "Payload Too Large", "", "", 0, 0 },
+  { 429, "Too Many Requests", "Retry-After: 1\r\n", "", 0, 0 },
+  { 503, "Service Unavailable", "Retry-After: 1\r\n", "", 0, 0 }
+};
+
+enum {
+  error_response_count = sizeof(error_responses) / sizeof(error_responses[0]),
+  http_date_length = 29  // "Sun, 07 Sep 2014 14:51:17 GMT"
+};
+
+static time_t error_date;
+
+static void format_http_date(char* out, time_t now) {
+  struct tm timeinfo;
+  char date[time_buffer_size];
+  gmtime_r(&now, &timeinfo);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &timeinfo);
+  memcpy(out, date, http_date_length);
+}
+
+void error_responses_init(void) {
+  const time_t now = time(NULL);
+  char date[http_date_length + 1];
+  format_http_date(date, now);
+  date[http_date_length] = '\0';
+
+  for (size_t i = 0; i < error_response_count; ++i) {
+    struct error_response* e = &error_responses[i];
+    char body[32];
+    const int body_length = snprintf(body, sizeof(body), "http error %d", e->status);
+    const int length = snprintf(e->data, sizeof(e->data),
+        "HTTP/1.1 %d %s\r\n"
+        "Date: %s\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %d\r\n"
+        "%s"
+        "Access-Control-Allow-Methods: GET, HEAD\r\n"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: close\r\n"
+        "Server: Garcon 1.0\r\n"
+        "\r\n"
+        "%s",
+        e->status, e->reason, date, body_length, e->extra_headers, body);
+    e->length = length;
+    e->date_offset = strstr(e->data, date) - e->data;
+  }
+  error_date = now;
+}
+
+const char* error_response(int status, time_t now, size_t* length) {
+  if (now != error_date) {
+    // A response still being sent from the old bytes can pick up part of
+    // the new date, which is harmless: it has the same length.
+    for (size_t i = 0; i < error_response_count; ++i) {
+      format_http_date(error_responses[i].data + error_responses[i].date_offset, now);
+    }
+    error_date = now;
+  }
+
+  for (size_t i = 0; i < error_response_count; ++i) {
+    if (error_responses[i].status == status) {
+      *length = error_responses[i].length;
+      return error_responses[i].data;
+    }
+  }
+  return NULL;
+}
+
+void log_request(int status, const struct request* request) {
+
+  char time_buffer[time_buffer_size];
+  const size_t time_size = strftime(time_buffer,
+      time_buffer_size, "%FT%T%z", request->time);
+
+  if (time_size == 0) {
+    // TODO: use longjmp back to the main loop rather than quitting
+    // the server
+    fprintf(stderr, "Error formatting time");
+    exit(EXIT_SUCCESS);
+  }
+
+  // Log request in Apache "Combined Log Format"
+  // http://httpd.apache.org/docs/1.3/logs.html
+  // <ip-address> <identd> <user> [<time>] "<request>" <status> <bytes> "<Referer>" "<User-agent>"
+  // 123.65.150.10 - - [23/Aug/2010:03:50:59 +0000] "POST /wordpress3/wp-admin/admin-ajax.php HTTP/1.1" 200 2 "http://www.example.com/wordpress3/wp-admin/post-new.php" "Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_4; en-US) AppleWebKit/534.3 (KHTML, like Gecko) Chrome/6.0.472.25 Safari/534.3"
+  // 127.0.0.1 - frank [10/Oct/2000:13:55:36 -0700] "GET /apache_pb.gif HTTP/1.0" 200 2326 "http://www.example.com/start.html" "Mozilla/4.08 [en] (Win98; I ;Nav)"
+  printf("%s - - [%s] %s %s %d \"%s\"\n",
+      request->client_address,
+      time_buffer,
+      request->method,
+      request->uri,
+      status,
+      request->user_agent);
+}
+
+void remove_query_string(buffer_t **path) {
+  const ssize_t pos = buffer_indexof(*path, "?");
+
+  if (pos == -1) {
+    return;
+  }
+
+  buffer_t *result = buffer_slice(*path, 0, pos);
+  buffer_free(*path);
+  *path = result;
+}
@@ -0,0 +1,70 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "buffer/buffer.h"
+
+enum {
+  time_buffer_size = 100
+};
+
+struct request {
+  const char* uri;
+  const char* user_agent;
+  const char* method;
+  const char* client_address;
+  const struct tm* time;
+};
+
+// The MIME type for `uri`, based on the extension, or NULL if unknown.
+const char* content_type(const char* uri);
+
+// Append a Content-Type header for `uri` to `buffer`, based on the
+// extension. Nothing is appended for unknown extensions.
+void buffer_set_content_type(buffer_t* buffer, const char* uri);
+
+// Build the status line and headers for a 200 response. `rules` are
+// the header lines from rules_headers() for the file.
+buffer_t* response_headers(off_t length, const char* rules, const struct tm *timeinfo, const char* uri);
+
+// Build the status line and headers for a 200 response of a file from a
+// bundle, whose content type (NULL if unknown) and ETag were worked out
+// when it was packed. `gzip` marks a precompressed body.
+buffer_t* packed_response_headers(off_t length, const char* rules,
+    const struct tm *timeinfo, const char* type, const char* etag, int gzip);
+
+// Build the status line and headers for a generated directory listing
+// of `length` bytes, or of a length not known in advance (-1), which is
+// sent in chunks if `chunked` is set, or else ends when the connection
+// is closed.
+buffer_t* listing_response_headers(off_t length, int chunked,
+    const struct tm *timeinfo, const char* type);
+
+// Build a 301 response sending the client to `location`.
+buffer_t* redirect_headers(const struct tm *timeinfo, const char* location);
+
+// Build a 101 response switching to a WebSocket, with the
+// Sec-WebSocket-Accept value for the client's key.
+buffer_t* upgrade_headers(const struct tm *timeinfo, const char* accept);
+
+// Build a 304 response for a file whose ETag the client already has.
+buffer_t* not_modified_headers(const char* rules, const struct tm *timeinfo,
+    const char* etag);
+
+// Build the error responses below. Called once at startup.
+void error_responses_init(void);
+
+// The complete response (status line, headers and body) for an error
+// status, or NULL for a status without one. The Date header is rewritten
+// in place when `now` moves on to a new second, so the bytes are shared
+// and nothing is allocated per response.
+const char* error_response(int status, time_t now, size_t* length);
+
+// Truncate `*path` at the first '?'.
+void remove_query_string(buffer_t **path);
+
+// Write a line for the request to stdout.
+void log_request(int status, const struct request* request);
+
+#endif
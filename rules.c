@@ -0,0 +1,315 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "radix.h"
+#include "rules.h"
+
+struct header {
+  char* name;
+  char* value;
+};
+
+struct rule {
+  char* key;  // the prefix without its '/', or the suffix reversed
+  size_t length;
+  size_t index;  // among the rules of its kind, from 1
+  struct header* headers;
+  size_t count;
+};
+
+struct rule_set {
+  struct rule* rules;
+  size_t count;
+  struct radix tree;
+};
+
+struct rules {
+  struct rule_set prefixes;
+  struct rule_set suffixes;
+
+  // The header lines for a path that matches prefix rule `p` and suffix
+  // rule `s` (0 for none) are blocks[p * (suffixes.count + 1) + s].
+  char** blocks;
+};
+
+static const char default_block[] = "cache-control: public, max-age=31536000\r\n";
+
+// Headers that garcon sets itself, from the file or the connection.
+static const char* const reserved_headers[] = {
+  "Content-Length", "Content-Type", "Content-Encoding", "Transfer-Encoding",
+  "Connection", "Date", "Server", "ETag", "Location", "Vary",
+  "Access-Control-Allow-Origin", "Access-Control-Allow-Methods"
+};
+
+static char* trim(char* text) {
+  while (isspace((unsigned char)*text)) {
+    ++text;
+  }
+  size_t length = strlen(text);
+  while (length > 0 && isspace((unsigned char)text[length - 1])) {
+    text[--length] = '\0';
+  }
+  return text;
+}
+
+static int is_token(const char* text) {
+  if (!*text) {
+    return 0;
+  }
+  for (; *text; ++text) {
+    if (!isalnum((unsigned char)*text) && !strchr("!#$%&'*+-.^_`|~", *text)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Set `name` to `value` in `headers`, replacing a header of that name.
+static int set_header(struct header** headers, size_t* count, const char* name,
+    const char* value) {
+  for (size_t i = 0; i < *count; ++i) {
+    if (strcasecmp((*headers)[i].name, name) == 0) {
+      char* copy_name = strdup(name);
+      char* copy_value = strdup(value);
+      if (!copy_name || !copy_value) {
+        free(copy_name);
+        free(copy_value);
+        return -1;
+      }
+      free((*headers)[i].name);
+      free((*headers)[i].value);
+      (*headers)[i].name = copy_name;
+      (*headers)[i].value = copy_value;
+      return 0;
+    }
+  }
+  struct header* larger = realloc(*headers, (*count + 1) * sizeof(**headers));
+  if (!larger) {
+    return -1;
+  }
+  *headers = larger;
+  larger[*count].name = strdup(name);
+  larger[*count].value = strdup(value);
+  if (!larger[*count].name || !larger[*count].value) {
+    free(larger[*count].name);
+    free(larger[*count].value);
+    return -1;
+  }
+  ++*count;
+  return 0;
+}
+
+static void free_headers(struct header* headers, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    free(headers[i].name);
+    free(headers[i].value);
+  }
+  free(headers);
+}
+
+// The rule for `key`, added if it is new.
+static struct rule* find_rule(struct rule_set* set, const char* key, size_t length) {
+  for (size_t i = 0; i < set->count; ++i) {
+    if (set->rules[i].length == length && memcmp(set->rules[i].key, key, length) == 0) {
+      return &set->rules[i];
+    }
+  }
+  struct rule* larger = realloc(set->rules, (set->count + 1) * sizeof(*set->rules));
+  if (!larger) {
+    return NULL;
+  }
+  set->rules = larger;
+  struct rule* rule = &set->rules[set->count];
+  memset(rule, 0, sizeof(*rule));
+  rule->key = malloc(length + 1);
+  if (!rule->key) {
+    return NULL;
+  }
+  memcpy(rule->key, key, length);
+  rule->key[length] = '\0';
+  rule->length = length;
+  rule->index = ++set->count;
+  return rule;
+}
+
+// Parse one line of the rules file. Returns an error message, or NULL.
+static const char* parse_line(struct rules* rules, char* line) {
+  line = trim(line);
+  if (!*line || *line == '#') {
+    return NULL;
+  }
+  const size_t pattern_length = strcspn(line, " \t");
+  char* header = trim(line + pattern_length);
+  line[pattern_length] = '\0';
+  char* colon = strchr(header, ':');
+  if (!colon) {
+    return "expected a pattern and then a header, as in '/assets/ Cache-Control: max-age=86400'";
+  }
+  *colon = '\0';
+  const char* name = trim(header);
+  const char* value = trim(colon + 1);
+  if (!is_token(name)) {
+    return "the header has no name, or a name with characters not allowed in one";
+  }
+  for (const char* c = value; *c; ++c) {
+    if (iscntrl((unsigned char)*c) && *c != '\t') {
+      return "the header's value has control characters in it";
+    }
+  }
+  for (size_t i = 0; i < sizeof(reserved_headers) / sizeof(reserved_headers[0]); ++i) {
+    if (strcasecmp(name, reserved_headers[i]) == 0) {
+      return "that header is set by garcon itself";
+    }
+  }
+
+  struct rule* rule;
+  if (line[0] == '/') {
+    rule = find_rule(&rules->prefixes, line + 1, pattern_length - 1);
+  } else if (line[0] == '*') {
+    char reversed[PATH_MAX];
+    const size_t length = pattern_length - 1;
+    if (length >= sizeof(reversed)) {
+      return "the pattern is too long";
+    }
+    for (size_t i = 0; i < length; ++i) {
+      reversed[i] = line[pattern_length - 1 - i];
+    }
+    rule = find_rule(&rules->suffixes, reversed, length);
+  } else {
+    return "a pattern starts with '/' for a prefix or '*' for a suffix";
+  }
+  if (!rule || set_header(&rule->headers, &rule->count, name, value) == -1) {
+    return strerror(ENOMEM);
+  }
+  return NULL;
+}
+
+// Apply the rules of `set` whose keys the key of `rule` starts with,
+// shortest first, to `headers`.
+static int apply_rules(const struct rule_set* set, const struct rule* rule,
+    struct header** headers, size_t* count) {
+  if (!rule) {
+    return 0;
+  }
+  for (size_t length = 0; length <= rule->length; ++length) {
+    for (size_t i = 0; i < set->count; ++i) {
+      const struct rule* r = &set->rules[i];
+      if (r->length == length && memcmp(r->key, rule->key, length) == 0) {
+        for (size_t h = 0; h < r->count; ++h) {
+          if (set_header(headers, count, r->headers[h].name, r->headers[h].value) == -1) {
+            return -1;
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static char* build_block(const struct rules* rules, const struct rule* prefix,
+    const struct rule* suffix) {
+  struct header* headers = NULL;
+  size_t count = 0;
+  char* block = NULL;
+  if (set_header(&headers, &count, "cache-control", "public, max-age=31536000") == 0 &&
+      apply_rules(&rules->prefixes, prefix, &headers, &count) == 0 &&
+      apply_rules(&rules->suffixes, suffix, &headers, &count) == 0) {
+    size_t size = 1;
+    for (size_t i = 0; i < count; ++i) {
+      size += strlen(headers[i].name) + strlen(headers[i].value) + 4;
+    }
+    block = malloc(size);
+    if (block) {
+      char* end = block;
+      for (size_t i = 0; i < count; ++i) {
+        end += sprintf(end, "%s: %s\r\n", headers[i].name, headers[i].value);
+      }
+      *end = '\0';
+    }
+  }
+  free_headers(headers, count);
+  return block;
+}
+
+static int compile(struct rule_set* set) {
+  if (radix_init(&set->tree) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < set->count; ++i) {
+    struct rule* rule = &set->rules[i];
+    if (!radix_insert(&set->tree, rule->key, rule->length, rule)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+struct rules* rules_load(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Cannot open rules file %s", path);
+    perror(" ");
+    return NULL;
+  }
+  struct rules* rules = calloc(1, sizeof(*rules));
+  if (!rules) {
+    perror("rules");
+    fclose(file);
+    return NULL;
+  }
+  char line[4096];
+  for (int number = 1; fgets(line, sizeof(line), file); ++number) {
+    const char* error = strchr(line, '\n') || feof(file) ? parse_line(rules, line) :
+      "the line is too long";
+    if (error) {
+      fprintf(stderr, "%s:%d: %s\n", path, number, error);
+      fclose(file);
+      return NULL;
+    }
+  }
+  fclose(file);
+
+  struct rule_set* prefixes = &rules->prefixes;
+  struct rule_set* suffixes = &rules->suffixes;
+  const size_t width = suffixes->count + 1;
+  rules->blocks = calloc((prefixes->count + 1) * width, sizeof(*rules->blocks));
+  if (!rules->blocks || compile(prefixes) == -1 || compile(suffixes) == -1) {
+    perror("rules");
+    return NULL;
+  }
+  for (size_t p = 0; p <= prefixes->count; ++p) {
+    for (size_t s = 0; s < width; ++s) {
+      char* block = build_block(rules, p ? &prefixes->rules[p - 1] : NULL,
+          s ? &suffixes->rules[s - 1] : NULL);
+      if (!block) {
+        perror("rules");
+        return NULL;
+      }
+      rules->blocks[p * width + s] = block;
+    }
+  }
+  return rules;
+}
+
+const char* rules_headers(const struct rules* rules, const char* path, size_t length) {
+  if (!rules) {
+    return default_block;
+  }
+  const struct radix_node* prefix = radix_match(&rules->prefixes.tree, path, length);
+  size_t suffix_index = 0;
+  if (rules->suffixes.count > 0) {
+    char reversed[PATH_MAX];
+    const size_t reversed_length = length < sizeof(reversed) ? length : sizeof(reversed);
+    for (size_t i = 0; i < reversed_length; ++i) {
+      reversed[i] = path[length - 1 - i];
+    }
+    const struct radix_node* suffix = radix_match(&rules->suffixes.tree, reversed, reversed_length);
+    suffix_index = suffix ? ((const struct rule*)suffix->value)->index : 0;
+  }
+  const size_t prefix_index = prefix ? ((const struct rule*)prefix->value)->index : 0;
+  return rules->blocks[prefix_index * (rules->suffixes.count + 1) + suffix_index];
+}
@@ -0,0 +1,40 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stddef.h>
+
+// Headers to send with files, by path, from a rules file (--rules) of
+// lines like these:
+//
+//   # pattern       header
+//   /               Cache-Control: no-cache
+//   /assets/        Cache-Control: public, max-age=31536000, immutable
+//   *.html          Cache-Control: no-cache
+//   /downloads/     Content-Disposition: attachment
+//
+// A pattern starting with '/' matches the paths that start with it, and
+// one starting with '*' the paths that end with the rest of it. Each
+// line adds a header for its pattern, or replaces one that a less
+// specific pattern set: a longer prefix wins over a shorter one, a
+// longer suffix over a shorter one, and a suffix over a prefix. Without
+// a rule, files get a Cache-Control of a year. Each virtual host may
+// have rules of its own. Headers that garcon always sends, such as
+// Content-Type, Vary and the Access-Control-Allow ones, cannot be set
+// by a rule: the file is rejected rather than send them twice.
+//
+// The prefixes and the reversed suffixes are compiled into two tries,
+// and the headers for every pair of patterns are worked out when the
+// rules are loaded, so finding the headers for a path is a walk down
+// each trie to a ready-made block of header lines.
+
+struct rules;
+
+// Load the rules in the file at `path`. Returns NULL after reporting the
+// problem on stderr.
+struct rules* rules_load(const char* path);
+
+// The header lines, each ending in CRLF, for the file at `path` (as made
+// by request_path()), under `rules`, or the default if they are NULL.
+const char* rules_headers(const struct rules* rules, const char* path, size_t length);
+
+#endif
@@ -0,0 +1,91 @@
+#include <sys/resource.h>
+#include "stats.h"
+
+struct stats stats;
+
+static unsigned long milliseconds(struct timeval time) {
+  return time.tv_sec * 1000 + time.tv_usec / 1000;
+}
+
+void stats_print(FILE* out) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  const unsigned long lookups = stats.cache.hits + stats.cache.misses;
+
+  fprintf(out, "{\"connections_accepted\": %lu, "
+      "\"connections_active\": %lu, "
+      "\"connections_shed\": %lu, "
+      "\"accept_fd_exhausted\": %lu, "
+      "\"requests\": %lu, "
+      "\"requests_head\": %lu, "
+      "\"requests_throttled\": %lu, "
+      "\"bytes_sent\": %lu, "
+      "\"cpu\": {\"user_ms\": %lu, \"system_ms\": %lu}, "
+      "\"negative_cache\": {\"hits\": %lu, \"inserts\": %lu, \"invalidations\": %lu}, "
+      "\"cache\": {\"policy\": \"%s\", \"hit_ratio\": %.3f, \"hits\": %lu, \"misses\": %lu, "
+      "\"coalesced\": %lu, \"inserts\": %lu, \"evictions\": %lu, \"rejections\": %lu, "
+      "\"invalidations\": %lu, \"entries\": %lu, \"bytes\": %lu}, "
+      "\"arena\": {\"size\": %zu, \"used\": %zu, \"slabs\": %lu, \"extents\": %lu, "
+      "\"failures\": %lu, \"huge_pages\": \"%s\"}, "
+      "\"zerocopy\": {\"sends\": %lu, \"bytes\": %lu, \"completions\": %lu, \"copied\": %lu}, "
+      "\"listings\": {\"hits\": %lu, \"reads\": %lu, \"streamed\": %lu}, "
+      "\"live_reload\": {\"subscribers\": %lu, \"messages\": %lu, \"dropped\": %lu}, "
+      "\"pacing\": {\"kernel\": %lu, \"userspace\": %lu, \"waits\": %lu}, "
+      "\"timeouts\": {\"header\": %lu, \"idle\": %lu, \"send\": %lu}, "
+      "\"io\": {\"offloaded\": %lu, \"threads\": %lu, \"idle\": %lu, \"queued\": %lu, "
+      "\"completed\": %lu, \"wait_average_us\": %lu, \"wait_max_us\": %lu}}\n",
+      stats.connections_accepted,
+      stats.connections_active,
+      stats.connections_shed,
+      stats.accept_fd_exhausted,
+      stats.requests,
+      stats.requests_head,
+      stats.requests_throttled,
+      stats.bytes_sent,
+      milliseconds(usage.ru_utime),
+      milliseconds(usage.ru_stime),
+      stats.negative_cache_hits,
+      stats.negative_cache_inserts,
+      stats.negative_cache_invalidations,
+      cache_policy_name(stats.cache.policy),
+      lookups ? (double)stats.cache.hits / lookups : 0.0,
+      stats.cache.hits,
+      stats.cache.misses,
+      stats.cache_coalesced,
+      stats.cache.inserts,
+      stats.cache.evictions,
+      stats.cache.rejections,
+      stats.cache.invalidations,
+      stats.cache.entries,
+      stats.cache.bytes,
+      stats.arena.size,
+      stats.arena.used,
+      stats.arena.slabs,
+      stats.arena.extents,
+      stats.arena.failures,
+      arena_huge_pages_name(stats.arena.huge_pages),
+      stats.zerocopy_sends,
+      stats.zerocopy_bytes,
+      stats.zerocopy_completions,
+      stats.zerocopy_copied,
+      stats.listing_hits,
+      stats.listing_reads,
+      stats.listing_streamed,
+      stats.live_reload.subscribers,
+      stats.live_reload.messages,
+      stats.live_reload.dropped,
+      stats.paced_kernel,
+      stats.paced_userspace,
+      stats.pace_waits,
+      stats.timeouts_header,
+      stats.timeouts_idle,
+      stats.timeouts_send,
+      stats.io_offloaded,
+      stats.io_pool.threads,
+      stats.io_pool.idle,
+      stats.io_pool.queued,
+      stats.io_pool.completed,
+      stats.io_pool.wait_average_us,
+      stats.io_pool.wait_max_us);
+  fflush(out);
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "arena.h"
+#include "cache.h"
+#include "hub.h"
+#include "iopool.h"
+
+// Server-wide counters. They are only updated from the event loop's
+// thread, so they are plain integers.
+struct stats {
+  unsigned long connections_accepted;
+  unsigned long connections_active;
+  unsigned long connections_shed;
+  unsigned long accept_fd_exhausted;
+  unsigned long requests;
+  unsigned long requests_head;  // of those, HEAD
+  unsigned long requests_throttled;
+  unsigned long negative_cache_hits;
+  unsigned long negative_cache_inserts;
+  unsigned long negative_cache_invalidations;
+  unsigned long timeouts_header;
+  unsigned long timeouts_idle;
+  unsigned long timeouts_send;
+  unsigned long io_offloaded;
+  struct iopool_metrics io_pool;  // copied from the pool when printed
+  struct cache_metrics cache;     // copied from the cache when printed
+  unsigned long cache_coalesced;  // misses that waited for another's load
+  struct arena_metrics arena;     // copied from the cache's arena when printed
+  unsigned long bytes_sent;
+  unsigned long zerocopy_sends;
+  unsigned long zerocopy_bytes;
+  unsigned long zerocopy_completions;
+  unsigned long zerocopy_copied;
+  unsigned long listing_hits;      // directory listings answered from memory
+  unsigned long listing_reads;     // directories read for a listing
+  unsigned long listing_streamed;  // of those, too large to keep
+  struct hub_metrics live_reload;  // copied from the hub when printed
+  unsigned long paced_kernel;     // connections paced by SO_MAX_PACING_RATE
+  unsigned long paced_userspace;  // connections paced by their own bucket
+  unsigned long pace_waits;       // times a connection waited for a bucket
+};
+
+extern struct stats stats;
+
+// Write the counters, and the CPU time used so far, to `out` as a single
+// line of JSON.
+void stats_print(FILE* out);
+
+#endif
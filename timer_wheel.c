@@ -0,0 +1,173 @@
+#include <limits.h>
+#include "timer_wheel.h"
+
+static const uint64_t max_delta = ((uint64_t)1 << (timer_level_bits * timer_levels)) - 1;
+
+static unsigned slot_index(uint64_t expires, int level) {
+  return (expires >> (level * timer_level_bits)) & (timer_slots - 1);
+}
+
+static void link_timer(struct timer_wheel* wheel, struct timer* timer) {
+  const uint64_t delta = timer->expires - wheel->now;
+
+  int level = 0;
+  while (level < timer_levels - 1 &&
+      delta >> ((level + 1) * timer_level_bits)) {
+    ++level;
+  }
+
+  const unsigned slot = slot_index(timer->expires, level);
+  struct timer** head = &wheel->slots[level][slot];
+  timer->next = *head;
+  if (timer->next) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+  wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+static void unlink_timer(struct timer_wheel* wheel, struct timer* timer) {
+  struct timer** pprev = timer->pprev;
+  *pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+
+  // If that emptied one of the wheel's slots, clear its occupied bit.
+  struct timer** first = &wheel->slots[0][0];
+  if (*pprev == NULL && pprev >= first && pprev < first + timer_levels * timer_slots) {
+    const size_t index = pprev - first;
+    wheel->occupied[index / timer_slots] &= ~((uint64_t)1 << (index % timer_slots));
+  }
+}
+
+// Move the contents of a slot onto a list of its own, so that callbacks
+// can re-arm timers into the same slot while it is being processed.
+static struct timer* detach_slot(struct timer_wheel* wheel, int level, unsigned slot) {
+  struct timer* list = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+  wheel->occupied[level] &= ~((uint64_t)1 << slot);
+  return list;
+}
+
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t now) {
+  wheel->now = now;
+  wheel->count = 0;
+  for (int level = 0; level < timer_levels; ++level) {
+    wheel->occupied[level] = 0;
+    for (int slot = 0; slot < timer_slots; ++slot) {
+      wheel->slots[level][slot] = NULL;
+    }
+  }
+}
+
+void timer_add(struct timer_wheel* wheel, struct timer* timer, uint64_t expires) {
+  if (timer_pending(timer)) {
+    unlink_timer(wheel, timer);
+  } else {
+    wheel->count++;
+  }
+
+  if (expires <= wheel->now) {
+    expires = wheel->now + 1;
+  } else if (expires - wheel->now > max_delta) {
+    expires = wheel->now + max_delta;
+  }
+  timer->expires = expires;
+  link_timer(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel* wheel, struct timer* timer) {
+  if (!timer_pending(timer)) {
+    return;
+  }
+  unlink_timer(wheel, timer);
+  wheel->count--;
+}
+
+// The first tick after `now` at which slot `slot` of `level` comes
+// round again.
+static uint64_t slot_tick(uint64_t now, int level, unsigned slot) {
+  const int shift = level * timer_level_bits;
+  const uint64_t position = now >> shift;
+  uint64_t tick = (position & ~(uint64_t)(timer_slots - 1)) + slot;
+  if (tick <= position) {
+    tick += timer_slots;
+  }
+  return tick << shift;
+}
+
+// The next tick at which a timer fires or a slot must be cascaded.
+static uint64_t next_tick(const struct timer_wheel* wheel) {
+  uint64_t next = UINT64_MAX;
+  for (int level = 0; level < timer_levels; ++level) {
+    const uint64_t occupied = wheel->occupied[level];
+    if (!occupied) {
+      continue;
+    }
+    // Slots after the current position come round first, then the
+    // ones before it on the next rotation.
+    const unsigned position = slot_index(wheel->now, level);
+    const uint64_t ahead = position == timer_slots - 1
+      ? 0
+      : occupied & (~(uint64_t)0 << (position + 1));
+    const unsigned slot = __builtin_ctzll(ahead ? ahead : occupied);
+    const uint64_t tick = slot_tick(wheel->now, level, slot);
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+void timer_wheel_advance(struct timer_wheel* wheel, uint64_t now) {
+  while (wheel->now < now) {
+    const uint64_t tick = wheel->count ? next_tick(wheel) : UINT64_MAX;
+    if (tick > now) {
+      wheel->now = now;
+      return;
+    }
+    wheel->now = tick;
+
+    // Cascade every level whose position rolled over at this tick,
+    // highest first, so that timers can fall straight through to the
+    // level 0 slot that is about to fire.
+    for (int level = timer_levels - 1; level > 0; --level) {
+      const uint64_t mask = ((uint64_t)1 << (level * timer_level_bits)) - 1;
+      if (tick & mask) {
+        continue;
+      }
+      struct timer* list = detach_slot(wheel, level, slot_index(tick, level));
+      while (list) {
+        struct timer* timer = list;
+        list = timer->next;
+        link_timer(wheel, timer);
+      }
+    }
+
+    struct timer* list = detach_slot(wheel, 0, slot_index(tick, 0));
+    if (list) {
+      list->pprev = &list;
+    }
+    while (list) {
+      struct timer* timer = list;
+      unlink_timer(wheel, timer);
+      wheel->count--;
+      timer->callback(timer);
+    }
+  }
+}
+
+int timer_wheel_timeout(const struct timer_wheel* wheel, uint64_t now) {
+  if (wheel->count == 0) {
+    return -1;
+  }
+  const uint64_t tick = next_tick(wheel);
+  if (tick <= now) {
+    return 0;
+  }
+  return tick - now > INT_MAX ? INT_MAX : (int)(tick - now);
+}
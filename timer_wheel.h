@@ -0,0 +1,52 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A hierarchical timing wheel. Times are in milliseconds, and a timer
+// fires on the first call to timer_wheel_advance() at or after its
+// expiry. Adding, re-arming and cancelling a timer are O(1), and each
+// timer is moved between levels at most timer_levels - 1 times before
+// it fires, so large numbers of pending timers cost almost nothing.
+
+enum {
+  timer_level_bits = 6,
+  timer_slots = 1 << timer_level_bits,
+  timer_levels = 4
+};
+
+struct timer {
+  struct timer* next;
+  struct timer** pprev;  // NULL when the timer is not pending
+  uint64_t expires;
+  void (*callback)(struct timer* timer);
+};
+
+struct timer_wheel {
+  uint64_t now;
+  size_t count;
+  uint64_t occupied[timer_levels];  // bit per non-empty slot
+  struct timer* slots[timer_levels][timer_slots];
+};
+
+void timer_wheel_init(struct timer_wheel* wheel, uint64_t now);
+
+// Schedule `timer` to fire at `expires`, replacing any earlier schedule.
+// Deadlines beyond the range of the wheel (about 4.6 hours) are clamped.
+void timer_add(struct timer_wheel* wheel, struct timer* timer, uint64_t expires);
+
+void timer_cancel(struct timer_wheel* wheel, struct timer* timer);
+
+static inline int timer_pending(const struct timer* timer) {
+  return timer->pprev != NULL;
+}
+
+// Fire every timer that has expired by `now`.
+void timer_wheel_advance(struct timer_wheel* wheel, uint64_t now);
+
+// Milliseconds until the wheel next needs advancing, or -1 when no
+// timers are pending. Suitable as a poll/epoll timeout.
+int timer_wheel_timeout(const struct timer_wheel* wheel, uint64_t now);
+
+#endif
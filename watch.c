@@ -0,0 +1,315 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hash.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "watch.h"
+
+enum {
+  max_listeners = 4
+};
+
+static watch_listener listeners[max_listeners];
+static int listener_count;
+
+int watch_subscribe(watch_listener listener) {
+  if (listener_count == max_listeners) {
+    return -1;
+  }
+  listeners[listener_count++] = listener;
+  return 0;
+}
+
+static void notify(enum watch_kind kind, const char* directory, const char* name) {
+  struct watch_event event;
+  event.kind = kind;
+  event.directory = directory;
+  event.name = name;
+  for (int i = 0; i < listener_count; ++i) {
+    listeners[i](&event);
+  }
+}
+
+#ifdef __linux__
+
+// IN_MODIFY as well as IN_CLOSE_WRITE, so that a file written by a
+// writer that keeps it open, or through a shared mapping, is reported.
+static const unsigned watch_mask = IN_CREATE | IN_MOVED_TO | IN_DELETE |
+  IN_MOVED_FROM | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF |
+  IN_MOVE_SELF | IN_ONLYDIR;
+
+static int inotify_fd = -1;
+static char* root_path;
+
+struct mount {
+  char* prefix;
+  size_t length;
+  char* path;
+};
+
+// There are as many mounts as virtual hosts, a few dozen at most, so they
+// are looked through in turn.
+static struct mount* mounts;
+static size_t mount_count;
+
+// Watch descriptors are small integers handed out in order, so the
+// directory each one refers to is kept in an array indexed by them. A
+// directory can be reached by more than one name, such as through a
+// virtual host's root and the main root, and the kernel hands out one
+// descriptor for it, so each has a list of the names it was added by.
+struct name {
+  struct name* next;
+  size_t length;
+  char directory[];
+};
+
+static struct name** directories;
+static int directory_count;
+
+// Every name is also kept in an open-addressing table with linear
+// probing, under half full, so that watching a directory again is a hash
+// and a probe or two, without a system call.
+static struct name** names;
+static size_t name_mask;
+static size_t name_count;
+static uint64_t name_key[2];
+
+static size_t find_slot(const char* directory, size_t length) {
+  size_t slot = siphash(directory, length, name_key) & name_mask;
+  while (names[slot] && !(names[slot]->length == length &&
+        memcmp(names[slot]->directory, directory, length) == 0)) {
+    slot = (slot + 1) & name_mask;
+  }
+  return slot;
+}
+
+static int remember(struct name* name) {
+  if (name_count + 1 > (name_mask + 1) / 2) {
+    const size_t old_capacity = names ? name_mask + 1 : 0;
+    const size_t capacity = names ? old_capacity * 2 : 256;
+    struct name** old = names;
+    names = calloc(capacity, sizeof(*names));
+    if (!names) {
+      names = old;
+      return -1;
+    }
+    name_mask = capacity - 1;
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old[i]) {
+        names[find_slot(old[i]->directory, old[i]->length)] = old[i];
+      }
+    }
+    free(old);
+  }
+  names[find_slot(name->directory, name->length)] = name;
+  name_count++;
+  return 0;
+}
+
+// Take `name` out of the table, if it is the one there, moving back the
+// names after it that would otherwise no longer be found.
+static void forget(const struct name* name) {
+  size_t slot = find_slot(name->directory, name->length);
+  if (names[slot] != name) {
+    return;
+  }
+  names[slot] = NULL;
+  name_count--;
+  for (size_t next = (slot + 1) & name_mask; names[next]; next = (next + 1) & name_mask) {
+    const size_t home = siphash(names[next]->directory, names[next]->length, name_key) & name_mask;
+    // Move it into the hole unless its home lies after the hole, up to it.
+    if (((next - home) & name_mask) >= ((next - slot) & name_mask)) {
+      names[slot] = names[next];
+      names[next] = NULL;
+      slot = next;
+    }
+  }
+}
+
+int watch_init(const char* root) {
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    return -1;
+  }
+  root_path = strdup(root);
+  hash_random_key(name_key, 2);
+  return inotify_fd;
+}
+
+int watch_mount(const char* prefix, const char* path) {
+  struct mount* grown = realloc(mounts, (mount_count + 1) * sizeof(*mounts));
+  if (!grown) {
+    return -1;
+  }
+  mounts = grown;
+  struct mount* mount = &mounts[mount_count];
+  mount->prefix = strdup(prefix);
+  mount->length = strlen(prefix);
+  mount->path = strdup(path);
+  if (!mount->prefix || !mount->path) {
+    free(mount->prefix);
+    free(mount->path);
+    return -1;
+  }
+  mount_count++;
+  return 0;
+}
+
+int watch_add(const char* directory) {
+  if (inotify_fd == -1) {
+    errno = ENOSYS;
+    return -1;
+  }
+  const size_t directory_length = strlen(directory);
+  if (name_count > 0 && names[find_slot(directory, directory_length)]) {
+    return 0;
+  }
+
+  const char* base = root_path;
+  const char* rest = directory;
+  for (size_t i = 0; i < mount_count; ++i) {
+    const struct mount* mount = &mounts[i];
+    if (strncmp(directory, mount->prefix, mount->length) == 0 &&
+        (directory[mount->length] == '\0' || directory[mount->length] == '/')) {
+      base = mount->path;
+      rest = directory + mount->length;
+      rest += *rest == '/';
+      break;
+    }
+  }
+  const size_t base_length = strlen(base);
+  const size_t length = strlen(rest);
+  char* path = malloc(base_length + length + 2);
+  if (!path) {
+    return -1;
+  }
+  memcpy(path, base, base_length);
+  path[base_length] = '/';
+  memcpy(path + base_length + 1, rest, length + 1);
+  const int wd = inotify_add_watch(inotify_fd, path, watch_mask);
+  free(path);
+  if (wd == -1) {
+    return -1;
+  }
+
+  if (wd >= directory_count) {
+    int count = directory_count ? directory_count : 64;
+    while (count <= wd) {
+      count *= 2;
+    }
+    struct name** grown = realloc(directories, count * sizeof(*directories));
+    if (!grown) {
+      inotify_rm_watch(inotify_fd, wd);
+      return -1;
+    }
+    memset(grown + directory_count, 0, (count - directory_count) * sizeof(*directories));
+    directories = grown;
+    directory_count = count;
+  }
+  struct name* name = malloc(sizeof(*name) + directory_length + 1);
+  if (!name) {
+    return -1;
+  }
+  name->length = directory_length;
+  memcpy(name->directory, directory, directory_length + 1);
+  if (remember(name) == -1) {
+    free(name);
+    return -1;
+  }
+  name->next = directories[wd];
+  directories[wd] = name;
+  return 0;
+}
+
+void watch_dispatch(void) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    const ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+      return;
+    }
+
+    const struct inotify_event* previous = NULL;
+    for (char* p = buffer; p < buffer + length; ) {
+      const struct inotify_event* event = (const struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      // Each write() is an IN_MODIFY; one report for a run of them is
+      // enough.
+      const int repeat = previous && (event->mask & IN_MODIFY) &&
+        previous->mask == event->mask && previous->wd == event->wd &&
+        previous->len == event->len &&
+        (event->len == 0 || strcmp(previous->name, event->name) == 0);
+      previous = event;
+      if (repeat) {
+        continue;
+      }
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        notify(WATCH_OVERFLOW, "", "");
+        continue;
+      }
+      if (event->wd < 0 || event->wd >= directory_count || !directories[event->wd]) {
+        continue;
+      }
+
+      const char* name = event->len ? event->name : "";
+      if (event->mask & IN_IGNORED) {
+        while (directories[event->wd]) {
+          struct name* next = directories[event->wd]->next;
+          forget(directories[event->wd]);
+          free(directories[event->wd]);
+          directories[event->wd] = next;
+        }
+        continue;
+      }
+      for (const struct name* watched = directories[event->wd]; watched; watched = watched->next) {
+        const char* directory = watched->directory;
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          notify(WATCH_CREATED, directory, name);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)) {
+          notify(WATCH_REMOVED, directory, name);
+        } else if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)) {
+          notify(WATCH_MODIFIED, directory, name);
+        }
+      }
+      if (event->mask & IN_MOVE_SELF) {
+        // The watch follows the directory to where it was moved, so its
+        // names no longer lead to it. Let them be watched afresh.
+        for (const struct name* watched = directories[event->wd]; watched; watched = watched->next) {
+          forget(watched);
+        }
+        inotify_rm_watch(inotify_fd, event->wd);
+      }
+    }
+  }
+}
+
+#else
+
+int watch_init(const char* root) {
+  (void)root;
+  return -1;
+}
+
+int watch_mount(const char* prefix, const char* path) {
+  (void)prefix;
+  (void)path;
+  return 0;
+}
+
+int watch_add(const char* directory) {
+  (void)directory;
+  errno = ENOSYS;
+  return -1;
+}
+
+void watch_dispatch(void) {
+  (void)notify;
+}
+
+#endif
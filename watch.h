@@ -0,0 +1,43 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// Change notification for directories under the document root, using
+// inotify on Linux. Elsewhere watch_init() fails and nothing is
+// reported, so users of this module must also expire what they cache.
+
+enum watch_kind {
+  WATCH_CREATED,   // `name` was created in, or moved into, `directory`
+  WATCH_REMOVED,   // `name` was deleted or moved away; "" for the directory itself
+  WATCH_MODIFIED,  // `name` was written or its attributes changed
+  WATCH_OVERFLOW   // events were lost; assume anything could have changed
+};
+
+struct watch_event {
+  enum watch_kind kind;
+  const char* directory;  // relative to the root, "" for the root itself
+  const char* name;
+};
+
+typedef void (*watch_listener)(const struct watch_event* event);
+
+// Start watching beneath `root`. Returns a descriptor that becomes
+// readable when there are events, or -1 if notification is unavailable.
+int watch_init(const char* root);
+
+// Find `prefix` and the directories beneath it ("prefix/...") at `path`
+// instead of under the root, as for the document root of a virtual host.
+// Returns -1 if out of memory.
+int watch_mount(const char* prefix, const char* path);
+
+// Watch `directory`, relative to the root. Watching the same directory
+// again is cheap. Returns 0, or -1 with errno set.
+int watch_add(const char* directory);
+
+// Call `listener` for every event. Returns -1 if there are already too
+// many listeners.
+int watch_subscribe(watch_listener listener);
+
+// Read the pending events and pass them to the listeners.
+void watch_dispatch(void);
+
+#endif